@@ -59,10 +59,13 @@ def get_source_list(project)
 
   if Platform.is_linux?
     src.push 'src/linux/platform.c',
+             'src/linux/proc.c',
              'src/linux/read.c',
              'src/linux/write.c',
              'src/linux/user.c',
-             'src/linux/vnode.c'
+             'src/linux/vnode.c',
+             'src/linux/uring.c',
+             'src/linux/aio.c'
 
     # FIXME: needed for RHEL5
     #src.push 'src/posix/user.c'
@@ -129,7 +132,11 @@ if Platform.is_linux?
 
   project.check_header('sys/epoll.h') or throw 'epoll is required'
   project.check_header('sys/inotify.h') or throw 'inotify is required'
-  project.check_header %w{ sys/signalfd.h sys/timerfd.h sys/eventfd.h }
+  project.check_header %w{ sys/signalfd.h sys/timerfd.h sys/eventfd.h linux/io_uring.h }
+  project.check_decl 'IORING_FEAT_EXT_ARG', :include => 'linux/io_uring.h'
+  project.check_decl 'IORING_ENTER_EXT_ARG', :include => 'linux/io_uring.h'
+  project.check_decl 'IORING_OP_EPOLL_CTL', :include => 'linux/io_uring.h'
+  project.check_decl 'IORING_OP_URING_CMD', :include => 'linux/io_uring.h'
 end
 
 project.add(kq)
@@ -176,6 +183,7 @@ else
           test/timer.c
           test/vnode.c
           test/user.c
+          test/aio.c
           },
       :ldadd => test_ldadd.split(' ')
       )
@@ -238,13 +246,17 @@ pre_configure_hook() {
   if [ $target = "linux" ] ; then
 
       check_symbol sys/epoll.h EPOLLRDHUP
+      check_symbol linux/io_uring.h IORING_FEAT_EXT_ARG
+      check_symbol linux/io_uring.h IORING_ENTER_EXT_ARG
+      check_symbol linux/io_uring.h IORING_OP_EPOLL_CTL
+      check_symbol linux/io_uring.h IORING_OP_URING_CMD
 
       # TODO - note this as a GCC 4.X dependency
       cflags="$cflags -fvisibility=hidden"
 
       libdepends="$libdepends -lpthread -lrt"
       required_headers="sys/epoll.h sys/inotify.h"
-      optional_headers="sys/signalfd.h sys/timerfd.h sys/eventfd.h"
+      optional_headers="sys/signalfd.h sys/timerfd.h sys/eventfd.h linux/io_uring.h"
   fi
 
   if [ $target = "solaris" ] ; then
@@ -269,16 +281,13 @@ post_configure_hook() {
       evfilt_user="src/linux/user.c"
       evfilt_socket="src/linux/read.c src/linux/write.c"
 
-       #XXX-FIXME disabled
-       evfilt_proc=""
-
       if [ "$have_sys_signalfd_h" = "yes" ] ; then
           evfilt_signal="src/linux/signal.c"
       fi
       if [ "$have_sys_timerfd_h" = "yes" ] ; then
           evfilt_timer="src/linux/timer.c"
       fi
-      platform="$platform src/linux/platform.c"
+      platform="$platform src/linux/platform.c src/linux/uring.c src/linux/aio.c"
     fi      
 
     if [ $target = "solaris" ] ; then
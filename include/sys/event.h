@@ -120,7 +120,9 @@ struct kevent {
  * data/hint flags for EVFILT_{READ|WRITE}
  */
 #define NOTE_LOWAT	0x0001			/* low water mark */
-#undef  NOTE_LOWAT                  /* Not supported on Linux */
+#define NOTE_NODATA	0x00010000		/* data is not wanted (libkqueue) */
+#define NOTE_ACCEPT	0x00020000		/* accept connections (libkqueue) */
+#define NOTE_ACCEPT_READ 0x00040000		/* and add read knotes for them */
 
 /*
  * data/hint flags for EVFILT_VNODE
@@ -198,6 +200,11 @@ kevent(int kq, const struct kevent *changelist, int nchanges,
 	    struct kevent *eventlist, int nevents,
 	    const struct timespec *timeout);
 
+__declspec(dllexport) int
+kevent_batch(int kq, const struct kevent *changelist, int nchanges,
+	    struct kevent *eventlist, int nevents, int nmin,
+	    const struct timespec *timeout, const struct timespec *latency);
+
 #ifdef MAKE_STATIC
 __declspec(dllexport) int
 libkqueue_init();
@@ -213,6 +220,58 @@ int     libkqueue_init();
 #endif
 #endif
 
+/*
+ * libkqueue extension: like kevent(), but once an event is ready, keep
+ * waiting until <nmin> events are ready or <latency> has passed since the
+ * call, whichever comes first. The timeout still bounds the whole call.
+ * A knote is reported at most once per call; since a level-triggered knote
+ * is ready again right away, reporting one again ends the batch.
+ */
+#define HAVE_KEVENT_BATCH 1
+#ifndef _WIN32
+int     kevent_batch(int kq, const struct kevent *changelist, int nchanges,
+	    struct kevent *eventlist, int nevents, int nmin,
+	    const struct timespec *timeout, const struct timespec *latency);
+#endif
+
+/*
+ * libkqueue extension: busy polling. kevent() on the kqueue spins for up
+ * to <usecs> microseconds before it blocks, and asks the kernel to busy
+ * poll the network devices where it can. The spin shrinks while it keeps
+ * missing events and grows back while it finds them. Zero turns it off.
+ */
+#define HAVE_KQUEUE_BUSY_POLL 1
+
+struct kqueue_stats {
+    uint64_t ks_waits;          /* Calls that looked for events */
+    uint64_t ks_spin_hits;      /* Spins that found events */
+    uint64_t ks_spin_misses;    /* Spins that ended in a blocking wait */
+    uint64_t ks_spin_nsecs;     /* Time spent spinning */
+    uint64_t ks_futile_wakeups; /* Waits that ended with nothing to return */
+    uint64_t ks_ctl_calls;      /* Changes to the set of watched descriptors */
+};
+
+/*
+ * libkqueue extension: batched queue sizes. kevent() on the kqueue fetches
+ * the data of all the sockets that it returns with one system call, where
+ * the kernel can do that, instead of an ioctl(2) for each of them.
+ */
+#define HAVE_KQUEUE_BATCH_DATA 1
+
+/*
+ * libkqueue extension: exclusive wakeups. Only one of the threads that
+ * block in kevent() on the kqueue waits for events at a time; the others
+ * take over in turn, so a ready event wakes a single thread.
+ */
+#define HAVE_KQUEUE_EXCLUSIVE 1
+
+#ifndef _WIN32
+int     kqueue_batch_data(int kq, int enable);
+int     kqueue_busy_poll(int kq, unsigned int usecs);
+int     kqueue_exclusive(int kq, int enable);
+int     kqueue_stats(int kq, struct kqueue_stats *stats);
+#endif
+
 #ifdef  __cplusplus
 }
 #endif
@@ -16,69 +16,325 @@
 
 
 /*
- * A simple fixed-size memory allocator.
+ * A slab allocator for fixed-size objects.
  *
- * Each translation unit in a program can include this header and
- * have access to it's own private memory allocator. This can be useful
- * for improving the performance of programs which frequently allocate 
- * and deallocate objects with a fixed size.
+ * Objects are carved out of large slabs which belong to an arena, and
+ * objects released with mem_free() go onto the arena's free list. Since
+ * the arena owns every slab, mem_arena_free() releases all of its objects
+ * at once, including those which were never passed to mem_free().
  *
- * The allocator must be initialized by calling mem_init(). This
- * function takes two arguments: the object size, and the maximum
- * number of objects in the cache.
- *
- * The functions mem_alloc() and mem_free() have similar semantics
- * to the traditional malloc() and free() calls. The main difference
- * is that mem_alloc() does not allow you to specify a specific size.
+ * Each thread keeps a small magazine of free objects in front of the arena
+ * it used last, so that a thread which allocates and frees from the same
+ * arena does not take the arena lock. A magazine holds a reference on its
+ * arena; when the arena has been destroyed, the magazine discards its
+ * objects instead of returning them.
  *
+ * Each translation unit that includes this header has its own private
+ * set of magazines. mem_init() must be called once before any arena is
+ * created.
  */
 
 #include <stdlib.h>
+#include <string.h>
 
 #ifndef _WIN32
 # include <unistd.h>
+# include <pthread.h>
+#endif
+#if defined(__linux__)
+# include <sys/mman.h>
 #endif
 
+#define MEM_ARENA_HUGEPAGES 0x01        /* Back slabs with huge pages */
+
+#define MEM_SLAB_SIZE       (64 * 1024)
+#define MEM_SLAB_SIZE_HUGE  (2 * 1024 * 1024)
+#define MEM_ALIGN           16
+#define MEM_MAGAZINE_SIZE   32          /* Objects cached per thread */
+#define MEM_MAGAZINE_BATCH  (MEM_MAGAZINE_SIZE / 2)
+
+struct mem_slab {
+    struct mem_slab *ms_next;
+    size_t           ms_len;
+    int              ms_mapped;     /* Allocated with mmap(2) */
+};
+
+struct mem_arena {
+    pthread_mutex_t  ma_mtx;
+    size_t           ma_objsize;    /* Object size, rounded up to MEM_ALIGN */
+    size_t           ma_slabsize;
+    int              ma_flags;
+    struct mem_slab *ma_slabs;      /* Every slab owned by the arena */
+    char            *ma_cur;        /* Next object not yet carved from a slab */
+    char            *ma_end;
+    void            *ma_free;       /* Free list, linked through each object */
+    volatile uint32_t ma_ref;       /* One for the owner, one per magazine */
+    int              ma_dead;       /* Set by mem_arena_free() */
+};
+
 static __thread struct {
-    void  **ac_cache;       /* An array of reusable memory objects */
-    size_t  ac_count;       /* The number of objects in the cache */
-    size_t  ac_max;         /* The maximum number of cached objects */
-    size_t  ac_size;        /* The size, in bytes, of each object */
-} _ma;
+    struct mem_arena *mg_arena;     /* Arena the cached objects belong to */
+    size_t  mg_count;               /* The number of objects in the cache */
+    void   *mg_cache[MEM_MAGAZINE_SIZE];
+} _mag;
+
+#ifndef _WIN32
+static pthread_key_t  _mag_key;
+static pthread_once_t _mag_once = PTHREAD_ONCE_INIT;
+#endif
+
+static inline void
+mem_arena_release(struct mem_arena *arena)
+{
+    if (atomic_dec(&arena->ma_ref) == 0) {
+        pthread_mutex_destroy(&arena->ma_mtx);
+        free(arena);
+    }
+}
+
+/* Move up to <count> objects from the magazine to its arena; needs ma_mtx */
+static inline void
+mem_magazine_return(struct mem_arena *arena, size_t count)
+{
+    void *p;
+
+    while (count-- > 0 && _mag.mg_count > 0) {
+        p = _mag.mg_cache[--_mag.mg_count];
+        *((void **) p) = arena->ma_free;
+        arena->ma_free = p;
+    }
+}
+
+/* Empty the magazine and detach it from its arena */
+static inline void
+mem_magazine_flush(void)
+{
+    struct mem_arena *arena = _mag.mg_arena;
+
+    if (arena == NULL)
+        return;
+
+    pthread_mutex_lock(&arena->ma_mtx);
+    if (!arena->ma_dead)
+        mem_magazine_return(arena, _mag.mg_count);
+    pthread_mutex_unlock(&arena->ma_mtx);
+
+    _mag.mg_count = 0;
+    _mag.mg_arena = NULL;
+    mem_arena_release(arena);
+}
+
+#ifndef _WIN32
+static void
+mem_magazine_destructor(void *arg)
+{
+    (void) arg;
+    mem_magazine_flush();
+}
+
+static void
+mem_magazine_key_init(void)
+{
+    (void) pthread_key_create(&_mag_key, mem_magazine_destructor);
+}
+#endif
+
+/* Point the calling thread's magazine at <arena> */
+static inline void
+mem_magazine_bind(struct mem_arena *arena)
+{
+    mem_magazine_flush();
+    atomic_inc(&arena->ma_ref);
+    _mag.mg_arena = arena;
+#ifndef _WIN32
+    /* Flush the magazine when the thread exits */
+    (void) pthread_setspecific(_mag_key, &_mag);
+#endif
+}
+
+static inline int
+mem_init(void)
+{
+#ifndef _WIN32
+    if (pthread_once(&_mag_once, mem_magazine_key_init) != 0)
+        return (-1);
+#endif
+    return (0);
+}
+
+static inline void *
+mem_slab_map(size_t len, int flags, int *mapped)
+{
+#if defined(__linux__)
+    void *p;
+
+    if (flags & MEM_ARENA_HUGEPAGES) {
+# ifdef MAP_HUGETLB
+        p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            *mapped = 1;
+            return (p);
+        }
+# endif
+        /* No reserved huge pages; ask for transparent ones instead */
+        p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p != MAP_FAILED) {
+# ifdef MADV_HUGEPAGE
+            (void) madvise(p, len, MADV_HUGEPAGE);
+# endif
+            *mapped = 1;
+            return (p);
+        }
+    }
+#else
+    (void) flags;
+#endif
+    *mapped = 0;
+    return (malloc(len));
+}
 
+static inline void
+mem_slab_unmap(struct mem_slab *slab)
+{
+#if defined(__linux__)
+    if (slab->ms_mapped) {
+        (void) munmap(slab, slab->ms_len);
+        return;
+    }
+#endif
+    free(slab);
+}
+
+/* Add a new slab to the arena; needs ma_mtx */
 static inline int
-mem_init(size_t objsize, size_t cachesize)
+mem_arena_grow(struct mem_arena *arena)
+{
+    struct mem_slab *slab;
+    int mapped;
+
+    slab = mem_slab_map(arena->ma_slabsize, arena->ma_flags, &mapped);
+    if (slab == NULL)
+        return (-1);
+    slab->ms_len = arena->ma_slabsize;
+    slab->ms_mapped = mapped;
+    slab->ms_next = arena->ma_slabs;
+    arena->ma_slabs = slab;
+
+    arena->ma_cur = (char *) slab +
+        ((sizeof(*slab) + MEM_ALIGN - 1) & ~(size_t) (MEM_ALIGN - 1));
+    arena->ma_end = (char *) slab + slab->ms_len;
+    return (0);
+}
+
+/* Take one object from the arena; needs ma_mtx */
+static inline void *
+mem_arena_get(struct mem_arena *arena)
 {
-    _ma.ac_size = objsize;
-    _ma.ac_cache = malloc(cachesize * sizeof(void *));
-    return (_ma.ac_cache == NULL ? -1 : 0);
+    void *p;
+
+    if (arena->ma_free != NULL) {
+        p = arena->ma_free;
+        arena->ma_free = *((void **) p);
+        return (p);
+    }
+    if (arena->ma_cur + arena->ma_objsize > arena->ma_end
+            && mem_arena_grow(arena) < 0)
+        return (NULL);
+    p = arena->ma_cur;
+    arena->ma_cur += arena->ma_objsize;
+    return (p);
+}
+
+static inline struct mem_arena *
+mem_arena_new(size_t objsize, int flags)
+{
+    struct mem_arena *arena;
+
+    arena = calloc(1, sizeof(*arena));
+    if (arena == NULL)
+        return (NULL);
+    pthread_mutex_init(&arena->ma_mtx, NULL);
+    arena->ma_objsize = (objsize + MEM_ALIGN - 1) & ~(size_t) (MEM_ALIGN - 1);
+    arena->ma_flags = flags;
+    arena->ma_slabsize = (flags & MEM_ARENA_HUGEPAGES) ?
+        MEM_SLAB_SIZE_HUGE : MEM_SLAB_SIZE;
+    arena->ma_ref = 1;
+    return (arena);
+}
+
+/* Release every object in the arena, whether or not it is still in use */
+static inline void
+mem_arena_free(struct mem_arena *arena)
+{
+    struct mem_slab *slab;
+
+    if (_mag.mg_arena == arena)
+        mem_magazine_flush();
+
+    pthread_mutex_lock(&arena->ma_mtx);
+    arena->ma_dead = 1;
+    while ((slab = arena->ma_slabs) != NULL) {
+        arena->ma_slabs = slab->ms_next;
+        mem_slab_unmap(slab);
+    }
+    arena->ma_free = NULL;
+    arena->ma_cur = arena->ma_end = NULL;
+    pthread_mutex_unlock(&arena->ma_mtx);
+
+    mem_arena_release(arena);
 }
 
 static inline void *
-mem_alloc(void)
+mem_alloc(struct mem_arena *arena)
 {
-    if (_ma.ac_count > 0) 
-        return (_ma.ac_cache[_ma.ac_count--]);
-    else 
-        return (malloc(_ma.ac_size));
+    void *p;
+
+    if (_mag.mg_arena == arena && _mag.mg_count > 0)
+        return (_mag.mg_cache[--_mag.mg_count]);
+
+    if (_mag.mg_arena != arena)
+        mem_magazine_bind(arena);
+
+    /* Refill the magazine, keeping the last object for the caller */
+    pthread_mutex_lock(&arena->ma_mtx);
+    while (_mag.mg_count < MEM_MAGAZINE_BATCH) {
+        if ((p = mem_arena_get(arena)) == NULL)
+            break;
+        _mag.mg_cache[_mag.mg_count++] = p;
+    }
+    pthread_mutex_unlock(&arena->ma_mtx);
+
+    if (_mag.mg_count == 0)
+        return (NULL);
+    return (_mag.mg_cache[--_mag.mg_count]);
 }
 
 static inline void *
-mem_calloc(void)
+mem_calloc(struct mem_arena *arena)
 {
     void *p;
 
-    p = mem_alloc();
+    p = mem_alloc(arena);
     if (p != NULL)
-        memset(p, 0, _ma.ac_size);
+        memset(p, 0, arena->ma_objsize);
     return (p);
 }
 
 static inline void
-mem_free(void *ptr)
+mem_free(struct mem_arena *arena, void *ptr)
 {
-    if (_ma.ac_count < _ma.ac_max)
-        _ma.ac_cache[_ma.ac_count++] = ptr;
-    else 
-        free(ptr);
+    if (_mag.mg_arena != arena)
+        mem_magazine_bind(arena);
+
+    if (_mag.mg_count == MEM_MAGAZINE_SIZE) {
+        pthread_mutex_lock(&arena->ma_mtx);
+        if (arena->ma_dead)
+            _mag.mg_count -= MEM_MAGAZINE_BATCH;   /* The slabs are gone */
+        else
+            mem_magazine_return(arena, MEM_MAGAZINE_BATCH);
+        pthread_mutex_unlock(&arena->ma_mtx);
+    }
+    _mag.mg_cache[_mag.mg_count++] = ptr;
 }
@@ -25,6 +25,7 @@
 
 extern const struct filter evfilt_read;
 extern const struct filter evfilt_write;
+extern const struct filter evfilt_aio;
 extern const struct filter evfilt_signal;
 extern const struct filter evfilt_vnode;
 extern const struct filter evfilt_proc;
@@ -45,8 +46,8 @@ filter_register(struct kqueue *kq, short filter, const struct filter *src)
     dst = &kq->kq_filt[filt];
     memcpy(dst, src, sizeof(*src));
     dst->kf_kqueue = kq;
-    RB_INIT(&dst->kf_knote);
-    pthread_rwlock_init(&dst->kf_knote_mtx, NULL);
+    pthread_mutex_init(&dst->kf_knote_mtx, NULL);
+    tracing_mutex_init(&dst->kf_mtx, NULL);
     if (src->kf_id == 0) {
         dbg_puts("filter is not implemented");
         return (0);
@@ -81,8 +82,8 @@ filter_register(struct kqueue *kq, short filter, const struct filter *src)
 #endif
 
 	/* FIXME: should totally remove const from src */
-	if (kqops.filter_init != NULL
-            && kqops.filter_init(kq, dst) < 0)
+	if (kq->kq_ops->filter_init != NULL
+            && kq->kq_ops->filter_init(kq, dst) < 0)
 		return (-1);
 
     return (0);
@@ -97,6 +98,7 @@ filter_register_all(struct kqueue *kq)
     rv = 0;
     rv += filter_register(kq, EVFILT_READ, &evfilt_read);
     rv += filter_register(kq, EVFILT_WRITE, &evfilt_write);
+    rv += filter_register(kq, EVFILT_AIO, &evfilt_aio);
     rv += filter_register(kq, EVFILT_SIGNAL, &evfilt_signal);
     rv += filter_register(kq, EVFILT_VNODE, &evfilt_vnode);
     rv += filter_register(kq, EVFILT_PROC, &evfilt_proc);
@@ -124,11 +126,11 @@ filter_unregister_all(struct kqueue *kq)
         if (kq->kq_filt[i].kf_destroy != NULL) 
             kq->kq_filt[i].kf_destroy(&kq->kq_filt[i]);
 
-        //XXX-FIXME
-        //knote_free_all(&kq->kq_filt[i]);
+        /* The knotes themselves are released by knote_free_all() */
+        knote_index_free(&kq->kq_filt[i]);
 
-        if (kqops.filter_free != NULL)
-            kqops.filter_free(kq, &kq->kq_filt[i]);
+        if (kq->kq_ops->filter_free != NULL)
+            kq->kq_ops->filter_free(kq, &kq->kq_filt[i]);
 	}
     memset(&kq->kq_filt[0], 0, sizeof(kq->kq_filt));
 }
@@ -25,6 +25,7 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <string.h>
+#include <time.h>
 
 #include "private.h"
 
@@ -115,43 +116,39 @@ kevent_dump(const struct kevent *kev)
     return ((const char *) &buf[0]);
 }
 
+/* The knote lock for <src> must be held */
 static int
-kevent_copyin_one(struct kqueue *kq, const struct kevent *src)
+kevent_copyin_knote(struct kqueue *kq, struct filter *filt, const struct kevent *src)
 {
     struct knote  *kn = NULL;
-    struct filter *filt;
     int rv = 0;
 
-    if (src->flags & EV_DISPATCH && src->flags & EV_ONESHOT) {
-        dbg_puts("Error: EV_DISPATCH and EV_ONESHOT are mutually exclusive");
-        errno = EINVAL;
-        return (-1);
-    }
-
-    if (filter_lookup(&filt, kq, src->filter) < 0) 
-        return (-1);
-
     dbg_printf("src=%s", kevent_dump(src));
 
     kn = knote_lookup(filt, src->ident);
     dbg_printf("knote_lookup: ident %d == %p", (int)src->ident, kn);
     if (kn == NULL) {
         if (src->flags & EV_ADD) {
-            if ((kn = knote_new()) == NULL) {
+            if ((kn = knote_new(kq)) == NULL) {
                 errno = ENOENT;
                 return (-1);
             }
             memcpy(&kn->kev, src, sizeof(kn->kev));
             kn->kev.flags &= ~EV_ENABLE;
             kn->kev.flags |= EV_ADD;//FIXME why?
-			kn->kn_kq = kq;
             assert(filt->kn_create);
             if (filt->kn_create(filt, kn) < 0) {
                 knote_release(kn);
                 errno = EFAULT;
                 return (-1);
             } 
-            knote_insert(filt, kn);
+            if (knote_insert(filt, kn) < 0) {
+                filt->kn_delete(filt, kn);
+                kn->kn_flags |= KNFL_KNOTE_DELETED;
+                knote_release(kn);
+                errno = ENOMEM;
+                return (-1);
+            }
             dbg_printf("created kevent %s", kevent_dump(src));
 
 /* XXX- FIXME Needs to be handled in kn_create() to prevent races */
@@ -189,9 +186,45 @@ kevent_copyin_one(struct kqueue *kq, const struct kevent *src)
     return (rv);
 }
 
+/* Apply one change; the platform also uses this for its own knotes */
+int
+kevent_copyin_one(struct kqueue *kq, const struct kevent *src)
+{
+    struct filter *filt;
+    tracing_mutex_t *mtx;
+    int rv, saved_errno;
+
+    if (src->flags & EV_DISPATCH && src->flags & EV_ONESHOT) {
+        dbg_puts("Error: EV_DISPATCH and EV_ONESHOT are mutually exclusive");
+        errno = EINVAL;
+        return (-1);
+    }
+
+    if (filter_lookup(&filt, kq, src->filter) < 0) 
+        return (-1);
+
+    mtx = filter_knote_mtx(filt, src->ident);
+    tracing_mutex_lock(mtx);
+    rv = kevent_copyin_knote(kq, filt, src);
+    saved_errno = errno;
+    tracing_mutex_unlock(mtx);
+    errno = saved_errno;
+
+    return (rv);
+}
+
+/* Returns the result of a change, as reported in the data field */
+static int
+kevent_status(int rv)
+{
+    if (rv >= 0)
+        return (0);
+    return (errno != 0 ? errno : EINVAL);
+}
+
 /** @return number of events added to the eventlist */
 static int
-kevent_copyin(struct kqueue *kq, const struct kevent *src, int nchanges,
+kevent_copyin_each(struct kqueue *kq, const struct kevent *src, int nchanges,
         struct kevent *eventlist, int nevents)
 {
     int status, nret;
@@ -201,9 +234,10 @@ kevent_copyin(struct kqueue *kq, const struct kevent *src, int nchanges,
     /* TODO: refactor, this has become convoluted to support EV_RECEIPT */
     for (nret = 0; nchanges > 0; src++, nchanges--) {
 
+        errno = 0;
         if (kevent_copyin_one(kq, src) < 0) {
             dbg_printf("errno=%s",strerror(errno));
-            status = errno;
+            status = kevent_status(-1);
             goto err_path;
         } else {
             if (src->flags & EV_RECEIPT) {
@@ -217,6 +251,7 @@ kevent_copyin(struct kqueue *kq, const struct kevent *src, int nchanges,
 err_path:
         if (nevents > 0) {
             memcpy(eventlist, src, sizeof(*src));
+            eventlist->flags |= EV_ERROR;
             eventlist->data = status;
             nevents--;
             eventlist++;
@@ -229,13 +264,481 @@ err_path:
     return (nret);
 }
 
-int VISIBLE
-kevent(int kqfd, const struct kevent *changelist, int nchanges,
-        struct kevent *eventlist, int nevents,
-        const struct timespec *timeout)
+/*
+ * Changelist coalescing.
+ *
+ * Event loops often change the same knote several times in one batch,
+ * for example by adding and deleting it, or by disabling and enabling it
+ * again. The changes for each (filter, ident) are folded together, so
+ * that only the net transition reaches the filter and the kernel:
+ *
+ *   - a run of EV_ENABLE and EV_DISABLE only leaves its final state,
+ *     which is not applied if the knote is in that state already, or
+ *     is deleted afterwards
+ *   - a new knote is created in the state that follows its toggles
+ *   - identical consecutive modifications are applied once
+ *
+ * Every change still gets its own result, as if it had been applied by
+ * itself. The changes for one knote are applied together under its lock,
+ * in the order of their first change. So when an error cannot be reported
+ * because the eventlist is full, changes for other knotes later in the
+ * batch may have been applied already.
+ */
+
+#define KEVENT_PENDING      (-1)    /* The change has not been applied yet */
+#define KEVENT_STACK_SLOTS  128     /* Larger changelists use the heap */
+
+/* The folded state of one knote */
+struct kevent_fold {
+    struct knote *kf_kn;        /* The knote, or NULL if it does not exist */
+    int           kf_pending;   /* First change not applied yet, or -1 */
+    int           kf_create;    /* kf_pending creates the knote */
+    int           kf_disable;   /* State requested by the pending changes */
+    int           kf_last;      /* Last modification applied, or -1 */
+};
+
+static int
+kevent_apply(struct kqueue *kq, struct filter *filt, const struct kevent *src)
+{
+    errno = 0;
+    return (kevent_status(kevent_copyin_knote(kq, filt, src)));
+}
+
+/* Apply the pending changes that precede change <upto>, or -1 for all */
+static void
+kevent_fold_flush(struct kqueue *kq, struct filter *filt, struct kevent_fold *f,
+        const struct kevent *changelist, const int *next, int *status, int upto)
+{
+    struct kevent kev;
+    int i, rv;
+
+    if (f->kf_pending < 0)
+        return;
+
+    i = f->kf_pending;
+    if (f->kf_create) {
+        memcpy(&kev, &changelist[i], sizeof(kev));
+        kev.flags &= ~(EV_ENABLE | EV_DISABLE);
+        if (f->kf_disable)
+            kev.flags |= EV_DISABLE;
+        status[i] = kevent_apply(kq, filt, &kev);
+        f->kf_kn = knote_lookup(filt, kev.ident);
+        /* The toggles that followed fail if the knote was not created */
+        rv = (f->kf_kn != NULL) ? 0 : ENOENT;
+        i = next[i];
+    } else if (f->kf_kn != NULL &&
+            f->kf_disable != ((f->kf_kn->kev.flags & EV_DISABLE) != 0)) {
+        memset(&kev, 0, sizeof(kev));
+        kev.ident = changelist[i].ident;
+        kev.filter = changelist[i].filter;
+        kev.flags = f->kf_disable ? EV_DISABLE : EV_ENABLE;
+        rv = kevent_apply(kq, filt, &kev);
+    } else {
+        rv = 0;
+    }
+    for (; i != upto; i = next[i])
+        status[i] = rv;
+
+    f->kf_pending = -1;
+    f->kf_create = 0;
+}
+
+/*
+ * Apply the changes for one knote. <first> is the index of the first one,
+ * and <next> links each change to the following one, or to -1.
+ */
+static void
+kevent_copyin_fold(struct kqueue *kq, struct filter *filt,
+        const struct kevent *changelist, const int *next, int first, int *status)
+{
+    const struct kevent *src;
+    struct kevent_fold f;
+    tracing_mutex_t *mtx;
+    int i, j;
+
+    mtx = filter_knote_mtx(filt, changelist[first].ident);
+    tracing_mutex_lock(mtx);
+
+    f.kf_kn = knote_lookup(filt, changelist[first].ident);
+    f.kf_pending = -1;
+    f.kf_create = 0;
+    f.kf_disable = 0;
+    f.kf_last = -1;
+
+    for (i = first; i >= 0; i = next[i]) {
+        src = &changelist[i];
+        if (src->flags & EV_DISPATCH && src->flags & EV_ONESHOT) {
+            status[i] = EINVAL;
+            continue;
+        }
+again:
+        if (f.kf_kn == NULL && !f.kf_create) {
+            if (src->flags & EV_ADD) {
+                f.kf_pending = i;
+                f.kf_create = 1;
+                f.kf_disable = (src->flags & EV_DISABLE) != 0;
+            } else {
+                status[i] = ENOENT;
+            }
+            f.kf_last = -1;
+            continue;
+        }
+
+        if (src->flags & EV_DELETE) {
+            if (f.kf_create) {
+                /* The add must still report its own error */
+                kevent_fold_flush(kq, filt, &f, changelist, next, status, i);
+                if (f.kf_kn == NULL)
+                    goto again;
+            } else if (f.kf_pending >= 0) {
+                /* Toggles of a knote that is deleted no longer matter */
+                for (j = f.kf_pending; j != i; j = next[j])
+                    status[j] = 0;
+                f.kf_pending = -1;
+            }
+        } else if (src->flags & (EV_ENABLE | EV_DISABLE)) {
+            if (f.kf_pending < 0)
+                f.kf_pending = i;
+            f.kf_disable = (src->flags & EV_DISABLE) != 0;
+            f.kf_last = -1;
+            continue;
+        } else if (f.kf_pending >= 0) {
+            kevent_fold_flush(kq, filt, &f, changelist, next, status, i);
+            if (f.kf_kn == NULL)
+                goto again;
+        } else if (f.kf_last >= 0 &&
+                memcmp(src, &changelist[f.kf_last], sizeof(*src)) == 0) {
+            status[i] = status[f.kf_last];
+            continue;
+        }
+
+        status[i] = kevent_apply(kq, filt, src);
+        f.kf_kn = knote_lookup(filt, src->ident);
+        f.kf_last = (src->flags & EV_DELETE) ? -1 : i;
+    }
+    kevent_fold_flush(kq, filt, &f, changelist, next, status, -1);
+
+    tracing_mutex_unlock(mtx);
+}
+
+/** @return number of events added to the eventlist */
+static int
+kevent_copyin(struct kqueue *kq, const struct kevent *changelist, int nchanges,
+        struct kevent *eventlist, int nevents)
+{
+    int stack[KEVENT_STACK_SLOTS];
+    int *buf, *next, *status, *slot;
+    struct filter *filt;
+    size_t nslots, h;
+    int i, j, nret, folded;
+
+    /* Each change gets a link and a result, and the hash needs two slots */
+    for (nslots = 4; nslots < (size_t) nchanges * 2; nslots *= 2)
+        ;
+    if (nchanges < 2)
+        return (kevent_copyin_each(kq, changelist, nchanges, eventlist, nevents));
+    if (2 * nchanges + nslots <= KEVENT_STACK_SLOTS) {
+        buf = stack;
+    } else if ((buf = malloc((2 * nchanges + nslots) * sizeof(int))) == NULL) {
+        return (kevent_copyin_each(kq, changelist, nchanges, eventlist, nevents));
+    }
+    next = buf;
+    status = next + nchanges;
+    slot = status + nchanges;
+
+    /* Link the changes for the same knote; each slot holds the last one */
+    memset(slot, 0xff, nslots * sizeof(int));
+    for (folded = 0, i = 0; i < nchanges; i++) {
+        next[i] = -1;
+        status[i] = KEVENT_PENDING;
+        h = (changelist[i].ident * 0x9E3779B1u) ^ (uint16_t) changelist[i].filter;
+        for (h &= nslots - 1; (j = slot[h]) >= 0; h = (h + 1) & (nslots - 1)) {
+            if (changelist[j].ident == changelist[i].ident &&
+                    changelist[j].filter == changelist[i].filter)
+                break;
+        }
+        if (j >= 0) {
+            next[j] = i;
+            folded = 1;
+        }
+        slot[h] = i;
+    }
+    if (!folded) {
+        if (buf != stack)
+            free(buf);
+        return (kevent_copyin_each(kq, changelist, nchanges, eventlist, nevents));
+    }
+
+    for (i = 0; i < nchanges; i++) {
+        if (status[i] != KEVENT_PENDING)
+            continue;   /* Applied with an earlier change for its knote */
+        if (next[i] < 0) {
+            errno = 0;
+            status[i] = kevent_status(kevent_copyin_one(kq, &changelist[i]));
+        } else if (filter_lookup(&filt, kq, changelist[i].filter) < 0) {
+            for (j = i; j >= 0; j = next[j])
+                status[j] = kevent_status(-1);
+        } else {
+            kevent_copyin_fold(kq, filt, changelist, next, i, status);
+        }
+    }
+
+    /* Report errors and receipts in the order of the changelist */
+    for (nret = 0, i = 0; i < nchanges; i++) {
+        if (status[i] == 0 && !(changelist[i].flags & EV_RECEIPT))
+            continue;
+        if (nevents == 0) {
+            if (status[i] != 0)
+                errno = status[i];
+            nret = -1;
+            break;
+        }
+        memcpy(eventlist, &changelist[i], sizeof(*eventlist));
+        eventlist->flags |= EV_ERROR;
+        eventlist->data = status[i];
+        eventlist++;
+        nevents--;
+        nret++;
+    }
+
+    if (buf != stack)
+        free(buf);
+    return (nret);
+}
+
+/* Copy out <nready> events that kevent_wait() reported */
+static int
+kevent_harvest(struct kqueue *kq, int nready, struct kevent *eventlist, int nevents)
+{
+    int rv;
+
+    knote_epoch_enter();
+#if defined(KNOTE_PLATFORM_LOCKING)
+    /* The platform takes the lock of each knote it copies out */
+    rv = kq->kq_ops->kevent_copyout(kq, nready, eventlist, nevents);
+#else
+    kqueue_lock(kq);
+    rv = kq->kq_ops->kevent_copyout(kq, nready, eventlist, nevents);
+    kqueue_unlock(kq);
+#endif
+    knote_epoch_exit();
+
+    return (rv);
+}
+
+#if !defined(_WIN32)
+static void
+kevent_deadline(struct timespec *deadline, const struct timespec *ts)
+{
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += ts->tv_sec;
+    deadline->tv_nsec += ts->tv_nsec;
+    if (deadline->tv_nsec >= 1000000000) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
+/* Returns zero once <deadline> has passed, otherwise the time left in <ts> */
+static int
+kevent_time_left(struct timespec *ts, const struct timespec *deadline)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ts->tv_sec = deadline->tv_sec - now.tv_sec;
+    ts->tv_nsec = deadline->tv_nsec - now.tv_nsec;
+    if (ts->tv_nsec < 0) {
+        ts->tv_sec--;
+        ts->tv_nsec += 1000000000;
+    }
+    return (ts->tv_sec > 0 || (ts->tv_sec == 0 && ts->tv_nsec > 0));
+}
+
+/*
+ * Exclusive wakeups
+ *
+ * When several threads wait on a kqueue, a ready event can end the wait
+ * of more than one of them: a level-triggered descriptor is ready again
+ * for the next waiter as soon as it has been reported, and so is the
+ * eventfd that announces knotes on the ready list. The threads that come
+ * second find nothing, or take events one by one that a single thread
+ * could have taken at once.
+ *
+ * In exclusive mode, the threads take turns instead: only one of them,
+ * the leader, waits in the backend, while the others queue up on
+ * kq_wait_cond. When the leader has events, the next thread takes over
+ * the wait while it copies them out.
+ */
+static int
+kevent_wait_exclusive(struct kqueue *kq, int nevents, const struct timespec *timeout)
+{
+    struct timespec deadline, left;
+    int rv;
+
+    if (timeout != NULL)
+        kevent_deadline(&deadline, timeout);
+
+    pthread_mutex_lock(&kq->kq_wait_mtx);
+    while (kq->kq_wait_leader) {
+        if (timeout == NULL) {
+            pthread_cond_wait(&kq->kq_wait_cond, &kq->kq_wait_mtx);
+        } else if (pthread_cond_timedwait(&kq->kq_wait_cond, &kq->kq_wait_mtx,
+                    &deadline) == ETIMEDOUT) {
+            pthread_mutex_unlock(&kq->kq_wait_mtx);
+            return (0);
+        }
+    }
+    kq->kq_wait_leader = 1;
+    pthread_mutex_unlock(&kq->kq_wait_mtx);
+
+    if (timeout != NULL) {
+        if (!kevent_time_left(&left, &deadline))
+            left.tv_sec = left.tv_nsec = 0;
+        timeout = &left;
+    }
+    rv = kq->kq_ops->kevent_wait(kq, nevents, timeout);
+
+    pthread_mutex_lock(&kq->kq_wait_mtx);
+    kq->kq_wait_leader = 0;
+    pthread_cond_signal(&kq->kq_wait_cond);
+    pthread_mutex_unlock(&kq->kq_wait_mtx);
+
+    return (rv);
+}
+#endif
+
+static int
+kevent_wait_events(struct kqueue *kq, int nevents, const struct timespec *timeout)
+{
+#if !defined(_WIN32)
+    /* A poll does not block, so it does not need to take its turn */
+    if (kq->kq_exclusive && (timeout == NULL || timeout->tv_sec != 0 || timeout->tv_nsec != 0))
+        return (kevent_wait_exclusive(kq, nevents, timeout));
+#endif
+    return (kq->kq_ops->kevent_wait(kq, nevents, timeout));
+}
+
+#if !defined(_WIN32)
+/*
+ * Tell whether the event of a knote that is already in the batch should be
+ * kept apart from an earlier one. Each event of a listening socket in
+ * NOTE_ACCEPT mode carries a new descriptor, and each event of an
+ * edge-triggered EVFILT_USER knote stands for a trigger of its own.
+ */
+static int
+kevent_batch_distinct(const struct kevent *kev)
+{
+    switch (kev->filter) {
+    case EVFILT_READ:
+        return ((kev->fflags & NOTE_ACCEPT) != 0);
+    case EVFILT_USER:
+        return ((kev->flags & (EV_CLEAR | EV_DISPATCH | EV_ONESHOT)) != 0);
+    default:
+        return (0);
+    }
+}
+
+/*
+ * Merge the <nnew> events that follow the first <n> ones in the eventlist
+ * into them. A knote that is reported again replaces its earlier event,
+ * except that the counts of timers and signals are added up, and the
+ * notes of vnodes and processes are combined.
+ * @return the number of events in the eventlist afterwards
+ */
+static int
+kevent_batch_merge(struct kevent *eventlist, int n, int nnew)
+{
+    struct kevent *src, *dst;
+    int i, j, total = n;
+
+    for (i = 0; i < nnew; i++) {
+        src = &eventlist[n + i];
+        j = n;
+        if (!kevent_batch_distinct(src) && !(src->flags & EV_ERROR)) {
+            for (j = 0; j < n; j++) {
+                if (eventlist[j].ident == src->ident && eventlist[j].filter == src->filter &&
+                        !(eventlist[j].flags & EV_ERROR))
+                    break;
+            }
+        }
+        if (j == n) {
+            dst = &eventlist[total++];
+            if (dst != src)
+                memcpy(dst, src, sizeof(*src));
+            continue;
+        }
+
+        dst = &eventlist[j];
+        switch (src->filter) {
+        case EVFILT_TIMER:
+        case EVFILT_SIGNAL:
+            src->data += dst->data;
+            break;
+        case EVFILT_VNODE:
+        case EVFILT_PROC:
+            src->fflags |= dst->fflags;
+            break;
+        }
+        memcpy(dst, src, sizeof(*src));
+    }
+
+    return (total);
+}
+
+/*
+ * Keep adding events to the <n> in the eventlist until there are <nmin>
+ * of them, or until <deadline> passes. A level-triggered knote is ready
+ * again as soon as it has been reported, so the batch also ends when a
+ * wait reports nothing new. Errors end it as well, since the events that
+ * were already copied out have to be returned.
+ * @return the number of events in the eventlist
+ */
+static int
+kevent_batch_fill(struct kqueue *kq, struct kevent *eventlist, int n,
+        int nevents, int nmin, const struct timespec *deadline)
+{
+    struct timespec left, *ts;
+    int rv, total;
+
+    while (n < nmin && n < nevents) {
+        ts = NULL;
+        if (deadline != NULL) {
+            if (!kevent_time_left(&left, deadline))
+                break;
+            ts = &left;
+        }
+        if (kq->kq_ops->kevent_wait_min != NULL)
+            rv = kq->kq_ops->kevent_wait_min(kq, nevents - n, nmin - n, ts);
+        else
+            rv = kevent_wait_events(kq, nevents - n, ts);
+        if (rv <= 0)
+            break;
+        rv = kevent_harvest(kq, rv, &eventlist[n], nevents - n);
+        if (rv < 0)
+            break;
+        total = kevent_batch_merge(eventlist, n, rv);
+        if (rv > 0 && total == n)
+            break;
+        n = total;
+    }
+    dbg_printf("batch holds %d events", n);
+
+    return (n);
+}
+#endif
+
+static int
+kevent_impl(int kqfd, const struct kevent *changelist, int nchanges,
+        struct kevent *eventlist, int nevents, int nmin,
+        const struct timespec *timeout, const struct timespec *latency)
 {
     struct kqueue *kq;
     int rv = 0;
+#if !defined(_WIN32)
+    struct timespec deadline, expiry, left;
+    const struct timespec *limit;
+#endif
 #ifndef NDEBUG
     static unsigned int _kevent_counter = 0;
     unsigned int myid = 0;
@@ -261,16 +764,15 @@ kevent(int kqfd, const struct kevent *changelist, int nchanges,
      * Process each kevent on the changelist.
      */
     if (nchanges > 0) {
-        kqueue_lock(kq);
+        knote_epoch_enter();
         rv = kevent_copyin(kq, changelist, nchanges, eventlist, nevents);
-        kqueue_unlock(kq);
+        knote_epoch_exit();
         dbg_printf("(%u) changelist: rv=%d", myid, rv);
         if (rv < 0)
             goto out;
-        if (rv > 0) {
-            eventlist += rv;
-            nevents -= rv;
-        }
+        /* As on BSD, errors and receipts are returned without waiting */
+        if (rv > 0)
+            goto out;
     }
 
     rv = 0;
@@ -278,15 +780,37 @@ kevent(int kqfd, const struct kevent *changelist, int nchanges,
     /*
      * Wait for events and copy them to the eventlist
      */
-    if (nevents > MAX_KEVENT)
-        nevents = MAX_KEVENT;
     if (nevents > 0) {
-        rv = kqops.kevent_wait(kq, nevents, timeout);
-        dbg_printf("kqops.kevent_wait returned %d", rv);
+#if !defined(_WIN32)
+        /* A batch ends with the latency or the timeout, whichever is shorter */
+        limit = timeout;
+        if (latency != NULL && (limit == NULL || latency->tv_sec < limit->tv_sec ||
+                    (latency->tv_sec == limit->tv_sec && latency->tv_nsec < limit->tv_nsec)))
+            limit = latency;
+        if (nmin > 1 && limit != NULL)
+            kevent_deadline(&deadline, limit);
+        if (timeout != NULL && (timeout->tv_sec > 0 || timeout->tv_nsec > 0))
+            kevent_deadline(&expiry, timeout);
+#endif
+again:
+        rv = kevent_wait_events(kq, nevents, timeout);
+        dbg_printf("kevent_wait returned %d", rv);
         if (fastpath(rv > 0)) {
-            kqueue_lock(kq);
-            rv = kqops.kevent_copyout(kq, rv, eventlist, nevents);
-            kqueue_unlock(kq);
+            rv = kevent_harvest(kq, rv, eventlist, nevents);
+
+            /* Every event was discarded, so keep waiting until the timeout */
+            if (rv == 0 && timeout == NULL)
+                goto again;
+#if !defined(_WIN32)
+            if (rv == 0 && timeout != NULL && (timeout->tv_sec > 0 || timeout->tv_nsec > 0) &&
+                    kevent_time_left(&left, &expiry)) {
+                timeout = &left;
+                goto again;
+            }
+            if (rv > 0 && rv < nmin && rv < nevents)
+                rv = kevent_batch_fill(kq, eventlist, rv, nevents, nmin,
+                        (limit != NULL) ? &deadline : NULL);
+#endif
         } else if (rv == 0) {
             /* Timeout reached */
         } else {
@@ -307,6 +831,26 @@ kevent(int kqfd, const struct kevent *changelist, int nchanges,
 #endif
 
 out:
+    if (kq->kq_ops->kevent_flush != NULL)
+        kq->kq_ops->kevent_flush(kq);
     dbg_printf("--- END kevent %u ret %d ---", myid, rv);
     return (rv);
 }
+
+int VISIBLE
+kevent(int kqfd, const struct kevent *changelist, int nchanges,
+        struct kevent *eventlist, int nevents,
+        const struct timespec *timeout)
+{
+    return (kevent_impl(kqfd, changelist, nchanges, eventlist, nevents,
+                1, timeout, NULL));
+}
+
+int VISIBLE
+kevent_batch(int kqfd, const struct kevent *changelist, int nchanges,
+        struct kevent *eventlist, int nevents, int nmin,
+        const struct timespec *timeout, const struct timespec *latency)
+{
+    return (kevent_impl(kqfd, changelist, nchanges, eventlist, nevents,
+                nmin, timeout, latency));
+}
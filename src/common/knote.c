@@ -15,6 +15,7 @@
  */
 
 #include <inttypes.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
@@ -23,31 +24,451 @@
 
 #include "alloc.h"
 
+/*
+ * Epoch-based reclamation.
+ *
+ * Lookups walk the knote index without taking a lock, so memory that has
+ * been unlinked from the index cannot be reused until every thread that
+ * might still be looking at it has finished. A thread brackets its use of
+ * knotes with knote_epoch_enter() and knote_epoch_exit(), which only touch
+ * a record that belongs to the calling thread. Retired objects wait on one
+ * of three limbo lists, and the global epoch may only advance once every
+ * active thread has observed the current one. Objects retired in epoch N
+ * are released when the global epoch reaches N + 2.
+ */
+#define EPOCH_RECLAIM_THRESHOLD 64
+
+struct epoch_record {
+    volatile uint32_t    er_epoch;      /* Global epoch when the section began */
+    volatile uint32_t    er_active;     /* Nesting depth of the section */
+    volatile uint32_t    er_inuse;      /* Owned by a live thread */
+    struct epoch_record *er_next;
+};
+
+static struct epoch_record *epoch_records;
+static volatile uint32_t    epoch_global;
+static pthread_mutex_t      epoch_mtx;      /* Protects the limbo lists */
+static pthread_mutex_t      epoch_free_mtx; /* Held while a limbo list is freed */
+static struct epoch_entry  *epoch_limbo[3];
+static size_t               epoch_nlimbo;
+static __thread struct epoch_record *epoch_self;
+#ifndef _WIN32
+static pthread_key_t        epoch_key;
+#endif
+
+#ifndef _WIN32
+static void
+epoch_record_release(void *arg)
+{
+    ((struct epoch_record *) arg)->er_inuse = 0;
+}
+#endif
+
+static struct epoch_record *
+epoch_register(void)
+{
+    struct epoch_record *rec, *head;
+
+    /* Records are never freed; reuse one left behind by an exited thread */
+    for (rec = epoch_records; rec != NULL; rec = rec->er_next) {
+        if (rec->er_inuse == 0 && atomic_cas(&rec->er_inuse, 0, 1) == 0)
+            goto out;
+    }
+
+    rec = calloc(1, sizeof(*rec));
+    if (rec == NULL)
+        abort();
+    rec->er_inuse = 1;
+    do {
+        head = epoch_records;
+        rec->er_next = head;
+    } while (atomic_ptr_cas(&epoch_records, head, rec) != head);
+
+out:
+#ifndef _WIN32
+    (void) pthread_setspecific(epoch_key, rec);
+#endif
+    epoch_self = rec;
+    return (rec);
+}
+
+void
+knote_epoch_enter(void)
+{
+    struct epoch_record *rec = epoch_self;
+
+    if (rec == NULL)
+        rec = epoch_register();
+    if (rec->er_active++ == 0) {
+        rec->er_epoch = epoch_global;
+        /* Publish the record before reading anything from the index */
+        atomic_barrier();
+    }
+}
+
+void
+knote_epoch_exit(void)
+{
+    struct epoch_record *rec = epoch_self;
+
+    assert(rec != NULL && rec->er_active > 0);
+    if (rec->er_active == 1)
+        atomic_barrier();
+    rec->er_active--;
+}
+
+static void
+epoch_free_list(struct epoch_entry *ent)
+{
+    struct epoch_entry *next;
+
+    for (; ent != NULL; ent = next) {
+        next = ent->ee_next;
+        ent->ee_free(ent);
+    }
+}
+
+/*
+ * Try to advance the global epoch, and release what has become unreachable.
+ * The detached list is freed under epoch_free_mtx, so that epoch_forget()
+ * cannot return, and the kqueue that owns an entry cannot be destroyed,
+ * while it is being freed. If another thread is already reclaiming, the
+ * next retirement will try again.
+ */
+static void
+epoch_reclaim(void)
+{
+    struct epoch_record *rec;
+    struct epoch_entry *ent, *list = NULL;
+    uint32_t epoch;
+
+    if (pthread_mutex_trylock(&epoch_free_mtx) != 0)
+        return;
+    pthread_mutex_lock(&epoch_mtx);
+    epoch = epoch_global;
+    atomic_barrier();
+    for (rec = epoch_records; rec != NULL; rec = rec->er_next) {
+        if (rec->er_inuse && rec->er_active && rec->er_epoch != epoch) {
+            pthread_mutex_unlock(&epoch_mtx);
+            pthread_mutex_unlock(&epoch_free_mtx);
+            return;
+        }
+    }
+    epoch_global = epoch + 1;
+    list = epoch_limbo[(epoch + 2) % 3];
+    epoch_limbo[(epoch + 2) % 3] = NULL;
+    for (ent = list; ent != NULL; ent = ent->ee_next)
+        epoch_nlimbo--;
+    pthread_mutex_unlock(&epoch_mtx);
+
+    epoch_free_list(list);
+    pthread_mutex_unlock(&epoch_free_mtx);
+}
+
+static void
+epoch_retire(struct epoch_entry *ent)
+{
+    struct epoch_entry **limbo;
+    size_t n;
+
+    pthread_mutex_lock(&epoch_mtx);
+    limbo = &epoch_limbo[epoch_global % 3];
+    ent->ee_next = *limbo;
+    *limbo = ent;
+    n = ++epoch_nlimbo;
+    pthread_mutex_unlock(&epoch_mtx);
+
+    if (n >= EPOCH_RECLAIM_THRESHOLD)
+        epoch_reclaim();
+}
+
+/*
+ * Drop retired objects that belong to <owner>, which is being destroyed.
+ * This waits for a reclaim in progress, which may be freeing some of them.
+ */
+static void
+epoch_forget(void *owner)
+{
+    struct epoch_entry **pp;
+    int i;
+
+    pthread_mutex_lock(&epoch_free_mtx);
+    pthread_mutex_lock(&epoch_mtx);
+    for (i = 0; i < 3; i++) {
+        for (pp = &epoch_limbo[i]; *pp != NULL; ) {
+            if ((*pp)->ee_owner == owner) {
+                *pp = (*pp)->ee_next;
+                epoch_nlimbo--;
+            } else {
+                pp = &(*pp)->ee_next;
+            }
+        }
+    }
+    pthread_mutex_unlock(&epoch_mtx);
+    pthread_mutex_unlock(&epoch_free_mtx);
+}
+
+static void
+epoch_free_mem(struct epoch_entry *ent)
+{
+    free(ent);
+}
+
+/* Flags for each per-kqueue knote arena */
+static int knote_arena_flags = 0;
+
 int
 knote_init(void)
 {
-    return 0;
-//    return (mem_init(sizeof(struct knote), 1024));
+    char *s = getenv("KQUEUE_HUGEPAGES");
+
+    if (s != NULL && strlen(s) > 0 && strcmp(s, "0") != 0) {
+        dbg_puts("allocating knotes from huge pages");
+        knote_arena_flags |= MEM_ARENA_HUGEPAGES;
+    }
+    pthread_mutex_init(&epoch_mtx, NULL);
+    pthread_mutex_init(&epoch_free_mtx, NULL);
+#ifndef _WIN32
+    if (pthread_key_create(&epoch_key, epoch_record_release) != 0)
+        return (-1);
+#endif
+    return (mem_init());
+}
+
+int
+knote_arena_init(struct kqueue *kq)
+{
+    kq->kq_knote_arena = mem_arena_new(sizeof(struct knote), knote_arena_flags);
+    return (kq->kq_knote_arena == NULL ? -1 : 0);
 }
 
+/* Release every knote that belongs to the kqueue */
+void
+knote_free_all(struct kqueue *kq)
+{
+    if (kq->kq_knote_arena == NULL)
+        return;
+    epoch_forget(kq);
+    mem_arena_free(kq->kq_knote_arena);
+    kq->kq_knote_arena = NULL;
+}
+
+/*
+ * Knotes are indexed by ident in one of two ways. Filters whose idents are
+ * descriptors use a two-level table, so that lookups are a pair of array
+ * accesses. Other idents are kept in an open-addressing hash table with
+ * linear probing.
+ *
+ * Both tables are read without a lock. Writers hold kf_knote_mtx, publish
+ * new entries with a single pointer store, and retire replaced tables
+ * through the epoch. Removing a hash entry shifts its neighbours back, so
+ * the writer bumps kf_hash_seq around it and readers retry if it changed.
+ */
+#define KNOTE_FDTAB_SHIFT   10
+#define KNOTE_FDTAB_PAGE    (1 << KNOTE_FDTAB_SHIFT)
+#define KNOTE_FDTAB_MAX     (1 << 24)   /* Larger descriptors use the hash */
+#define KNOTE_HASH_MIN      16
+
+struct knote_fdtab {
+    struct epoch_entry  ft_epoch;
+    size_t              ft_len;         /* Number of pages */
+    struct knote ** volatile ft_page[];
+};
+
+struct knote_hash {
+    struct epoch_entry  kh_epoch;
+    size_t              kh_size;        /* A power of two */
+    struct knote * volatile kh_slot[];
+};
+
 static int
-knote_cmp(struct knote *a, struct knote *b)
+knote_ident_is_fd(struct filter *filt, uintptr_t ident)
+{
+    switch (filt->kf_id) {
+        case EVFILT_READ:
+        case EVFILT_WRITE:
+        case EVFILT_VNODE:
+            return (ident < KNOTE_FDTAB_MAX);
+        default:
+            return (0);
+    }
+}
+
+/* Returns the table entry for a descriptor, optionally creating its page */
+static struct knote * volatile *
+knote_fdtab_slot(struct filter *filt, uintptr_t ident, int create)
+{
+    size_t page = ident >> KNOTE_FDTAB_SHIFT;
+    struct knote_fdtab *tab, *old;
+    struct knote **pg;
+    size_t len;
+
+    tab = filt->kf_fdtab;
+    if (tab == NULL || page >= tab->ft_len) {
+        if (!create)
+            return (NULL);
+        old = tab;
+        for (len = old ? old->ft_len : 1; len <= page; len *= 2)
+            ;
+        tab = calloc(1, sizeof(*tab) + len * sizeof(tab->ft_page[0]));
+        if (tab == NULL)
+            return (NULL);
+        tab->ft_epoch.ee_free = epoch_free_mem;
+        tab->ft_len = len;
+        if (old != NULL) {
+            memcpy((void *) &tab->ft_page[0], (void *) &old->ft_page[0],
+                    old->ft_len * sizeof(tab->ft_page[0]));
+        }
+        atomic_barrier();
+        filt->kf_fdtab = tab;
+        if (old != NULL)
+            epoch_retire(&old->ft_epoch);
+    }
+    if (tab->ft_page[page] == NULL) {
+        if (!create)
+            return (NULL);
+        pg = calloc(KNOTE_FDTAB_PAGE, sizeof(struct knote *));
+        if (pg == NULL)
+            return (NULL);
+        atomic_barrier();
+        tab->ft_page[page] = pg;
+    }
+
+    return (&tab->ft_page[page][ident & (KNOTE_FDTAB_PAGE - 1)]);
+}
+
+static size_t
+knote_hash(uintptr_t ident, size_t size)
+{
+    uint64_t h = (uint64_t) ident * UINT64_C(0x9E3779B97F4A7C15);
+
+    return ((size_t) (h >> 32) & (size - 1));
+}
+
+/* Returns the position of the knote with the given ident, or of the empty slot where it belongs */
+static size_t
+knote_hash_find(struct knote_hash *h, uintptr_t ident)
+{
+    size_t i, mask = h->kh_size - 1;
+    struct knote *kn;
+
+    for (i = knote_hash(ident, h->kh_size); ; i = (i + 1) & mask) {
+        kn = h->kh_slot[i];
+        if (kn == NULL || kn->kev.ident == ident)
+            return (i);
+    }
+}
+
+static int
+knote_hash_grow(struct filter *filt)
+{
+    struct knote_hash *h, *old = filt->kf_hash;
+    struct knote *kn;
+    size_t i, size;
+
+    size = old ? old->kh_size * 2 : KNOTE_HASH_MIN;
+    h = calloc(1, sizeof(*h) + size * sizeof(h->kh_slot[0]));
+    if (h == NULL)
+        return (-1);
+    h->kh_epoch.ee_free = epoch_free_mem;
+    h->kh_size = size;
+    for (i = 0; old != NULL && i < old->kh_size; i++) {
+        if ((kn = old->kh_slot[i]) != NULL)
+            h->kh_slot[knote_hash_find(h, kn->kev.ident)] = kn;
+    }
+    atomic_barrier();
+    filt->kf_hash = h;
+    if (old != NULL)
+        epoch_retire(&old->kh_epoch);
+
+    return (0);
+}
+
+/* Remove the entry at position <i>, shifting back the entries that follow it */
+static void
+knote_hash_remove(struct filter *filt, size_t i)
+{
+    struct knote_hash *h = filt->kf_hash;
+    size_t j, k, mask = h->kh_size - 1;
+
+    atomic_inc(&filt->kf_hash_seq);
+    for (j = i; ; ) {
+        j = (j + 1) & mask;
+        if (h->kh_slot[j] == NULL)
+            break;
+        k = knote_hash(h->kh_slot[j]->kev.ident, h->kh_size);
+        /* Leave the entry alone if its home slot lies cyclically in (i, j] */
+        if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+        h->kh_slot[i] = h->kh_slot[j];
+        i = j;
+    }
+    h->kh_slot[i] = NULL;
+    atomic_inc(&filt->kf_hash_seq);
+    filt->kf_hash_count--;
+}
+
+/* Lock-free lookup in the hash table; the caller must be in an epoch */
+static struct knote *
+knote_hash_lookup(struct filter *filt, uintptr_t ident)
 {
-    return memcmp(&a->kev.ident, &b->kev.ident, sizeof(a->kev.ident)); 
+    struct knote_hash *h;
+    struct knote *kn;
+    uint32_t seq;
+
+    do {
+        /* An odd sequence number means that a removal is in progress */
+        while ((seq = filt->kf_hash_seq) & 1)
+            ;
+        atomic_barrier();
+        h = filt->kf_hash;
+        kn = (h == NULL) ? NULL : h->kh_slot[knote_hash_find(h, ident)];
+        atomic_barrier();
+    } while (seq != filt->kf_hash_seq);
+
+    return (kn);
 }
 
-RB_GENERATE(knt, knote, kn_entries, knote_cmp)
+/* Free the index of a filter, but not the knotes in it */
+void
+knote_index_free(struct filter *filt)
+{
+    struct knote_fdtab *tab = filt->kf_fdtab;
+    size_t i;
+
+    if (tab != NULL) {
+        for (i = 0; i < tab->ft_len; i++)
+            free(tab->ft_page[i]);
+        free(tab);
+    }
+    filt->kf_fdtab = NULL;
+    free(filt->kf_hash);
+    filt->kf_hash = NULL;
+    filt->kf_hash_count = 0;
+}
+
+static void
+knote_free(struct epoch_entry *ent)
+{
+    struct knote *kn = (struct knote *) ((char *) ent - offsetof(struct knote, kn_epoch));
+
+    dbg_printf("freeing knote at %p", kn);
+    mem_free(kn->kn_kq->kq_knote_arena, kn);
+}
 
 struct knote *
-knote_new(void)
+knote_new(struct kqueue *kq)
 {
 	struct knote *res;
 
-    res = calloc(1, sizeof(struct knote));
+    res = mem_calloc(kq->kq_knote_arena);
 	if (res == NULL)
         return (NULL);
 
     res->kn_ref = 1;
+    res->kn_kq = kq;
+    res->kn_epoch.ee_free = knote_free;
+    res->kn_epoch.ee_owner = kq;
 
     return (res);
 }
@@ -59,8 +480,8 @@ knote_release(struct knote *kn)
 
 	if (atomic_dec(&kn->kn_ref) == 0) {
         if (kn->kn_flags & KNFL_KNOTE_DELETED) {
-            dbg_printf("freeing knote at %p", kn);
-            free(kn);
+            /* Lock-free lookups may still be looking at it */
+            epoch_retire(&kn->kn_epoch);
         } else {
             dbg_puts("this should never happen");
         }
@@ -69,19 +490,42 @@ knote_release(struct knote *kn)
     }
 }
 
-void
+int
 knote_insert(struct filter *filt, struct knote *kn)
 {
-    pthread_rwlock_wrlock(&filt->kf_knote_mtx);
-    RB_INSERT(knt, &filt->kf_knote, kn);
-    pthread_rwlock_unlock(&filt->kf_knote_mtx);
+    struct knote * volatile *slot;
+    int rv = 0;
+
+    pthread_mutex_lock(&filt->kf_knote_mtx);
+    /* The knote must be complete before lookups can see it */
+    atomic_barrier();
+    if (knote_ident_is_fd(filt, kn->kev.ident)) {
+        slot = knote_fdtab_slot(filt, kn->kev.ident, 1);
+        if (slot != NULL)
+            *slot = kn;
+        else
+            rv = -1;
+    } else {
+        /* Keep the load factor below 3/4 */
+        if ((filt->kf_hash == NULL || 
+                    (filt->kf_hash_count + 1) * 4 > filt->kf_hash->kh_size * 3)
+                && knote_hash_grow(filt) < 0) {
+            rv = -1;
+        } else {
+            filt->kf_hash->kh_slot[knote_hash_find(filt->kf_hash, kn->kev.ident)] = kn;
+            filt->kf_hash_count++;
+        }
+    }
+    pthread_mutex_unlock(&filt->kf_knote_mtx);
+
+    return (rv);
 }
 
 int
 knote_delete(struct filter *filt, struct knote *kn)
 {
-    struct knote query;
-    struct knote *tmp;
+    struct knote * volatile *slot;
+    size_t i;
 
     if (kn->kn_flags & KNFL_KNOTE_DELETED) {
         dbg_puts("ERROR: double deletion detected");
@@ -92,13 +536,17 @@ knote_delete(struct filter *filt, struct knote *kn)
      * Verify that the knote wasn't removed by another
      * thread before we acquired the knotelist lock.
      */
-    query.kev.ident = kn->kev.ident;
-    pthread_rwlock_wrlock(&filt->kf_knote_mtx);
-    tmp = RB_FIND(knt, &filt->kf_knote, &query);
-    if (tmp == kn) {
-        RB_REMOVE(knt, &filt->kf_knote, kn);
+    pthread_mutex_lock(&filt->kf_knote_mtx);
+    if (knote_ident_is_fd(filt, kn->kev.ident)) {
+        slot = knote_fdtab_slot(filt, kn->kev.ident, 0);
+        if (slot != NULL && *slot == kn)
+            *slot = NULL;
+    } else if (filt->kf_hash != NULL) {
+        i = knote_hash_find(filt->kf_hash, kn->kev.ident);
+        if (filt->kf_hash->kh_slot[i] == kn)
+            knote_hash_remove(filt, i);
     }
-    pthread_rwlock_unlock(&filt->kf_knote_mtx);
+    pthread_mutex_unlock(&filt->kf_knote_mtx);
 
     filt->kn_delete(filt, kn); //XXX-FIXME check return value
 
@@ -109,17 +557,24 @@ knote_delete(struct filter *filt, struct knote *kn)
     return (0);
 }
 
+/*
+ * Find the knote for an ident without taking a lock. The caller must be
+ * between knote_epoch_enter() and knote_epoch_exit() for as long as it
+ * uses the result.
+ */
 struct knote *
 knote_lookup(struct filter *filt, uintptr_t ident)
 {
-    struct knote query;
+    struct knote * volatile *slot;
     struct knote *ent = NULL;
 
-    query.kev.ident = ident;
-
-    pthread_rwlock_rdlock(&filt->kf_knote_mtx);
-    ent = RB_FIND(knt, &filt->kf_knote, &query);
-    pthread_rwlock_unlock(&filt->kf_knote_mtx);
+    if (knote_ident_is_fd(filt, ident)) {
+        slot = knote_fdtab_slot(filt, ident, 0);
+        if (slot != NULL)
+            ent = *slot;
+    } else {
+        ent = knote_hash_lookup(filt, ident);
+    }
 
     dbg_printf("id=%" PRIuPTR " ent=%p", ident, ent);
 
@@ -151,8 +606,9 @@ knote_disable(struct filter *filt, struct knote *kn)
 {
     assert(!(kn->kev.flags & EV_DISABLE));
 
-    filt->kn_disable(filt, kn); //TODO: Error checking
+    /* Set first, like kevent_copyin_one() does, so kn_disable() can see it */
     KNOTE_DISABLE(kn);
+    filt->kn_disable(filt, kn); //TODO: Error checking
     return (0);
 }
 
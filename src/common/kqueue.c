@@ -111,7 +111,8 @@ kqueue_free(struct kqueue *kq)
 {
     RB_REMOVE(kqt, &kqtree, kq);
     filter_unregister_all(kq);
-    kqops.kqueue_free(kq);
+    kq->kq_ops->kqueue_free(kq);
+    knote_free_all(kq);
     free(kq);
 }
 
@@ -123,6 +124,27 @@ kqueue_lookup(int kq)
     return ((struct kqueue *) map_lookup(kqmap, kq));
 }
 
+#if !defined(_WIN32)
+static int
+kqueue_wait_init(struct kqueue *kq)
+{
+    pthread_condattr_t attr;
+    int rv;
+
+    /* Waits are timed against the clock that kevent() uses for deadlines */
+    if (pthread_condattr_init(&attr) != 0)
+        return (-1);
+    rv = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    if (rv == 0)
+        rv = pthread_cond_init(&kq->kq_wait_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    if (rv != 0)
+        return (-1);
+    pthread_mutex_init(&kq->kq_wait_mtx, NULL);
+    return (0);
+}
+#endif
+
 int VISIBLE
 kqueue(void)
 {
@@ -148,8 +170,21 @@ kqueue(void)
         return (-1);
 
 	tracing_mutex_init(&kq->kq_mtx, NULL);
+#if !defined(_WIN32)
+    if (kqueue_wait_init(kq) < 0) {
+        free(kq);
+        return (-1);
+    }
+#endif
 
-    if (kqops.kqueue_init(kq) < 0) {
+    if (knote_arena_init(kq) < 0) {
+        free(kq);
+        return (-1);
+    }
+    /* The platform may pick another backend for this kqueue */
+    kq->kq_ops = &kqops;
+    if (kq->kq_ops->kqueue_init(kq) < 0) {
+        knote_free_all(kq);
         free(kq);
         return (-1);
     }
@@ -163,9 +198,77 @@ kqueue(void)
     }
     if (map_insert(kqmap, kq->kq_id, kq) < 0) {
         dbg_puts("map insertion failed");
-        kqops.kqueue_free(kq);
+        kq->kq_ops->kqueue_free(kq);
         return (-1);
     }
 
     return (kq->kq_id);
 }
+
+int VISIBLE
+kqueue_batch_data(int kqfd, int enable)
+{
+    struct kqueue *kq;
+
+    kq = kqueue_lookup(kqfd);
+    if (kq == NULL) {
+        errno = EBADF;
+        return (-1);
+    }
+    if (kq->kq_ops->kqueue_batch_data == NULL) {
+        errno = ENOTSUP;
+        return (-1);
+    }
+    return (kq->kq_ops->kqueue_batch_data(kq, enable));
+}
+
+int VISIBLE
+kqueue_busy_poll(int kqfd, unsigned int usecs)
+{
+    struct kqueue *kq;
+
+    kq = kqueue_lookup(kqfd);
+    if (kq == NULL) {
+        errno = EBADF;
+        return (-1);
+    }
+    if (kq->kq_ops->kqueue_busy_poll == NULL) {
+        errno = ENOTSUP;
+        return (-1);
+    }
+    return (kq->kq_ops->kqueue_busy_poll(kq, usecs));
+}
+
+int VISIBLE
+kqueue_exclusive(int kqfd, int enable)
+{
+    struct kqueue *kq;
+
+    kq = kqueue_lookup(kqfd);
+    if (kq == NULL) {
+        errno = EBADF;
+        return (-1);
+    }
+#if !defined(_WIN32)
+    kq->kq_exclusive = (enable != 0);
+    return (0);
+#else
+    (void) enable;
+    errno = ENOTSUP;
+    return (-1);
+#endif
+}
+
+int VISIBLE
+kqueue_stats(int kqfd, struct kqueue_stats *stats)
+{
+    struct kqueue *kq;
+
+    kq = kqueue_lookup(kqfd);
+    if (kq == NULL) {
+        errno = EBADF;
+        return (-1);
+    }
+    memcpy(stats, &kq->kq_stats, sizeof(*stats));
+    return (0);
+}
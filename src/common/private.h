@@ -23,15 +23,16 @@
 #include "config.h"
 #include "tree.h"
 
-/* Maximum events returnable in a single kevent() call */
-#define MAX_KEVENT  512
-
 struct kqueue;
 struct kevent;
 struct knote;
 struct map;
 struct eventfd;
 struct evfilt_data;
+struct mem_arena;
+struct knote_fdtab;
+struct knote_hash;
+struct kqueue_vtable;
 
 #if defined(_WIN32)
 # include "../windows/platform.h"
@@ -68,7 +69,16 @@ struct eventfd {
  */
 #define KNFL_PASSIVE_SOCKET  (0x01)  /* Socket is in listen(2) mode */
 #define KNFL_REGULAR_FILE    (0x02)  /* File descriptor is a regular file */
+#define KNFL_LOWAT_CHECK     (0x04)  /* The filter checks NOTE_LOWAT itself */
+#define KNFL_ACCEPT          (0x08)  /* Each event is an accepted connection */
 #define KNFL_KNOTE_DELETED   (0x10)  /* The knote object is no longer valid */
+
+/* An object waiting for lock-free readers to finish before it is freed */
+struct epoch_entry {
+    struct epoch_entry *ee_next;
+    void              (*ee_free)(struct epoch_entry *);
+    void               *ee_owner;       /* The kqueue, if any, that owns it */
+};
  
 struct knote {
     struct kevent     kev;
@@ -87,10 +97,10 @@ struct knote {
     } data;
 	struct kqueue*	   kn_kq;
     volatile uint32_t  kn_ref;
+    struct epoch_entry kn_epoch;
 #if defined(KNOTE_PLATFORM_SPECIFIC)
     KNOTE_PLATFORM_SPECIFIC;
 #endif
-    RB_ENTRY(knote)   kn_entries;
 };
 
 #define KNOTE_ENABLE(ent)           do {                            \
@@ -127,8 +137,12 @@ struct filter {
     //----?
 
     struct evfilt_data *kf_data;	    /* filter-specific data */
-    RB_HEAD(knt, knote) kf_knote;
-    pthread_rwlock_t    kf_knote_mtx;
+    struct knote_fdtab * volatile kf_fdtab; /* Knotes indexed by descriptor */
+    struct knote_hash * volatile kf_hash;   /* Knotes indexed by other idents */
+    size_t              kf_hash_count;
+    volatile uint32_t   kf_hash_seq;    /* Odd while a hash entry is moving */
+    pthread_mutex_t     kf_knote_mtx;   /* Held to change the index */
+    tracing_mutex_t     kf_mtx;         /* Protects the filter and its knotes */
     struct kqueue      *kf_kqueue;
 #if defined(FILTER_PLATFORM_SPECIFIC)
     FILTER_PLATFORM_SPECIFIC;
@@ -145,6 +159,15 @@ struct kqueue {
     int             kq_nfds;
     tracing_mutex_t kq_mtx;
     volatile uint32_t kq_ref;
+    struct mem_arena *kq_knote_arena; /* Slabs that knotes are allocated from */
+    const struct kqueue_vtable *kq_ops; /* The backend of this kqueue */
+    struct kqueue_stats kq_stats; /* Updated by the backend, if it keeps any */
+#if !defined(_WIN32)
+    pthread_mutex_t kq_wait_mtx;  /* Protects the two members below */
+    pthread_cond_t  kq_wait_cond; /* Signalled when the leader stops waiting */
+    int             kq_wait_leader; /* A thread waits in the backend */
+    int             kq_exclusive; /* Only one thread waits in the backend */
+#endif
 #if defined(KQUEUE_PLATFORM_SPECIFIC)
     KQUEUE_PLATFORM_SPECIFIC;
 #endif
@@ -171,6 +194,16 @@ struct kqueue_vtable {
     int  (*eventfd_raise)(struct eventfd *);
     int  (*eventfd_lower)(struct eventfd *);
     int  (*eventfd_descriptor)(struct eventfd *);
+    // Optional; called at the end of every kevent() call
+    void (*kevent_flush)(struct kqueue *);
+    // Optional; like kevent_wait, but waits until <int> events are ready
+    // @param int the number of events to wait for
+    // @param int the number of events that should be ready
+    int  (*kevent_wait_min)(struct kqueue *, int, int, const struct timespec *);
+    // Optional; spin for up to <unsigned int> microseconds before blocking
+    int  (*kqueue_busy_poll)(struct kqueue *, unsigned int);
+    // Optional; fetch the data of the events of a copyout in one batch
+    int  (*kqueue_batch_data)(struct kqueue *, int);
 };
 extern const struct kqueue_vtable kqops;
 
@@ -180,17 +213,33 @@ extern const struct kqueue_vtable kqops;
 #define kqueue_lock(kq)     tracing_mutex_lock(&(kq)->kq_mtx)
 #define kqueue_unlock(kq)   tracing_mutex_unlock(&(kq)->kq_mtx)
 
+/*
+ * Returns the lock that protects the knote for <ident> in a filter. Unless
+ * the platform defines KNOTE_PLATFORM_LOCKING and locks knotes itself,
+ * every knote is protected by kq_mtx.
+ */
+#if !defined(KNOTE_PLATFORM_LOCKING)
+# define filter_knote_mtx(filt, ident)  (&(filt)->kf_kqueue->kq_mtx)
+#endif
+#define knote_mtx(kn) \
+    filter_knote_mtx(&(kn)->kn_kq->kq_filt[~(kn)->kev.filter], (kn)->kev.ident)
+
 /*
  * knote internal API
  */
 struct knote * knote_lookup(struct filter *, uintptr_t);
 //DEADWOOD: struct knote * knote_get_by_data(struct filter *filt, intptr_t);
-struct knote * knote_new(void);
+struct knote * knote_new(struct kqueue *);
 #define knote_retain(kn) atomic_inc(&kn->kn_ref)
 void knote_release(struct knote *);
-void knote_insert(struct filter *, struct knote *);
+int  knote_insert(struct filter *, struct knote *);
 int  knote_delete(struct filter *, struct knote *);
 int  knote_init(void);
+void knote_epoch_enter(void);
+void knote_epoch_exit(void);
+int  knote_arena_init(struct kqueue *);
+void knote_free_all(struct kqueue *);
+void knote_index_free(struct filter *);
 int  knote_disable(struct filter *, struct knote *);
 #define knote_get_filter(knt) &((knt)->kn_kq->kq_filt[(knt)->kev.filter])
 
@@ -201,6 +250,7 @@ const char *filter_name(short);
 
 int         kevent_wait(struct kqueue *, const struct timespec *);
 int         kevent_copyout(struct kqueue *, int, struct kevent *, int);
+int         kevent_copyin_one(struct kqueue *, const struct kevent *);
 void 		kevent_free(struct kqueue *);
 const char *kevent_dump(const struct kevent *);
 struct kqueue * kqueue_lookup(int);
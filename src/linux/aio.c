@@ -0,0 +1,222 @@
+/*
+ * Copyright (c) 2011 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <aio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "private.h"
+
+#if HAVE_LINUX_IO_URING
+
+/* Completions reaped per read of the ring */
+#define AIO_REAP_MAX    64
+
+/*
+ * The ident of an EVFILT_AIO knote is a pointer to a struct aiocb, whose
+ * aio_lio_opcode is LIO_READ or LIO_WRITE. Adding the knote starts the
+ * transfer, and the knote fires once, when the transfer is complete: data
+ * holds the number of bytes transferred, or the error number with
+ * EV_ERROR. The aiocb and its buffer must stay valid until then, even if
+ * the knote is deleted.
+ *
+ * The transfers run on an io_uring that the kqueue creates the first time
+ * it is needed. A knote holds a reference for the ring while its transfer
+ * is in flight, which the harvest drops when it reaps the completion.
+ */
+struct evfilt_data {
+    struct uring   *af_ring;
+};
+
+/* Make the knotes of the completed transfers ready; kf_mtx is held */
+static void
+evfilt_aio_harvest(struct filter *filt, struct epoll_event *ev UNUSED)
+{
+    struct evfilt_data *af = filt->kf_data;
+    struct knote *kn;
+    void *udata[AIO_REAP_MAX];
+    int res[AIO_REAP_MAX];
+    int i, n;
+
+    do {
+        n = linux_uring_aio_reap(af->af_ring, udata, res, AIO_REAP_MAX);
+        for (i = 0; i < n; i++) {
+            if ((kn = udata[i]) == NULL)
+                continue;   /* A cancellation */
+            kn->kdata.kn_aio.a_res = res[i];
+            atomic_barrier();
+            kn->kdata.kn_aio.a_done = 1;
+            if (!(kn->kn_flags & KNFL_KNOTE_DELETED))
+                (void) linux_knote_ready_async(kn);
+            knote_release(kn);
+        }
+    } while (n == AIO_REAP_MAX);
+}
+
+/*
+ * Create the ring the first time a transfer is started. Knotes of
+ * different aiocbs may get here at the same time, so the first one to
+ * finish installs it.
+ */
+static struct evfilt_data *
+aio_ring_create(struct filter *filt)
+{
+    struct evfilt_data *af;
+    struct epoll_event ev;
+
+    if ((af = filt->kf_data) != NULL)
+        return (af);
+
+    af = calloc(1, sizeof(*af));
+    if (af == NULL)
+        return (NULL);
+    if ((af->af_ring = linux_uring_aio_new()) == NULL) {
+        free(af);
+        return (NULL);
+    }
+    if (atomic_ptr_cas(&filt->kf_data, NULL, af) != NULL) {
+        linux_uring_aio_free(af->af_ring);
+        free(af);
+        return (filt->kf_data);
+    }
+
+    filt->kf_udata.ud_type = EPOLL_UDATA_FILTER;
+    filt->kf_udata.ud_ptr = filt;
+    filt->kf_harvest = evfilt_aio_harvest;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = &filt->kf_udata;
+    if (linux_poll_ctl(filt->kf_kqueue, EPOLL_CTL_ADD,
+                linux_uring_aio_fd(af->af_ring), &ev) < 0) {
+        /* The ring stays, and its completions are never reported */
+        dbg_perror("epoll_ctl(2)");
+    }
+
+    return (af);
+}
+
+static void
+evfilt_aio_destroy(struct filter *filt)
+{
+    struct evfilt_data *af = filt->kf_data;
+
+    if (af == NULL)
+        return;
+    linux_uring_aio_free(af->af_ring);
+    free(af);
+    filt->kf_data = NULL;
+}
+
+int
+evfilt_aio_copyout(struct kevent *dst, struct knote *src, void *ptr UNUSED)
+{
+    memcpy(dst, &src->kev, sizeof(*dst));
+    if (src->kdata.kn_aio.a_res < 0) {
+        dst->flags |= EV_ERROR;
+        dst->data = -src->kdata.kn_aio.a_res;
+    } else {
+        dst->data = src->kdata.kn_aio.a_res;
+    }
+
+    return (0);
+}
+
+int
+evfilt_aio_knote_create(struct filter *filt, struct knote *kn)
+{
+    struct aiocb *cb = (struct aiocb *) kn->kev.ident;
+    struct evfilt_data *af;
+
+    if (cb == NULL ||
+            (cb->aio_lio_opcode != LIO_READ && cb->aio_lio_opcode != LIO_WRITE)) {
+        errno = EINVAL;
+        return (-1);
+    }
+    if ((af = aio_ring_create(filt)) == NULL)
+        return (-1);
+
+    /* A transfer completes only once */
+    kn->kev.flags |= EV_ONESHOT;
+    kn->kdata.kn_aio.a_res = 0;
+    kn->kdata.kn_aio.a_done = 0;
+
+    knote_retain(kn);
+    if (linux_uring_aio_submit(af->af_ring, cb->aio_lio_opcode == LIO_WRITE,
+                cb->aio_fildes, (void *) cb->aio_buf, cb->aio_nbytes,
+                cb->aio_offset, kn) < 0) {
+        knote_release(kn);
+        return (-1);
+    }
+
+    return (0);
+}
+
+int
+evfilt_aio_knote_modify(struct filter *filt UNUSED, struct knote *kn UNUSED,
+        const struct kevent *kev UNUSED)
+{
+    return (-1); /* The transfer is already under way */
+}
+
+int
+evfilt_aio_knote_delete(struct filter *filt, struct knote *kn)
+{
+    struct evfilt_data *af = filt->kf_data;
+
+    linux_knote_unready(kn);
+    if (!kn->kdata.kn_aio.a_done)
+        linux_uring_aio_cancel(af->af_ring, kn);
+
+    return (0);
+}
+
+int
+evfilt_aio_knote_enable(struct filter *filt UNUSED, struct knote *kn)
+{
+    if (kn->kdata.kn_aio.a_done)
+        linux_knote_ready(kn);
+
+    return (0);
+}
+
+int
+evfilt_aio_knote_disable(struct filter *filt UNUSED, struct knote *kn)
+{
+    linux_knote_unready(kn);
+
+    return (0);
+}
+
+const struct filter evfilt_aio = {
+    EVFILT_AIO,
+    NULL,
+    evfilt_aio_destroy,
+    evfilt_aio_copyout,
+    evfilt_aio_knote_create,
+    evfilt_aio_knote_modify,
+    evfilt_aio_knote_delete,
+    evfilt_aio_knote_enable,
+    evfilt_aio_knote_disable,
+};
+
+#else
+
+const struct filter evfilt_aio = EVFILT_NOTIMPL;
+
+#endif /* HAVE_LINUX_IO_URING */
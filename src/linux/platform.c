@@ -16,16 +16,64 @@
 
 # define _GNU_SOURCE
 # include <poll.h>
+# include <sys/ioctl.h>
 #include "../common/private.h"
 
-//XXX-FIXME TEMP
-const struct filter evfilt_proc = EVFILT_NOTIMPL;
-
 /*
  * Per-thread epoll event buffer used to ferry data between
- * kevent_wait() and kevent_copyout().
+ * kevent_wait() and kevent_copyout(). It is allocated on first use and
+ * grows with the largest eventlist the thread has asked for, so it costs
+ * nothing for threads that never wait.
  */
-static __thread struct epoll_event epevt[MAX_KEVENT];
+#define EPEVT_MIN   64
+
+static __thread struct epoll_event *epevt;
+static __thread int epevt_size;
+static __thread int nepevt;
+
+static pthread_key_t  epevt_key;
+static pthread_once_t epevt_once = PTHREAD_ONCE_INIT;
+
+static void
+epevt_key_init(void)
+{
+    /* Free the buffer when the thread exits */
+    (void) pthread_key_create(&epevt_key, free);
+}
+
+/*
+ * Point <evs> at the calling thread's buffer, after growing it to hold
+ * <nevents> if possible. Returns the number of events it can hold, which
+ * is less than asked for only if the buffer could not be grown.
+ */
+int
+linux_epoll_buffer(struct epoll_event **evs, int nevents)
+{
+    struct epoll_event *p;
+    int size;
+
+    if (nevents > epevt_size) {
+        size = (epevt_size > 0) ? epevt_size : EPEVT_MIN;
+        while (size < nevents)
+            size = (size > INT_MAX / 2) ? nevents : size * 2;
+        if ((size_t) size > SIZE_MAX / sizeof(*p) ||
+                (p = realloc(epevt, size * sizeof(*p))) == NULL) {
+            dbg_printf("unable to grow the event buffer to %d", size);
+            if (epevt_size == 0) {
+                errno = ENOMEM;
+                return (-1);
+            }
+        } else {
+            (void) pthread_once(&epevt_once, epevt_key_init);
+            (void) pthread_setspecific(epevt_key, p);
+            epevt = p;
+            epevt_size = size;
+        }
+    }
+
+    *evs = epevt;
+    return (nevents < epevt_size ? nevents : epevt_size);
+}
 
 const struct kqueue_vtable kqops = {
     linux_kqueue_init,
@@ -38,20 +86,48 @@ const struct kqueue_vtable kqops = {
     linux_eventfd_close,
     linux_eventfd_raise,
     linux_eventfd_lower,
-    linux_eventfd_descriptor
+    linux_eventfd_descriptor,
+    NULL,
+    NULL,
+    linux_kqueue_busy_poll,
+    linux_kqueue_batch_data
 };
 
 int
 linux_kqueue_init(struct kqueue *kq)
 {
-    kq->kq_id = epoll_create(1);
-    if (kq->kq_id < 0) {
-        dbg_perror("epoll_create(2)");
-        return (-1);
+    const char *backend;
+    int i;
+
+    /* KQUEUE_BACKEND=io_uring selects the io_uring backend, if available */
+    backend = getenv("KQUEUE_BACKEND");
+    if (backend != NULL && strcmp(backend, "io_uring") == 0) {
+#if HAVE_LINUX_IO_URING
+        if (linux_uring_init(kq) == 0)
+            kq->kq_ops = &linux_uring_kqops;
+        else
+#endif
+            dbg_puts("io_uring is not available, falling back to epoll");
     }
+    if (kq->kq_ring == NULL) {
+        kq->kq_id = epoll_create(1);
+        if (kq->kq_id < 0) {
+            dbg_perror("epoll_create(2)");
+            return (-1);
+        }
+    }
+    TAILQ_INIT(&kq->kq_ready);
+    tracing_mutex_init(&kq->kq_ready_mtx, NULL);
+    for (i = 0; i < KNOTE_LOCK_STRIPES; i++)
+        tracing_mutex_init(&kq->kq_fdlock[i], NULL);
 
     if (filter_register_all(kq) < 0) {
-        close(kq->kq_id);
+#if HAVE_LINUX_IO_URING
+        if (kq->kq_ring != NULL)
+            linux_uring_free(kq);
+        else
+#endif
+            close(kq->kq_id);
         return (-1);
     }
 
@@ -126,81 +202,807 @@ linux_kevent_wait_hires(
     return (n);
 }
 
+#ifndef __NR_epoll_pwait2
+# define __NR_epoll_pwait2  441
+#endif
+
+/* Cleared when the kernel turns out not to have epoll_pwait2() */
+static volatile int have_epoll_pwait2 = 1;
+
+/*
+ * Wait with the full resolution of <ts> in a single syscall. Returns -1
+ * with ENOSYS if the kernel is older than 5.11, or if a seccomp filter
+ * does not know the syscall yet.
+ */
+static int
+linux_epoll_pwait2(int epfd, struct epoll_event *evs, int nevents,
+        const struct timespec *ts)
+{
+    int rv;
+
+    rv = (int) syscall(__NR_epoll_pwait2, epfd, evs, nevents, ts, NULL, 0);
+    if (rv < 0 && (errno == ENOSYS || errno == EPERM)) {
+        errno = ENOSYS;
+        dbg_puts("epoll_pwait2() is not supported, using epoll_wait()");
+        have_epoll_pwait2 = 0;
+    }
+    return (rv);
+}
+
+/*
+ * Busy polling
+ *
+ * A kqueue in busy-poll mode calls epoll_wait() with a zero timeout in a
+ * loop before it blocks. The spin starts at the budget, is halved when it
+ * ends without events, and doubles again when it finds some, so that a
+ * quiet kqueue mostly blocks while a busy one mostly spins.
+ */
+#ifndef EPIOCSPARAMS
+struct epoll_params {
+    uint32_t busy_poll_usecs;
+    uint16_t busy_poll_budget;
+    uint8_t  prefer_busy_poll;
+    uint8_t  __pad;
+};
+# define EPIOCSPARAMS   _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+#define BUSY_POLL_MAX_USECS     1000000     /* Spin for one second at most */
+
+int
+linux_kqueue_busy_poll(struct kqueue *kq, unsigned int usecs)
+{
+    struct epoll_params params;
+
+    if (usecs > BUSY_POLL_MAX_USECS) {
+        errno = EINVAL;
+        return (-1);
+    }
+
+    /* Let the kernel poll the devices of the sockets too (Linux 6.9) */
+    memset(&params, 0, sizeof(params));
+    params.busy_poll_usecs = usecs;
+    params.prefer_busy_poll = (usecs > 0);
+    if (ioctl(kqueue_epfd(kq), EPIOCSPARAMS, &params) < 0)
+        dbg_perror("ioctl(EPIOCSPARAMS)");
+
+    kq->kq_busy_nsecs = usecs * 1000;
+    kq->kq_spin_nsecs = usecs * 1000;
+    return (0);
+}
+
+static long
+linux_nsecs_since(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((now.tv_sec - start->tv_sec) * 1000000000L + (now.tv_nsec - start->tv_nsec));
+}
+
+/*
+ * Spin until an event is ready, the spin ends, or <ts> expires. On a miss,
+ * <ts> is updated with the time left to wait, if any.
+ * @return the number of events, or 0 if there were none
+ */
+static int
+linux_kevent_spin(struct kqueue *kq, struct epoll_event *evs, int nevents,
+        struct timespec *ts)
+{
+    struct timespec start;
+    long spin, elapsed, limit;
+    int nret;
+
+    spin = kq->kq_spin_nsecs;
+    limit = spin;
+    if (ts != NULL && ts->tv_sec == 0 && ts->tv_nsec < limit)
+        limit = ts->tv_nsec;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        nret = epoll_wait(kqueue_epfd(kq), evs, nevents, 0);
+        elapsed = linux_nsecs_since(&start);
+    } while (nret == 0 && elapsed < limit);
+    atomic_add(&kq->kq_stats.ks_spin_nsecs, elapsed);
+
+    if (nret > 0) {
+        atomic_inc(&kq->kq_stats.ks_spin_hits);
+        if (spin < kq->kq_busy_nsecs)
+            kq->kq_spin_nsecs = (spin * 2 < kq->kq_busy_nsecs) ? spin * 2 : kq->kq_busy_nsecs;
+    } else if (nret == 0) {
+        atomic_inc(&kq->kq_stats.ks_spin_misses);
+        if (spin > kq->kq_busy_nsecs / 16)
+            kq->kq_spin_nsecs = spin / 2;
+        if (ts != NULL) {
+            ts->tv_sec -= elapsed / 1000000000L;
+            ts->tv_nsec -= elapsed % 1000000000L;
+            if (ts->tv_nsec < 0) {
+                ts->tv_sec--;
+                ts->tv_nsec += 1000000000L;
+            }
+            if (ts->tv_sec < 0)
+                ts->tv_sec = ts->tv_nsec = 0;
+        }
+    }
+    return (nret);
+}
+
 int
 linux_kevent_wait(
         struct kqueue *kq, 
         int nevents,
         const struct timespec *ts)
 {
+    static const struct timespec ts_zero = { 0, 0 };
+    struct epoll_event *evs;
+    struct timespec left;
     int timeout, nret;
 
-    /* Use a high-resolution syscall if the timeout value is less than one millisecond.  */
-    if (ts != NULL && ts->tv_sec == 0 && ts->tv_nsec > 0 && ts->tv_nsec < 1000000) {
+    nepevt = 0;
+    if ((nevents = linux_epoll_buffer(&evs, nevents)) < 0)
+        return (-1);
+
+    /*
+     * Announce the waiter before looking at the ready lists, so that
+     * linux_knote_ready_async() either sees it or is seen by it.
+     */
+    atomic_inc(&kq->kq_nwaiters);
+
+    /* Knotes on the ready list can be returned without waiting */
+    if (!TAILQ_EMPTY(&kq->kq_ready) || kq->kq_pending != NULL)
+        ts = &ts_zero;
+    atomic_inc(&kq->kq_stats.ks_waits);
+
+    if (kq->kq_busy_nsecs > 0 && ts != &ts_zero &&
+            (ts == NULL || ts->tv_sec > 0 || ts->tv_nsec > 0)) {
+        if (ts != NULL)
+            left = *ts;
+        nret = linux_kevent_spin(kq, evs, nevents, (ts != NULL) ? &left : NULL);
+        if (nret != 0)
+            goto done;
+        if (ts != NULL)
+            ts = (left.tv_sec == 0 && left.tv_nsec == 0) ? &ts_zero : &left;
+    }
+
+    if (have_epoll_pwait2) {
+        dbg_puts("waiting for events");
+        nret = linux_epoll_pwait2(kqueue_epfd(kq), evs, nevents, ts);
+        if (nret >= 0 || errno != ENOSYS)
+            goto done;
+    }
+
+    if (ts == &ts_zero) {
+        timeout = 0;
+    } else if (ts != NULL && ts->tv_sec == 0 && ts->tv_nsec > 0 && ts->tv_nsec < 1000000) {
+        /* Use a high-resolution syscall if the timeout value is less than one millisecond.  */
         nret = linux_kevent_wait_hires(kq, ts);
-        if (nret <= 0)
+        if (nret <= 0) {
+            atomic_dec(&kq->kq_nwaiters);
             return (nret);
+        }
 
         /* epoll_wait() should have ready events */
         timeout = 0;
     } else {
-        /* Convert timeout to the format used by epoll_wait() */
+        /*
+         * Convert timeout to the format used by epoll_wait(), rounding up
+         * so that the wait does not end before the timeout
+         */
         if (ts == NULL) 
             timeout = -1;
         else
-            timeout = (1000 * ts->tv_sec) + (ts->tv_nsec / 1000000);
+            timeout = (1000 * ts->tv_sec) + ((ts->tv_nsec + 999999) / 1000000);
     }
 
     dbg_puts("waiting for events");
-    nret = epoll_wait(kqueue_epfd(kq), &epevt[0], nevents, timeout);
+    nret = epoll_wait(kqueue_epfd(kq), evs, nevents, timeout);
+done:
+    atomic_dec(&kq->kq_nwaiters);
     if (nret < 0) {
         dbg_perror("epoll_wait");
         return (-1);
     }
+    nepevt = nret;
+
+    if (nret == 0 && (!TAILQ_EMPTY(&kq->kq_ready) || kq->kq_pending != NULL))
+        return (1);
 
     return (nret);
 }
 
+/*
+ * Add a knote to the ready list of its kqueue. It will be copied out
+ * by the next call to kevent(), even if no descriptor becomes readable.
+ * The knote lock must be held.
+ *
+ * A knote that has been taken off the list by another thread, but not yet
+ * copied out, is left alone; that copyout will report the new state.
+ */
+void
+linux_knote_ready(struct knote *kn)
+{
+    struct kqueue *kq = kn->kn_kq;
+
+    tracing_mutex_lock(&kq->kq_ready_mtx);
+    if (kn->kn_queued == KNOTE_QUEUED_NO) {
+        kn->kn_queued = KNOTE_QUEUED_LIST;
+        TAILQ_INSERT_TAIL(&kq->kq_ready, kn, kn_ready);
+        kq->kq_nready++;
+    }
+    tracing_mutex_unlock(&kq->kq_ready_mtx);
+}
+
+/* The knote lock must be held */
+void
+linux_knote_unready(struct knote *kn)
+{
+    struct kqueue *kq = kn->kn_kq;
+
+    tracing_mutex_lock(&kq->kq_ready_mtx);
+    if (kn->kn_queued == KNOTE_QUEUED_LIST) {
+        TAILQ_REMOVE(&kq->kq_ready, kn, kn_ready);
+        kq->kq_nready--;
+    }
+    kn->kn_queued = KNOTE_QUEUED_NO;
+    tracing_mutex_unlock(&kq->kq_ready_mtx);
+}
+
+/* Take the first knote off the ready list, or return NULL */
+static struct knote *
+linux_knote_take(struct kqueue *kq)
+{
+    struct knote *kn;
+
+    tracing_mutex_lock(&kq->kq_ready_mtx);
+    kn = TAILQ_FIRST(&kq->kq_ready);
+    if (kn != NULL) {
+        TAILQ_REMOVE(&kq->kq_ready, kn, kn_ready);
+        kq->kq_nready--;
+        kn->kn_queued = KNOTE_QUEUED_TAKEN;
+    }
+    tracing_mutex_unlock(&kq->kq_ready_mtx);
+
+    return (kn);
+}
+
+/*
+ * Claim a knote taken by linux_knote_take(); the knote lock must be held.
+ * Returns zero if the knote was deleted or unreadied in the meantime.
+ */
+static int
+linux_knote_claim(struct knote *kn)
+{
+    struct kqueue *kq = kn->kn_kq;
+    int taken;
+
+    tracing_mutex_lock(&kq->kq_ready_mtx);
+    taken = (kn->kn_queued == KNOTE_QUEUED_TAKEN);
+    if (taken)
+        kn->kn_queued = KNOTE_QUEUED_NO;
+    tracing_mutex_unlock(&kq->kq_ready_mtx);
+
+    return (taken && !(kn->kn_flags & KNFL_KNOTE_DELETED));
+}
+
+/*
+ * Make a knote ready without holding the kqueue lock. The knote is pushed
+ * onto kq_pending, and moved to the ready list by linux_kqueue_collect().
+ *
+ * Returns 1 if the caller must wake up a thread blocked in epoll_wait(),
+ * which is only the case when the stack was empty and there are waiters;
+ * otherwise a wakeup is already on its way, or the next waiter will find
+ * the knote before it blocks.
+ */
 int
-linux_kevent_copyout(struct kqueue *kq, int nready,
-        struct kevent *eventlist, int nevents UNUSED)
+linux_knote_ready_async(struct knote *kn)
+{
+    struct kqueue *kq = kn->kn_kq;
+    struct knote *head;
+    uint32_t pending;
+
+    /* A knote that is still on the stack only has to count again */
+    for (;;) {
+        pending = atomic_cas(&kn->kn_pending, KNOTE_PENDING_NO, KNOTE_PENDING_READY);
+        if (pending == KNOTE_PENDING_NO)
+            break;
+        if (pending == KNOTE_PENDING_READY ||
+                atomic_cas(&kn->kn_pending, KNOTE_PENDING_CANCELLED,
+                    KNOTE_PENDING_READY) == KNOTE_PENDING_CANCELLED)
+            return (0);
+        /* linux_kqueue_collect() took it off in the meantime */
+    }
+
+    do {
+        head = kq->kq_pending;
+        kn->kn_pending_next = head;
+    } while (atomic_ptr_cas(&kq->kq_pending, head, kn) != head);
+
+    return (head == NULL && kq->kq_nwaiters > 0);
+}
+
+/*
+ * Forget a knote that linux_knote_ready_async() has pushed onto kq_pending.
+ * It stays on the stack, and linux_kqueue_collect() skips it. Taking it off
+ * would mean taking the locks of the other knotes on the stack, which the
+ * caller may not do while it holds its own.
+ */
+void
+linux_knote_unpend(struct knote *kn)
+{
+    (void) atomic_cas(&kn->kn_pending, KNOTE_PENDING_READY, KNOTE_PENDING_CANCELLED);
+}
+
+/*
+ * Move the knotes from kq_pending to the ready list. The lock of each knote
+ * is taken in turn, so the caller must not hold any knote lock.
+ */
+void
+linux_kqueue_collect(struct kqueue *kq)
+{
+    struct knote *kn, *next, *prev;
+    tracing_mutex_t *mtx;
+    uint32_t pending;
+
+    do {
+        kn = kq->kq_pending;
+    } while (kn != NULL && atomic_ptr_cas(&kq->kq_pending, kn, NULL) != kn);
+
+    /* Reverse the stack, so that knotes are returned in the order they fired */
+    for (prev = NULL; kn != NULL; kn = next) {
+        next = kn->kn_pending_next;
+        kn->kn_pending_next = prev;
+        prev = kn;
+    }
+    for (kn = prev; kn != NULL; kn = next) {
+        next = kn->kn_pending_next;
+        mtx = knote_mtx(kn);
+        tracing_mutex_lock(mtx);
+        do {
+            pending = kn->kn_pending;
+        } while (atomic_cas(&kn->kn_pending, pending, KNOTE_PENDING_NO) != pending);
+        /* It may have been deleted or disabled while it was on the stack */
+        if (pending == KNOTE_PENDING_READY &&
+                !(kn->kn_flags & KNFL_KNOTE_DELETED) && !(kn->kev.flags & EV_DISABLE))
+            linux_knote_ready(kn);
+        tracing_mutex_unlock(mtx);
+    }
+}
+
+/** @return the number of events copied to <dst>, either 0 or 1 */
+int
+linux_knote_copyout(struct kevent *dst, struct knote *kn, void *ptr)
+{
+    struct filter *filt;
+    int rv;
+
+    filt = &kn->kn_kq->kq_filt[~(kn->kev.filter)];
+    rv = filt->kf_copyout(dst, kn, ptr);
+    if (slowpath(rv < 0)) {
+        dbg_puts("knote_copyout failed");
+        /* XXX-FIXME: hard to handle this without losing events */
+        abort();
+    }
+
+    /* If an empty kevent structure is returned, the event is discarded. */
+    /* TODO: add these semantics to windows + solaris platform.c */
+    if (slowpath(dst->filter == 0)) {
+        dbg_puts("spurious wakeup, discarding event");
+        return (0);
+    }
+
+    /*
+     * Certain flags cause the associated knote to be deleted
+     * or disabled.
+     */
+    if (dst->flags & EV_DISPATCH) 
+        knote_disable(filt, kn); //FIXME: Error checking
+    if (dst->flags & EV_ONESHOT) {
+        knote_delete(filt, kn); //FIXME: Error checking
+    }
+
+    return (1);
+}
+
+/*
+ * Socket queue sizes
+ *
+ * The read and write filters report the bytes in the receive or send
+ * queue of a socket, which costs an ioctl(2) per event; knotes with
+ * NOTE_NODATA go without. While a kqueue in batch mode copies out events,
+ * the requests are collected instead, and linux_sockq_flush() hands them
+ * to io_uring at once (see linux_uring_sockq()).
+ */
+#define SOCKQ_MIN   16
+
+static __thread struct sockq_req *sockq;
+static __thread int sockq_size;
+static __thread int nsockq;
+static __thread int sockq_batch;    /* Collect the requests of this copyout */
+
+static pthread_key_t  sockq_key;
+static pthread_once_t sockq_once = PTHREAD_ONCE_INIT;
+
+static void
+sockq_key_init(void)
+{
+    (void) pthread_key_create(&sockq_key, free);
+}
+
+static void
+sockq_result(struct kevent *dst, int cmd, int res)
+{
+    if (res < 0) {
+        /* race condition with socket close, so ignore this error */
+        dbg_puts("ioctl(2) of socket failed");
+        dst->data = 0;
+        return;
+    }
+    dst->data = res;
+    if (cmd == SIOCINQ && res == 0)
+        dst->flags |= EV_EOF;
+}
+
+static int
+sockq_ioctl(struct kevent *dst, int cmd)
+{
+    int n;
+
+    if (ioctl(dst->ident, cmd, &n) < 0)
+        return (-errno);
+    return (n);
+}
+
+/* Queue a request for linux_sockq_flush(); returns -1 if there is no room */
+static int
+sockq_defer(struct kevent *dst, int cmd)
+{
+    struct sockq_req *p;
+    int size;
+
+    if (nsockq == sockq_size) {
+        size = (sockq_size > 0) ? sockq_size * 2 : SOCKQ_MIN;
+        if ((p = realloc(sockq, size * sizeof(*p))) == NULL)
+            return (-1);
+        (void) pthread_once(&sockq_once, sockq_key_init);
+        (void) pthread_setspecific(sockq_key, p);
+        sockq = p;
+        sockq_size = size;
+    }
+    sockq[nsockq].sq_dst = dst;
+    sockq[nsockq].sq_cmd = cmd;
+    nsockq++;
+
+    return (0);
+}
+
+/*
+ * Set the data of a socket event to the SIOCINQ or SIOCOUTQ of the socket.
+ * In batch mode, this happens at the end of the copyout.
+ */
+void
+linux_sockq_data(struct kevent *dst, int cmd)
+{
+    if (sockq_batch && sockq_defer(dst, cmd) == 0)
+        return;
+    sockq_result(dst, cmd, sockq_ioctl(dst, cmd));
+}
+
+/*
+ * Like linux_sockq_data(), for a filter that needs the size right away,
+ * so the request is never deferred. Returns the size, or -1 on error.
+ */
+int
+linux_sockq_size(struct kevent *dst, int cmd)
+{
+    int res;
+
+    res = sockq_ioctl(dst, cmd);
+    sockq_result(dst, cmd, res);
+    return ((res < 0) ? -1 : res);
+}
+
+/* Answer the requests collected by the copyout */
+static void
+linux_sockq_flush(void)
+{
+    int i, batched;
+
+    batched = 0;
+#if HAVE_LINUX_URING_SOCKQ
+    if (nsockq > 1)
+        batched = (linux_uring_sockq(sockq, nsockq) == 0);
+#endif
+    for (i = 0; i < nsockq; i++) {
+        /* A socket that io_uring cannot query falls back to ioctl(2) */
+        if (!batched || sockq[i].sq_res == -EOPNOTSUPP || sockq[i].sq_res == -EINVAL)
+            sockq[i].sq_res = sockq_ioctl(sockq[i].sq_dst, sockq[i].sq_cmd);
+        sockq_result(sockq[i].sq_dst, sockq[i].sq_cmd, sockq[i].sq_res);
+    }
+    nsockq = 0;
+}
+
+int
+linux_kqueue_batch_data(struct kqueue *kq, int enable)
+{
+#if HAVE_LINUX_URING_SOCKQ
+    kq->kq_batch_data = (enable != 0);
+    return (0);
+#else
+    (void) kq;
+    (void) enable;
+    errno = ENOTSUP;
+    return (-1);
+#endif
+}
+
+/* Returns non-zero if the epoll events are of interest to the knote */
+static int
+fd_knote_wants(struct knote *kn, uint32_t events)
+{
+    if (kn == NULL || (kn->kev.flags & EV_DISABLE))
+        return (0);
+    if (events & (EPOLLHUP | EPOLLERR))
+        return (1);
+    return ((events & kn->data.events & ~(EPOLLET | EPOLLONESHOT)) != 0);
+}
+
+/*
+ * Accepted connections
+ *
+ * A listening socket in NOTE_ACCEPT mode reports each connection that the
+ * read filter accepts as an event of its own, up to the limit in the data
+ * field of the knote. With NOTE_ACCEPT_READ, each new descriptor also
+ * gets an EVFILT_READ knote with the udata of the listening knote. This
+ * is done by linux_accept_register() once the knote locks are released,
+ * and the flag is cleared from the event if it fails.
+ */
+static __thread int accept_read;    /* The copyout has connections to add */
+
+static int
+fd_accept_copyout(struct kevent *dst, int nevents, struct knote *kn, struct epoll_event *ev)
+{
+    struct filter *filt;
+    int n, max;
+
+    filt = &kn->kn_kq->kq_filt[~EVFILT_READ];
+    max = (kn->kev.data > 0 && kn->kev.data < nevents) ? kn->kev.data : nevents;
+    for (n = 0; n < max; ) {
+        (void) filt->kf_copyout(&dst[n], kn, ev);
+        if (dst[n].filter == 0)
+            break;
+        if (dst[n++].flags & EV_ERROR)
+            break;
+    }
+    if (n == 0) {
+        /* Nothing was reported, so a one-shot entry has to fire again */
+        if (kn->kn_fds->fds_disarmed)
+            (void) linux_fd_update(filt, kn->kn_fds);
+        return (0);
+    }
+    if (kn->kev.fflags & NOTE_ACCEPT_READ)
+        accept_read = 1;
+
+    /* EV_DISPATCH and EV_ONESHOT apply to the batch as a whole */
+    if (dst[0].flags & EV_DISPATCH)
+        knote_disable(filt, kn); //FIXME: Error checking
+    if (dst[0].flags & EV_ONESHOT)
+        knote_delete(filt, kn); //FIXME: Error checking
+    else if (n == max && !(dst[0].flags & EV_DISPATCH))
+        linux_knote_ready(kn);  /* There may be connections left */
+
+    return (n);
+}
+
+static void
+linux_accept_register(struct kqueue *kq, struct kevent *eventlist, int nevents)
+{
+    struct kevent kev;
+    int i;
+
+    for (i = 0; i < nevents; i++) {
+        if (eventlist[i].filter != EVFILT_READ ||
+                !(eventlist[i].fflags & NOTE_ACCEPT) ||
+                !(eventlist[i].fflags & NOTE_ACCEPT_READ) ||
+                (eventlist[i].flags & EV_ERROR))
+            continue;
+        EV_SET(&kev, eventlist[i].data, EVFILT_READ, EV_ADD, 0, 0, eventlist[i].udata);
+        if (kevent_copyin_one(kq, &kev) < 0) {
+            dbg_printf("fd %d: %s", (int) eventlist[i].data, strerror(errno));
+            eventlist[i].fflags &= ~NOTE_ACCEPT_READ;
+        }
+    }
+    accept_read = 0;
+}
+
+/*
+ * Copy out one of the knotes sharing an epoll entry, which may take up to
+ * <nevents> events.
+ *
+ * A level-triggered knote that shares an edge-triggered entry with an
+ * EV_CLEAR knote will not be reported by epoll again while it stays ready,
+ * so it goes back on the ready list to be checked with poll(2) next time.
+ */
+static int
+fd_knote_copyout(struct kevent *dst, int nevents, struct knote *kn, struct epoll_event *ev)
+{
+    int requeue;
+
+    if (kn->kn_flags & KNFL_ACCEPT)
+        return (fd_accept_copyout(dst, nevents, kn, ev));
+
+    requeue = (kn->kn_fds->fds_events & EPOLLET) &&
+        !(kn->kev.flags & (EV_CLEAR | EV_ONESHOT | EV_DISPATCH));
+    if (linux_knote_copyout(dst, kn, ev) == 0) {
+        /* Nothing was reported, so a one-shot entry has to fire again */
+        if (kn->kn_fds->fds_disarmed)
+            (void) linux_fd_update(&kn->kn_kq->kq_filt[~(kn->kev.filter)], kn->kn_fds);
+        return (0);
+    }
+    if (requeue)
+        linux_knote_ready(kn);
+
+    return (1);
+}
+
+/* Copy out a knote from the ready list */
+static int
+ready_knote_copyout(struct kevent *dst, int nevents, struct knote *kn)
+{
+    struct epoll_event ev;
+    struct pollfd pfd;
+
+    if (kn->kn_fds == NULL)
+        return (linux_knote_copyout(dst, kn, NULL));
+
+    /* The knote may not be ready anymore */
+    pfd.fd = kn->kn_fds->fds_fd;
+    pfd.events = kn->data.events & ~(EPOLLET | EPOLLONESHOT);
+    pfd.revents = 0;
+    if (poll(&pfd, 1, 0) <= 0) {
+        /* Re-arm a one-shot entry that fired while the knote was queued */
+        if (kn->kn_fds->fds_disarmed)
+            (void) linux_fd_update(&kn->kn_kq->kq_filt[~(kn->kev.filter)], kn->kn_fds);
+        return (0);
+    }
+
+    /* The poll(2) and epoll(7) event bits have the same values */
+    memset(&ev, 0, sizeof(ev));
+    ev.events = pfd.revents;
+    return (fd_knote_copyout(dst, nevents, kn, &ev));
+}
+
+/*
+ * Copy out the knotes of a descriptor in the epoll set. The knote lock
+ * for the descriptor must be held.
+ */
+static int
+fd_event_copyout(struct kqueue *kq, struct kevent *eventlist, int nevents,
+        uintptr_t fd, struct epoll_event *ev)
+{
+    struct fd_state *fds;
+    struct knote *kn, *wkn;
+    int nret = 0;
+
+    kn = knote_lookup(&kq->kq_filt[~EVFILT_READ], fd);
+    if (kn != NULL)
+        fds = kn->kn_fds;
+    else if ((wkn = knote_lookup(&kq->kq_filt[~EVFILT_WRITE], fd)) != NULL)
+        fds = wkn->kn_fds;
+    else
+        fds = NULL;
+    if (fds == NULL) {
+        dbg_printf("fd %d was deleted after epoll_wait()", (int) fd);
+        return (0);
+    }
+    if (fds->fds_events & EPOLLONESHOT)
+        fds->fds_disarmed = 1;
+
+    /* 
+     * Fan the event out to the read and write knotes. The write knote
+     * is looked up first, since copying out the read knote may free
+     * the descriptor state. A knote that does not fit in the eventlist
+     * goes on the ready list.
+     */
+    kn = fds->fds_read;
+    wkn = fds->fds_write;
+    if (!fd_knote_wants(wkn, ev->events))
+        wkn = NULL;
+    if (fd_knote_wants(kn, ev->events)) {
+        if (nevents > 0)
+            nret += fd_knote_copyout(&eventlist[nret], nevents, kn, ev);
+        else
+            linux_knote_ready(kn);
+    }
+    if (wkn != NULL) {
+        if (nret < nevents)
+            nret += fd_knote_copyout(&eventlist[nret], nevents - nret, wkn, ev);
+        else
+            linux_knote_ready(wkn);
+    }
+
+    return (nret);
+}
+
+int
+linux_kevent_copyout(struct kqueue *kq, int nready UNUSED,
+        struct kevent *eventlist, int nevents)
+{
+    return (linux_epoll_copyout(kq, epevt, nepevt, eventlist, nevents));
+}
+
+/*
+ * Copy out the knotes for the events in <evs>, then the knotes on the
+ * ready list. This is shared by the epoll and io_uring backends.
+ */
+int
+linux_epoll_copyout(struct kqueue *kq, struct epoll_event *evs, int nevs,
+        struct kevent *eventlist, int nevents)
 {
     struct epoll_event *ev;
+    struct epoll_udata *ud;
     struct filter *filt;
     struct knote *kn;
-    int i, nret, rv;
-
-    nret = nready;
-    for (i = 0; i < nready; i++) {
-        ev = &epevt[i];
-        kn = (struct knote *) ev->data.ptr;
-        filt = &kq->kq_filt[~(kn->kev.filter)];
-        rv = filt->kf_copyout(eventlist, kn, ev);
-        if (slowpath(rv < 0)) {
-            dbg_puts("knote_copyout failed");
-            /* XXX-FIXME: hard to handle this without losing events */
-            abort();
-        }
+    tracing_mutex_t *mtx;
+    uintptr_t ident;
+    size_t n;
+    int i, nret;
 
-        /*
-         * Certain flags cause the associated knote to be deleted
-         * or disabled.
-         */
-        if (eventlist->flags & EV_DISPATCH) 
-            knote_disable(filt, kn); //FIXME: Error checking
-        if (eventlist->flags & EV_ONESHOT) {
-            knote_delete(filt, kn); //FIXME: Error checking
-        }
+    if (kq->kq_pending != NULL)
+        linux_kqueue_collect(kq);
 
-        /* If an empty kevent structure is returned, the event is discarded. */
-        /* TODO: add these semantics to windows + solaris platform.c */
-        if (fastpath(eventlist->filter != 0)) {
-            eventlist++;
-        } else {
-            dbg_puts("spurious wakeup, discarding event");
-            nret--;
+    sockq_batch = kq->kq_batch_data;
+    nret = 0;
+    for (i = 0; i < nevs; i++) {
+        ev = &evs[i];
+        if (!EPOLL_DATA_IS_KNOTE(ev->data.u64)) {
+            /* Let the filter move the knotes that fired to the ready list */
+            ud = (struct epoll_udata *) ev->data.ptr;
+            filt = (struct filter *) ud->ud_ptr;
+            tracing_mutex_lock(&filt->kf_mtx);
+            filt->kf_harvest(filt, ev);
+            tracing_mutex_unlock(&filt->kf_mtx);
+            continue;
         }
+        filt = &kq->kq_filt[EPOLL_DATA_FILTER(ev->data.u64)];
+        ident = EPOLL_DATA_IDENT(ev->data.u64);
+        mtx = filter_knote_mtx(filt, ident);
+        tracing_mutex_lock(mtx);
+        if (filt->kf_id == EVFILT_READ) {
+            nret += fd_event_copyout(kq, &eventlist[nret], nevents - nret, ident, ev);
+        } else if (nret < nevents && (kn = knote_lookup(filt, ident)) != NULL) {
+            /* 
+             * Only a socket with two knotes can fill the eventlist early,
+             * and the remaining knotes here are level-triggered, so epoll
+             * will report them again.
+             */
+            nret += linux_knote_copyout(&eventlist[nret], kn, ev);
+        }
+        tracing_mutex_unlock(mtx);
     }
 
+    /* Knotes that a filter made ready while harvesting events */
+    if (kq->kq_pending != NULL)
+        linux_kqueue_collect(kq);
+
+    /* Level-triggered knotes go back on the list; only visit them once. */
+    for (n = kq->kq_nready; n > 0 && nret < nevents; n--) {
+        if ((kn = linux_knote_take(kq)) == NULL)
+            break;
+        mtx = knote_mtx(kn);
+        tracing_mutex_lock(mtx);
+        if (linux_knote_claim(kn))
+            nret += ready_knote_copyout(&eventlist[nret], nevents - nret, kn);
+        tracing_mutex_unlock(mtx);
+    }
+
+    if (nsockq > 0)
+        linux_sockq_flush();
+    sockq_batch = 0;
+    if (accept_read)
+        linux_accept_register(kq, eventlist, nret);
+
+    if (nret == 0)
+        atomic_inc(&kq->kq_stats.ks_futile_wakeups);
     return (nret);
 }
 
@@ -366,16 +1168,141 @@ epoll_event_dump(struct epoll_event *evt)
 #undef EPEVT_DUMP
 }
 
+/*
+ * Attach a socket knote to the epoll entry of its descriptor, creating the
+ * entry for the first knote. The knote of the other filter is found by
+ * looking up the same ident.
+ */
+int
+linux_fd_attach(struct filter *filt, struct knote *kn)
+{
+    struct kqueue *kq = filt->kf_kqueue;
+    struct fd_state *fds;
+    struct knote *peer;
+
+    if (kn->kev.filter == EVFILT_READ)
+        peer = knote_lookup(&kq->kq_filt[~EVFILT_WRITE], kn->kev.ident);
+    else
+        peer = knote_lookup(&kq->kq_filt[~EVFILT_READ], kn->kev.ident);
+
+    if (peer != NULL && peer->kn_fds != NULL) {
+        fds = peer->kn_fds;
+    } else {
+        fds = calloc(1, sizeof(*fds));
+        if (fds == NULL) {
+            dbg_perror("calloc(3)");
+            return (-1);
+        }
+        fds->fds_fd = kn->kev.ident;
+    }
+
+    if (kn->kev.filter == EVFILT_READ)
+        fds->fds_read = kn;
+    else
+        fds->fds_write = kn;
+    kn->kn_fds = fds;
+
+    if (linux_fd_update(filt, fds) < 0) {
+        (void) linux_fd_detach(filt, kn);
+        return (-1);
+    }
+
+    return (0);
+}
+
+int
+linux_fd_detach(struct filter *filt, struct knote *kn)
+{
+    struct fd_state *fds = kn->kn_fds;
+    int rv;
+
+    if (fds == NULL)
+        return (0);
+
+    if (fds->fds_read == kn)
+        fds->fds_read = NULL;
+    else
+        fds->fds_write = NULL;
+    kn->kn_fds = NULL;
+    linux_knote_unready(kn);
+
+    rv = linux_fd_update(filt, fds);
+    if (fds->fds_read == NULL && fds->fds_write == NULL)
+        free(fds);
+
+    return (rv);
+}
+
+/*
+ * Bring the epoll entry of a descriptor in line with its enabled knotes.
+ *
+ * The entry is edge-triggered if either knote wants EV_CLEAR, and is
+ * only one-shot when a single knote is enabled; otherwise the other knote
+ * could miss events. knote_disable() stops a one-shot knote in that case.
+ *
+ * Once a one-shot entry has fired, the kernel has already disarmed it, so
+ * disabling or deleting its knote costs no system call, and enabling it
+ * again is a single EPOLL_CTL_MOD. A disarmed entry is left in the set
+ * when its last knote goes away; it never reports anything, and it is
+ * replaced if the descriptor is added again, or dropped by the kernel
+ * when the file is closed.
+ */
 int
-epoll_update(int op, struct filter *filt, struct knote *kn, struct epoll_event *ev)
+linux_fd_update(struct filter *filt, struct fd_state *fds)
 {
-    dbg_printf("op=%d fd=%d events=%s", op, (int)kn->kev.ident, 
-            epoll_event_dump(ev));
-    if (epoll_ctl(filter_epfd(filt), op, kn->kev.ident, ev) < 0) {
+    struct knote *knotes[2] = { fds->fds_read, fds->fds_write };
+    struct epoll_event ev;
+    uint32_t events, oneshot;
+    int i, n, op;
+
+    events = 0;
+    oneshot = EPOLLONESHOT;
+    for (i = n = 0; i < 2; i++) {
+        if (knotes[i] == NULL || (knotes[i]->kev.flags & EV_DISABLE))
+            continue;
+        events |= knotes[i]->data.events & ~EPOLLONESHOT;
+        oneshot &= knotes[i]->data.events;
+        n++;
+    }
+    if (n == 1)
+        events |= oneshot;
+
+    if (fds->fds_disarmed) {
+        if (events == 0)
+            return (0);
+        op = EPOLL_CTL_MOD;
+    } else if (events == fds->fds_events) {
+        return (0);
+    } else if (fds->fds_events == 0) {
+        op = EPOLL_CTL_ADD;
+    } else if (events == 0) {
+        op = EPOLL_CTL_DEL;
+    } else {
+        op = EPOLL_CTL_MOD;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.u64 = EPOLL_DATA_KNOTE(EVFILT_READ, fds->fds_fd);
+    dbg_printf("op=%d fd=%d events=%s", op, fds->fds_fd, epoll_event_dump(&ev));
+    if (linux_poll_ctl(filt->kf_kqueue, op, fds->fds_fd, &ev) < 0) {
+        /* The descriptor may have been closed already */
+        if (op == EPOLL_CTL_DEL && (errno == EBADF || errno == ENOENT)) {
+            fds->fds_events = 0;
+            return (0);
+        }
+        /* A disarmed entry that was left behind by an earlier knote */
+        if (op == EPOLL_CTL_ADD && errno == EEXIST &&
+                linux_poll_ctl(filt->kf_kqueue, EPOLL_CTL_MOD, fds->fds_fd, &ev) == 0)
+            goto out;
         dbg_printf("epoll_ctl(2): %s", strerror(errno));
         return (-1);
     }
 
+out:
+    fds->fds_events = events;
+    fds->fds_disarmed = 0;
+
     return (0);
 }
 
@@ -18,11 +18,15 @@
 #define  _KQUEUE_LINUX_PLATFORM_H
 
 struct filter;
+struct uring;
 
 #include <sys/syscall.h>
 #include <sys/epoll.h>
 #include <sys/queue.h>
 #include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include <asm/socket.h>     /* SO_PROTOCOL */
 #if HAVE_SYS_EVENTFD_H
 # include <sys/eventfd.h>
 #else
@@ -53,41 +57,210 @@ struct filter;
 extern long int syscall (long int __sysno, ...);
 #endif
  
+/*
+ * The io_uring code needs the headers of Linux 5.11 or later. The backend
+ * passes the timeout of a wait with IORING_ENTER_EXT_ARG and changes its
+ * epoll set with IORING_OP_EPOLL_CTL. With older headers, every kqueue
+ * uses epoll.
+ */
+#if HAVE_LINUX_IO_URING_H && HAVE_DECL_IORING_FEAT_EXT_ARG && \
+    HAVE_DECL_IORING_ENTER_EXT_ARG && HAVE_DECL_IORING_OP_EPOLL_CTL
+# define HAVE_LINUX_IO_URING 1
+#endif
+
+/* Socket queue sizes are batched with IORING_OP_URING_CMD (Linux 5.19) */
+#if HAVE_LINUX_IO_URING && HAVE_DECL_IORING_OP_URING_CMD
+# define HAVE_LINUX_URING_SOCKQ 1
+#endif
+
 /* Convenience macros to access the epoll descriptor for the kqueue */
 #define kqueue_epfd(kq)     ((kq)->kq_id)
 #define filter_epfd(filt)   ((filt)->kf_kqueue->kq_id)
 
+/*
+ * Change the set of descriptors watched by a kqueue. This is epoll_ctl(2),
+ * unless the kqueue uses the io_uring backend (see uring.c). Each change
+ * is counted in ks_ctl_calls.
+ */
+#if HAVE_LINUX_IO_URING
+# define linux_poll_ctl(kq, op, fd, ev) \
+    (atomic_inc(&(kq)->kq_stats.ks_ctl_calls), \
+     ((kq)->kq_ring != NULL) ? linux_uring_ctl((kq), (op), (fd), (ev)) : \
+     epoll_ctl(kqueue_epfd(kq), (op), (fd), (ev)))
+#else
+# define linux_poll_ctl(kq, op, fd, ev) \
+    (atomic_inc(&(kq)->kq_stats.ks_ctl_calls), \
+     epoll_ctl(kqueue_epfd(kq), (op), (fd), (ev)))
+#endif
+
+/*
+ * A descriptor that is shared by all knotes of a filter carries a pointer
+ * to the filter's kf_udata in epoll_event.data.ptr.
+ */
+#define EPOLL_UDATA_FILTER  2   /* ud_ptr is a struct filter */
+
+struct epoll_udata {
+    int     ud_type;
+    void   *ud_ptr;
+};
+
+/*
+ * A descriptor that belongs to a knote, or to the read and write knotes of
+ * a socket, is identified by filter and ident instead. Another thread may
+ * delete the knote between epoll_wait() and linux_kevent_copyout(), so it
+ * is looked up again when the event is copied out. The low bit tells these
+ * values apart from a pointer to a struct epoll_udata.
+ */
+#define EPOLL_DATA_KNOTE(filter, ident) \
+    (((uint64_t) (ident) << 8) | ((uint64_t) ~(filter) << 1) | 1)
+#define EPOLL_DATA_IS_KNOTE(data)   ((data) & 1)
+#define EPOLL_DATA_FILTER(data)     ((int) (((data) >> 1) & 0x7f))
+#define EPOLL_DATA_IDENT(data)      ((uintptr_t) ((data) >> 8))
+
+#define KNOTE_EPOLL_DATA(kn)    EPOLL_DATA_KNOTE((kn)->kev.filter, (kn)->kev.ident)
+
+/*
+ * The EVFILT_READ and EVFILT_WRITE knotes for a descriptor share a single
+ * entry in the epoll set, since epoll only allows one per descriptor.
+ */
+struct fd_state {
+    int                 fds_fd;
+    struct knote       *fds_read;
+    struct knote       *fds_write;
+    uint32_t            fds_events;     /* Events in the epoll set, or 0 */
+    int                 fds_disarmed;   /* EPOLLONESHOT fired; needs a MOD */
+};
+
+/*
+ * Knotes are locked individually instead of by kq_mtx, so that threads
+ * sharing a kqueue can copy out independent events at the same time. The
+ * read and write knotes of a descriptor share an epoll entry, so both of
+ * those filters lock knotes by descriptor. The other filters keep state
+ * that is shared by all of their knotes, and lock the whole filter.
+ *
+ * Lock order: knote lock, then kf_knote_mtx, then kq_ready_mtx.
+ */
+#define KNOTE_PLATFORM_LOCKING  1
+#define KNOTE_LOCK_STRIPES      64
+
+#define filter_knote_mtx(filt, ident) \
+    (((filt)->kf_id == EVFILT_READ || (filt)->kf_id == EVFILT_WRITE) ? \
+     &(filt)->kf_kqueue->kq_fdlock[(uintptr_t) (ident) % KNOTE_LOCK_STRIPES] : \
+     &(filt)->kf_mtx)
+
 /*
  * Additional members of struct filter
  */
-#undef FILTER_PLATFORM_SPECIFIC 
+#define FILTER_PLATFORM_SPECIFIC \
+    struct epoll_udata kf_udata; /* Used by a descriptor shared by all knotes */ \
+    void (*kf_harvest)(struct filter *, struct epoll_event *)
 
 /*
  * Additional members of struct knote
  */
 #define KNOTE_PLATFORM_SPECIFIC \
-    int kn_epollfd; /* A copy of filter->epfd */      \
+    struct fd_state *kn_fds; /* Used by read.c and write.c */ \
+    TAILQ_ENTRY(knote) kn_ready; /* Entry in kq_ready */ \
+    int kn_queued; /* KNOTE_QUEUED_*; protected by kq_ready_mtx */ \
+    struct knote *kn_pending_next; /* Entry in kq_pending */ \
+    volatile uint32_t kn_pending; /* KNOTE_PENDING_*; non-zero while on kq_pending */ \
     union { \
-        int kn_timerfd; \
-        int kn_signalfd; \
+        struct { \
+            LIST_ENTRY(knote) t_entries; /* Entry in a timer wheel slot */ \
+            uint64_t t_expire;  /* Next expiration, in ns */ \
+            uint64_t t_period;  /* Interval in ns, or 0 for a one-shot */ \
+            uint64_t t_count;   /* Expirations not yet copied out */ \
+            unsigned int t_slot; /* Position in the timer wheel */ \
+        } kn_timer; \
+        uint64_t kn_sigcount; \
         int kn_inotifyfd; \
-        int kn_eventfd; \
+        struct { \
+            LIST_ENTRY(knote) v_entries; /* Entry in the wd index */ \
+            int v_wd;           /* inotify watch descriptor, or -1 */ \
+            uint32_t v_events;  /* inotify events not yet copied out */ \
+        } kn_vnode; \
+        struct { \
+            off_t f_size;       /* Size at the last fstat(2), or -1 */ \
+            int f_wd;           /* inotify watch descriptor, or -1 */ \
+            LIST_ENTRY(knote) f_entries; /* Entry in the wd index */ \
+        } kn_file; \
+        struct { \
+            int s_lowat;        /* Low-water mark to restore, or -1 */ \
+            int s_sndbuf;       /* SO_SNDBUF, for the NOTE_LOWAT check */ \
+        } kn_sock; \
+        struct { \
+            int a_res;          /* Result of the transfer, or -errno */ \
+            int a_done;         /* Non-zero once it has completed */ \
+        } kn_aio; \
+        int kn_pidfd; \
     } kdata
 
+/* Values of knote->kn_queued */
+#define KNOTE_QUEUED_NO     0
+#define KNOTE_QUEUED_LIST   1   /* On kq_ready */
+#define KNOTE_QUEUED_TAKEN  2   /* Taken off kq_ready, not yet copied out */
+
+/* Values of knote->kn_pending */
+#define KNOTE_PENDING_NO        0
+#define KNOTE_PENDING_READY     1   /* On kq_pending, to be made ready */
+#define KNOTE_PENDING_CANCELLED 2   /* On kq_pending, to be skipped */
+
 /*
  * Additional members of struct kqueue
  */
 #define KQUEUE_PLATFORM_SPECIFIC \
-    struct epoll_event kq_plist[MAX_KEVENT]; \
-    size_t kq_nplist
+    TAILQ_HEAD(, knote) kq_ready; /* Knotes that fired without an epoll event */ \
+    size_t kq_nready; \
+    tracing_mutex_t kq_ready_mtx; /* Protects kq_ready */ \
+    tracing_mutex_t kq_fdlock[KNOTE_LOCK_STRIPES]; /* Locks for read and write knotes */ \
+    struct knote *kq_pending; /* Lock-free stack of knotes readied by other threads */ \
+    volatile uint32_t kq_nwaiters; /* Threads waiting in kevent_wait() */ \
+    unsigned int kq_busy_nsecs; /* Longest spin before blocking, or 0 */ \
+    unsigned int kq_spin_nsecs; /* Current spin, adapted to the hit rate */ \
+    int kq_batch_data; /* Fetch socket queue sizes in batches */ \
+    struct uring *kq_ring /* The io_uring backend, or NULL for epoll */
 
 int     linux_kqueue_init(struct kqueue *);
 void    linux_kqueue_free(struct kqueue *);
 
 int     linux_kevent_wait(struct kqueue *, int, const struct timespec *);
 int     linux_kevent_copyout(struct kqueue *, int, struct kevent *, int);
+int     linux_kqueue_busy_poll(struct kqueue *, unsigned int);
+int     linux_kqueue_batch_data(struct kqueue *, int);
+int     linux_epoll_buffer(struct epoll_event **, int);
+int     linux_epoll_copyout(struct kqueue *, struct epoll_event *, int,
+            struct kevent *, int);
+
+/* A SIOCINQ or SIOCOUTQ request for the data of a socket event */
+struct sockq_req {
+    struct kevent  *sq_dst;
+    int             sq_cmd;
+    int             sq_res;     /* The result, or -errno */
+};
+
+void    linux_sockq_data(struct kevent *, int);
+int     linux_sockq_size(struct kevent *, int);
+
+/* The io_uring backend */
+
+int     linux_uring_init(struct kqueue *);
+void    linux_uring_free(struct kqueue *);
+int     linux_uring_ctl(struct kqueue *, int, int, struct epoll_event *);
+int     linux_uring_sockq(struct sockq_req *, int);
+struct uring *linux_uring_aio_new(void);
+void    linux_uring_aio_free(struct uring *);
+int     linux_uring_aio_fd(struct uring *);
+int     linux_uring_aio_submit(struct uring *, int, int, void *, size_t, off_t, void *);
+void    linux_uring_aio_cancel(struct uring *, void *);
+int     linux_uring_aio_reap(struct uring *, void **, int *, int);
+extern const struct kqueue_vtable linux_uring_kqops;
 
-int     linux_knote_copyout(struct kevent *, struct knote *);
+int     linux_knote_copyout(struct kevent *, struct knote *, void *);
+void    linux_knote_ready(struct knote *);
+void    linux_knote_unready(struct knote *);
+int     linux_knote_ready_async(struct knote *);
+void    linux_knote_unpend(struct knote *);
+void    linux_kqueue_collect(struct kqueue *);
 
 int     linux_eventfd_init(struct eventfd *);
 void    linux_eventfd_close(struct eventfd *);
@@ -102,7 +275,9 @@ int     linux_fd_to_path(char *, size_t, int);
 
 /* epoll-related functions */
 
-int     epoll_update(int, struct filter *, struct knote *, struct epoll_event *);
+int     linux_fd_attach(struct filter *, struct knote *);
+int     linux_fd_detach(struct filter *, struct knote *);
+int     linux_fd_update(struct filter *, struct fd_state *);
 char *  epoll_event_dump(struct epoll_event *);
 
 #endif  /* ! _KQUEUE_LINUX_PLATFORM_H */
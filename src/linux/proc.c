@@ -14,226 +14,160 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-#include <errno.h>
-#include <err.h>
-#include <fcntl.h>
-#include <pthread.h>
-#include <signal.h>
-#include <stdlib.h>
-#include <stdio.h>
-#include <sys/queue.h>
-#include <sys/types.h>
 #include <sys/wait.h>
-#include <string.h>
-#include <unistd.h>
 
-#include <limits.h>
-#include <sys/inotify.h>
-#include <sys/epoll.h>
-
-#include "sys/event.h"
 #include "private.h"
 
+/* The process descriptor API is newer than most C libraries */
+#ifndef SYS_pidfd_open
+# define SYS_pidfd_open 434
+#endif
+#ifndef P_PIDFD
+# define P_PIDFD 3
+#endif
 
-/* XXX-FIXME Should only have one wait_thread per process.
-   Now, there is one thread per kqueue
- */
-struct evfilt_data {
-    pthread_t       wthr_id;
-    pthread_cond_t   wait_cond;
-    pthread_mutex_t  wait_mtx;
-};
+static int
+pidfd_open(pid_t pid)
+{
+    return (syscall(SYS_pidfd_open, pid, 0));
+}
 
-//FIXME: WANT: static void *
-void *
-wait_thread(void *arg)
+/* Convert the result of waitid(2) to a wait(2) status, as BSD reports it */
+static intptr_t
+proc_status(const siginfo_t *si)
 {
-    struct filter *filt = (struct filter *) arg;
-    uint64_t counter = 1;
-    const int options = WEXITED | WNOWAIT; 
-    struct knote *kn;
-    siginfo_t si;
-    sigset_t sigmask;
-
-    /* Block all signals */
-    sigfillset (&sigmask);
-    pthread_sigmask(SIG_BLOCK, &sigmask, NULL);
-
-    for (;;) {
-
-        /* Wait for a child process to exit(2) */
-        if (waitid(P_ALL, 0, &si, options) != 0) {
-            if (errno == ECHILD) {
-                dbg_puts("got ECHILD, waiting for wakeup condition");
-                pthread_mutex_lock(&filt->kf_data->wait_mtx);
-                pthread_cond_wait(&filt->kf_data->wait_cond, &filt->kf_data->wait_mtx);
-                pthread_mutex_unlock(&filt->kf_data->wait_mtx);
-                dbg_puts("awoken from ECHILD-induced sleep");
-                continue;
-            }
-
-            dbg_puts("  waitid(2) returned");
-            if (errno == EINTR)
-                continue;
-            dbg_perror("waitid(2)");
-            break; 
-        }
-
-        /* Scan the wait queue to see if anyone is interested */
-        kn = knote_lookup(filt, si.si_pid);
-        if (kn == NULL) 
-            continue;
-
-        /* Create a proc_event */
-        if (si.si_code == CLD_EXITED) {
-            kn->kev.data = si.si_status;
-        } else if (si.si_code == CLD_KILLED) {
-            /* FIXME: probably not true on BSD */
-            /* FIXME: arbitrary non-zero number */
-            kn->kev.data = 254; 
-        } else {
-            /* Should never happen. */
-            /* FIXME: arbitrary non-zero number */
-            kn->kev.data = 1; 
-        }
-
-        knote_enqueue(filt, kn);
-
-        /* Indicate read(2) readiness */
-        if (write(filt->kf_pfd, &counter, sizeof(counter)) < 0) {
-            if (errno != EAGAIN) {
-                dbg_printf("write(2): %s", strerror(errno));
-                /* TODO: set filter error flag */
-                break;
-                }
-        }
+    switch (si->si_code) {
+        case CLD_EXITED:
+            return ((si->si_status & 0xff) << 8);
+        case CLD_KILLED:
+            return (si->si_status);
+        case CLD_DUMPED:
+            return (si->si_status | 0x80);
+        default:
+            return (0);
     }
-
-    /* TODO: error handling */
-
-    return (NULL);
 }
 
 int
-evfilt_proc_init(struct filter *filt)
+evfilt_proc_copyout(struct kevent *dst, struct knote *src, void *ptr UNUSED)
 {
-#if FIXME
-    struct evfilt_data *ed;
-    int efd = -1;
-
-    if ((ed = calloc(1, sizeof(*ed))) == NULL)
-        return (-1);
-    filt->kf_data = ed;
+    siginfo_t si;
 
-    pthread_mutex_init(&ed->wait_mtx, NULL);
-    pthread_cond_init(&ed->wait_cond, NULL);
-    if ((efd = eventfd(0, 0)) < 0) 
-        goto errout;
-    if (fcntl(filt->kf_pfd, F_SETFL, O_NONBLOCK) < 0) 
-        goto errout;
-    filt->kf_pfd = efd;
-    if (pthread_create(&ed->wthr_id, NULL, wait_thread, filt) != 0) 
-        goto errout;
+    memcpy(dst, &src->kev, sizeof(*dst));
+    dst->fflags = NOTE_EXIT;
+    dst->flags |= EV_EOF | EV_ONESHOT;
+
+    /*
+     * WNOWAIT leaves the zombie to be reaped by the application. Only the
+     * parent can obtain the exit status; other processes get ECHILD.
+     */
+    memset(&si, 0, sizeof(si));
+    if (waitid((idtype_t) P_PIDFD, src->kdata.kn_pidfd, &si, 
+                WEXITED | WNOWAIT | WNOHANG) == 0) {
+        dst->data = proc_status(&si);
+    } else {
+        if (errno != ECHILD)
+            dbg_perror("waitid(2)");
+        dst->data = 0;
+    }
 
+    /* The process is gone, so the knote will not fire again */
+    src->kev.flags |= EV_ONESHOT;
 
     return (0);
-
-errout:
-    if (efd >= 0)
-        close(efd);
-    free(ed);
-    close(filt->kf_pfd);
-    return (-1);
-#endif
-    return (-1); /*STUB*/
 }
 
-void
-evfilt_proc_destroy(struct filter *filt)
+static int
+proc_watch(struct filter *filt, struct knote *kn)
 {
-//TODO:    pthread_cancel(filt->kf_data->wthr_id);
-    close(filt->kf_pfd);
+    struct epoll_event ev;
+
+    /* The pidfd becomes readable when the process exits */
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = KNOTE_EPOLL_DATA(kn);
+    if (linux_poll_ctl(filt->kf_kqueue, EPOLL_CTL_ADD, kn->kdata.kn_pidfd, &ev) < 0) {
+        dbg_perror("epoll_ctl(2)");
+        return (-1);
+    }
+
+    return (0);
 }
 
-int
-evfilt_proc_copyout(struct filter *filt, 
-            struct kevent *dst, 
-            int maxevents)
+static int
+proc_unwatch(struct filter *filt, struct knote *kn)
 {
-    struct knote *kn;
-    int nevents = 0;
-    uint64_t cur;
-
-    /* Reset the counter */
-    if (read(filt->kf_pfd, &cur, sizeof(cur)) < sizeof(cur)) {
-        dbg_printf("read(2): %s", strerror(errno));
+    if (linux_poll_ctl(filt->kf_kqueue, EPOLL_CTL_DEL, kn->kdata.kn_pidfd, NULL) < 0) {
+        dbg_perror("epoll_ctl(2)");
         return (-1);
     }
-    dbg_printf("  counter=%llu", (unsigned long long) cur);
-
-    for (kn = knote_dequeue(filt); kn != NULL; kn = knote_dequeue(filt)) {
-        kevent_dump(&kn->kev);
-        memcpy(dst, &kn->kev, sizeof(*dst));
-
-        if (kn->kev.flags & EV_DISPATCH) {
-            KNOTE_DISABLE(kn);
-        }
-        if (kn->kev.flags & EV_ONESHOT) {
-            knote_free(filt, kn);
-        } else {
-            kn->kev.data = 0; //why??
-        }
 
+    return (0);
+}
 
-        if (++nevents > maxevents)
-            break;
-        dst++;
+int
+evfilt_proc_knote_create(struct filter *filt, struct knote *kn)
+{
+    /* Only NOTE_EXIT is supported; other fflags are accepted but never fire */
+    kn->kdata.kn_pidfd = pidfd_open(kn->kev.ident);
+    if (kn->kdata.kn_pidfd < 0) {
+        dbg_perror("pidfd_open(2)");
+        return (-1);
     }
+    dbg_printf("created pidfd %d for pid %u", kn->kdata.kn_pidfd,
+            (unsigned int) kn->kev.ident);
 
-    if (knote_events_pending(filt)) {
-    /* XXX-FIXME: If there are leftover events on the waitq, 
-       re-arm the eventfd. list */
-        abort();
+    if (proc_watch(filt, kn) < 0) {
+        (void) close(kn->kdata.kn_pidfd);
+        kn->kdata.kn_pidfd = -1;
+        return (-1);
     }
 
-    return (nevents);
-}
- 
-int
-evfilt_proc_knote_create(struct filter *filt, struct knote *kn)
-{
-    return (0); /* STUB */
+    return (0);
 }
 
 int
-evfilt_proc_knote_modify(struct filter *filt, struct knote *kn, 
-        const struct kevent *kev)
+evfilt_proc_knote_modify(struct filter *filt UNUSED, struct knote *kn UNUSED, 
+        const struct kevent *kev UNUSED)
 {
-    return (0); /* STUB */
+    /* Nothing to do since the pid does not change. */
+
+    return (0);
 }
 
 int
 evfilt_proc_knote_delete(struct filter *filt, struct knote *kn)
 {
-    return (0); /* STUB */
+    int rv = 0;
+
+    if (kn->kdata.kn_pidfd < 0)
+        return (0);
+
+    /* Closing the pidfd removes it from the epoll set */
+    if (!(kn->kev.flags & EV_DISABLE))
+        rv = proc_unwatch(filt, kn);
+    (void) close(kn->kdata.kn_pidfd);
+    kn->kdata.kn_pidfd = -1;
+
+    return (rv);
 }
 
 int
 evfilt_proc_knote_enable(struct filter *filt, struct knote *kn)
 {
-    return (0); /* STUB */
+    return (proc_watch(filt, kn));
 }
 
 int
 evfilt_proc_knote_disable(struct filter *filt, struct knote *kn)
 {
-    return (0); /* STUB */
+    return (proc_unwatch(filt, kn));
 }
 
-const struct filter evfilt_proc_DEADWOOD = {
-    0, //XXX-FIXME broken: EVFILT_PROC,
-    evfilt_proc_init,
-    evfilt_proc_destroy,
+const struct filter evfilt_proc = {
+    EVFILT_PROC,
+    NULL,
+    NULL,
     evfilt_proc_copyout,
     evfilt_proc_knote_create,
     evfilt_proc_knote_modify,
@@ -14,11 +14,15 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#define _GNU_SOURCE     /* accept4() */
 #include <errno.h>
 #include <fcntl.h>
 #include <linux/sockios.h>
+#include <linux/tcp.h>
+#include <netinet/in.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <sys/ioctl.h>
@@ -30,14 +34,295 @@
 
 #include "private.h"
 
+/* Size of the buffer that inotify events are read into */
+#define FILE_BUFSIZE    (16 * 1024)
+
+/* Initial number of buckets in the watch descriptor index */
+#define FILE_HASHSIZE   64
+
+/*
+ * A regular file is readable until its end, and then it is watched with
+ * inotify, so that its knote becomes ready again when the file grows or
+ * is truncated. Every watched knote in a kqueue shares one inotify
+ * descriptor, and is indexed by watch descriptor, like EVFILT_VNODE.
+ *
+ * Read knotes are locked by descriptor rather than by kf_mtx, so the index
+ * has a lock of its own, and an inotify event makes its knotes ready with
+ * linux_knote_ready_async(). Lock order: knote lock or kf_mtx, then rf_mtx.
+ */
+struct evfilt_data {
+    int             rf_inotifyfd;
+    tracing_mutex_t rf_mtx;                 /* Protects the index */
+    size_t          rf_count;
+    size_t          rf_size;                /* Number of buckets, a power of two */
+    LIST_HEAD(file_hash, knote) *rf_hash;
+    char            rf_buf[FILE_BUFSIZE]
+                        __attribute__ ((aligned(__alignof__(struct inotify_event))));
+};
+
+static struct file_hash *
+file_bucket(struct evfilt_data *rf, int wd)
+{
+    return (&rf->rf_hash[(unsigned int) wd & (rf->rf_size - 1)]);
+}
+
+static int
+file_hash_grow(struct evfilt_data *rf)
+{
+    struct file_hash *old = rf->rf_hash;
+    size_t i, oldsize = rf->rf_size;
+    struct knote *kn;
+
+    rf->rf_hash = calloc(oldsize * 2, sizeof(*rf->rf_hash));
+    if (rf->rf_hash == NULL) {
+        rf->rf_hash = old;
+        return (-1);
+    }
+    rf->rf_size = oldsize * 2;
+    for (i = 0; i < rf->rf_size; i++)
+        LIST_INIT(&rf->rf_hash[i]);
+
+    for (i = 0; i < oldsize; i++) {
+        while ((kn = LIST_FIRST(&old[i])) != NULL) {
+            LIST_REMOVE(kn, kdata.kn_file.f_entries);
+            LIST_INSERT_HEAD(file_bucket(rf, kn->kdata.kn_file.f_wd),
+                    kn, kdata.kn_file.f_entries);
+        }
+    }
+    free(old);
+
+    return (0);
+}
+
+/* Make the knotes watching a file ready; rf_mtx must be held */
+static void
+file_event(struct evfilt_data *rf, struct inotify_event *evt)
+{
+    struct knote *kn, *next;
+    size_t i;
+
+    if (evt->wd < 0) {
+        /* IN_Q_OVERFLOW: any of the files may have changed */
+        dbg_puts("inotify event queue overflow");
+        for (i = 0; i < rf->rf_size; i++) {
+            LIST_FOREACH(kn, &rf->rf_hash[i], kdata.kn_file.f_entries)
+                (void) linux_knote_ready_async(kn);
+        }
+        return;
+    }
+
+    for (kn = LIST_FIRST(file_bucket(rf, evt->wd)); kn != NULL; kn = next) {
+        next = LIST_NEXT(kn, kdata.kn_file.f_entries);
+        if (kn->kdata.kn_file.f_wd != evt->wd)
+            continue;
+
+        if (evt->mask & IN_IGNORED) {
+            /* The kernel removed the watch, e.g. the file was deleted */
+            LIST_REMOVE(kn, kdata.kn_file.f_entries);
+            kn->kdata.kn_file.f_wd = -1;
+            rf->rf_count--;
+            continue;
+        }
+
+        (void) linux_knote_ready_async(kn);
+    }
+}
+
+/*
+ * Read the inotify events; kf_mtx is held. The knotes are moved to the
+ * ready list by linux_epoll_copyout().
+ */
+static void
+evfilt_read_harvest(struct filter *filt, struct epoll_event *ev UNUSED)
+{
+    struct evfilt_data *rf = filt->kf_data;
+    struct inotify_event *evt;
+    ssize_t n, off;
+
+    for (;;) {
+        n = read(rf->rf_inotifyfd, rf->rf_buf, sizeof(rf->rf_buf));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                dbg_perror("read(2) from inotify");
+            return;
+        }
+
+        tracing_mutex_lock(&rf->rf_mtx);
+        for (off = 0; off < n; off += sizeof(*evt) + evt->len) {
+            evt = (struct inotify_event *) (rf->rf_buf + off);
+            file_event(rf, evt);
+        }
+        tracing_mutex_unlock(&rf->rf_mtx);
+
+        /* Stop once there is clearly nothing left to read */
+        if ((size_t) n < sizeof(rf->rf_buf) - (sizeof(*evt) + NAME_MAX + 1))
+            return;
+    }
+}
+
+/*
+ * Create the inotify descriptor the first time a file reaches its end.
+ * Knotes of different descriptors may get here at the same time, so the
+ * first one to finish installs it.
+ */
+static struct evfilt_data *
+file_watch_create(struct filter *filt)
+{
+    struct evfilt_data *rf;
+    struct epoll_event ev;
+    size_t i;
+
+    if ((rf = filt->kf_data) != NULL)
+        return (rf);
+
+    rf = calloc(1, sizeof(*rf));
+    if (rf == NULL)
+        return (NULL);
+    rf->rf_size = FILE_HASHSIZE;
+    rf->rf_hash = calloc(rf->rf_size, sizeof(*rf->rf_hash));
+    if (rf->rf_hash == NULL) {
+        free(rf);
+        return (NULL);
+    }
+    for (i = 0; i < rf->rf_size; i++)
+        LIST_INIT(&rf->rf_hash[i]);
+    tracing_mutex_init(&rf->rf_mtx, NULL);
+
+    rf->rf_inotifyfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (rf->rf_inotifyfd < 0) {
+        dbg_perror("inotify_init1(2)");
+        goto errout;
+    }
+    if (atomic_ptr_cas(&filt->kf_data, NULL, rf) != NULL) {
+        (void) close(rf->rf_inotifyfd);
+        tracing_mutex_destroy(&rf->rf_mtx);
+        free(rf->rf_hash);
+        free(rf);
+        return (filt->kf_data);
+    }
+
+    filt->kf_udata.ud_type = EPOLL_UDATA_FILTER;
+    filt->kf_udata.ud_ptr = filt;
+    filt->kf_harvest = evfilt_read_harvest;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = &filt->kf_udata;
+    if (linux_poll_ctl(filt->kf_kqueue, EPOLL_CTL_ADD, rf->rf_inotifyfd, &ev) < 0) {
+        /* The descriptor stays, and the files are simply not watched */
+        dbg_perror("epoll_ctl(2)");
+    }
+
+    return (rf);
+
+errout:
+    tracing_mutex_destroy(&rf->rf_mtx);
+    free(rf->rf_hash);
+    free(rf);
+    return (NULL);
+}
+
+static void
+evfilt_read_destroy(struct filter *filt)
+{
+    struct evfilt_data *rf = filt->kf_data;
+
+    if (rf == NULL)
+        return;
+    (void) close(rf->rf_inotifyfd);
+    tracing_mutex_destroy(&rf->rf_mtx);
+    free(rf->rf_hash);
+    free(rf);
+    filt->kf_data = NULL;
+}
+
+/*
+ * Watch a regular file for changes. Returns 1 if the watch is new, 0 if
+ * the knote was already watching the file, and -1 on failure.
+ */
+static int
+file_watch(struct filter *filt, struct knote *kn)
+{
+    struct evfilt_data *rf;
+    char path[64];
+    int wd;
+
+    if (kn->kdata.kn_file.f_wd >= 0)
+        return (0);
+    if ((rf = file_watch_create(filt)) == NULL)
+        return (-1);
+
+    /* The magic link is followed to the file behind the descriptor */
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", (int) kn->kev.ident);
+    wd = inotify_add_watch(rf->rf_inotifyfd, path, IN_MODIFY);
+    if (wd < 0) {
+        dbg_perror("inotify_add_watch(2)");
+        return (-1);
+    }
+
+    tracing_mutex_lock(&rf->rf_mtx);
+    if (rf->rf_count >= rf->rf_size)
+        (void) file_hash_grow(rf);
+    kn->kdata.kn_file.f_wd = wd;
+    LIST_INSERT_HEAD(file_bucket(rf, wd), kn, kdata.kn_file.f_entries);
+    rf->rf_count++;
+    tracing_mutex_unlock(&rf->rf_mtx);
+
+    return (1);
+}
+
+/* Stop watching a file; an inotify event that raced with this is dropped */
+static void
+file_unwatch(struct filter *filt, struct knote *kn)
+{
+    struct evfilt_data *rf = filt->kf_data;
+    struct knote *ent;
+    int wd = kn->kdata.kn_file.f_wd;
+
+    if (wd >= 0) {
+        tracing_mutex_lock(&rf->rf_mtx);
+        if (kn->kdata.kn_file.f_wd >= 0) {
+            LIST_REMOVE(kn, kdata.kn_file.f_entries);
+            kn->kdata.kn_file.f_wd = -1;
+            rf->rf_count--;
+
+            /* Keep the watch while another knote refers to the same file */
+            LIST_FOREACH(ent, file_bucket(rf, wd), kdata.kn_file.f_entries) {
+                if (ent->kdata.kn_file.f_wd == wd)
+                    break;
+            }
+            if (ent == NULL && inotify_rm_watch(rf->rf_inotifyfd, wd) < 0 &&
+                    errno != EINVAL)
+                dbg_perror("inotify_rm_watch(2)");
+        }
+        tracing_mutex_unlock(&rf->rf_mtx);
+    }
+
+    linux_knote_unpend(kn);
+    linux_knote_unready(kn);
+}
+
 /*
  * Return the offset from the current position to end of file.
+ *
+ * For a regular file, FIONREAD is the same thing in one system call, but
+ * truncated to an int, so it is only trusted while the file is known to
+ * be smaller than INT_MAX bytes. A result of zero or less is checked with
+ * lseek(2) and fstat(2), which also update the known size.
  */
 static intptr_t
-get_eof_offset(int fd)
+get_eof_offset(struct knote *kn)
 {
+    const int fd = kn->kev.ident;
     off_t curpos;
     struct stat sb;
+    int n;
+
+    if (kn->kdata.kn_file.f_size >= 0 && kn->kdata.kn_file.f_size < INT_MAX &&
+            ioctl(fd, FIONREAD, &n) == 0 && n > 0)
+        return (n);
 
     curpos = lseek(fd, 0, SEEK_CUR);
     if (curpos == (off_t) -1) {
@@ -48,61 +333,139 @@ get_eof_offset(int fd)
         dbg_perror("fstat(2)");
         sb.st_size = 1;
     }
+    kn->kdata.kn_file.f_size = sb.st_size;
 
     dbg_printf("curpos=%zu size=%zu\n", (size_t)curpos, (size_t)sb.st_size);
     return (sb.st_size - curpos); //FIXME: can overflow
 }
 
+/*
+ * Report the socket as readable only once NOTE_LOWAT bytes are queued.
+ * TCP honors SO_RCVLOWAT in poll(2), so the kernel stops waking us up for
+ * partial data. Other descriptors ignore it, and the copyout checks the
+ * size of the queue instead; the knote becomes edge-triggered, so that a
+ * short queue is not reported again until more data arrives.
+ */
+static void
+lowat_watch(struct knote *kn)
+{
+    socklen_t slen;
+    int proto, lowat;
+
+    if (kn->kev.data <= 1)
+        return;
+    lowat = (kn->kev.data > INT_MAX) ? INT_MAX : (int) kn->kev.data;
+
+    slen = sizeof(proto);
+    if (getsockopt(kn->kev.ident, SOL_SOCKET, SO_PROTOCOL, &proto, &slen) == 0 &&
+            proto == IPPROTO_TCP) {
+        slen = sizeof(kn->kdata.kn_sock.s_lowat);
+        if (getsockopt(kn->kev.ident, SOL_SOCKET, SO_RCVLOWAT,
+                    &kn->kdata.kn_sock.s_lowat, &slen) == 0 &&
+                setsockopt(kn->kev.ident, SOL_SOCKET, SO_RCVLOWAT,
+                    &lowat, sizeof(lowat)) == 0)
+            return;
+        dbg_perror("setsockopt(2)");
+        kn->kdata.kn_sock.s_lowat = -1;
+    }
+
+    kn->kn_flags |= KNFL_LOWAT_CHECK;
+    kn->data.events = (kn->data.events & ~EPOLLONESHOT) | EPOLLET;
+}
+
+/* Put back the SO_RCVLOWAT that lowat_watch() replaced */
+static void
+lowat_unwatch(struct knote *kn)
+{
+    if (kn->kdata.kn_sock.s_lowat < 0)
+        return;
+    if (setsockopt(kn->kev.ident, SOL_SOCKET, SO_RCVLOWAT,
+                &kn->kdata.kn_sock.s_lowat, sizeof(kn->kdata.kn_sock.s_lowat)) < 0)
+        dbg_perror("setsockopt(2)");    /* The socket may be closed */
+    kn->kdata.kn_sock.s_lowat = -1;
+}
+
+/*
+ * Return the number of connections waiting to be accepted on a listening
+ * socket. TCP reports the length of the accept queue of a listener in the
+ * tcpi_unacked field of TCP_INFO. For other sockets, the length is not
+ * known, so it is reported as 1.
+ */
+static intptr_t
+get_backlog(struct knote *kn)
+{
+    struct tcp_info ti;
+    socklen_t slen;
+
+    slen = sizeof(ti);
+    if (getsockopt(kn->kev.ident, IPPROTO_TCP, TCP_INFO, &ti, &slen) < 0 ||
+            slen < offsetof(struct tcp_info, tcpi_unacked) + sizeof(ti.tcpi_unacked))
+        return (1);
+
+    return (ti.tcpi_unacked);
+}
+
+/*
+ * In NOTE_ACCEPT mode, each event is a connection accepted from the
+ * listening socket, with the new descriptor in data. fd_accept_copyout()
+ * calls this once for each event it has room for, until none is left.
+ */
+static int
+accept_copyout(struct kevent *dst, struct knote *src)
+{
+    int fd, error;
+
+    do {
+        fd = accept4(src->kev.ident, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    } while (fd < 0 && (errno == ECONNABORTED || errno == EINTR));
+    if (fd < 0) {
+        error = errno;
+        if (error == EAGAIN || error == EWOULDBLOCK) {
+            dst->filter = 0;    /* Will cause the kevent to be discarded */
+        } else {
+            dbg_perror("accept4(2)");
+            dst->flags |= EV_ERROR;
+            dst->data = error;
+        }
+        return (0);
+    }
+    dst->data = fd;
+
+    return (0);
+}
+
 int
 evfilt_read_copyout(struct kevent *dst, struct knote *src, void *ptr)
 {
     struct epoll_event * const ev = (struct epoll_event *) ptr;
 
-    /* Special case: for regular files, return the offset from current position to end of file */
+    /*
+     * Special case: for regular files, return the offset from current
+     * position to end of file. The knote stays on the ready list until
+     * the end of file is reached; after that, or after each event with
+     * EV_CLEAR, it waits for the file to change.
+     */
     if (src->kn_flags & KNFL_REGULAR_FILE) {
         memcpy(dst, &src->kev, sizeof(*dst));
-        dst->data = get_eof_offset(src->kev.ident);
-
-        if (dst->data == 0) {
+        dst->data = get_eof_offset(src);
+        if (dst->data == 0)
             dst->filter = 0;    /* Will cause the kevent to be discarded */
-            if (epoll_ctl(src->kn_epollfd, EPOLL_CTL_DEL, src->kdata.kn_eventfd, NULL) < 0) {
-                dbg_perror("epoll_ctl(2)");
-                return (-1);
-            }
-
-#if FIXME
-            /* XXX-FIXME Switch to using kn_inotifyfd to monitor for IN_ATTRIB events
-                         that may signify the file size has changed.
-
-                         This code is not tested.
-             */
-            int inofd;
-            char path[PATH_MAX];
-
-            inofd = inotify_init();
-            if (inofd < 0) {
-                dbg_perror("inotify_init(2)");
-                (void) close(inofd);
-                return (-1);
-            } 
-            src->kdata.kn_inotifyfd = inofd;
-            if (linux_fd_to_path(&path[0], sizeof(path), src->kev.ident) < 0)
-                return (-1);
-            if (inotify_add_watch(inofd, path, IN_ATTRIB) < 0) {
-                dbg_perror("inotify_add_watch");
-                return (-1);
-            }
-            if (epoll_ctl(src->kn_epollfd, EPOLL_CTL_ADD, src->kdata.kn_inotifyfd, NULL) < 0) {
-                dbg_perror("epoll_ctl(2)");
-                return (-1);
-            }
-            /* FIXME: race here, should we check the EOF status again ? */
-#endif
+        if (dst->data != 0 && !(src->kev.flags & EV_CLEAR)) {
+            linux_knote_ready(src);
+        } else if (file_watch(&src->kn_kq->kq_filt[~EVFILT_READ], src) > 0 &&
+                dst->data == 0 && get_eof_offset(src) != 0) {
+            /* The file changed before the watch was in place */
+            linux_knote_ready(src);
         }
 
         return (0);
     }
 
+    if (src->kn_flags & KNFL_ACCEPT) {
+        memcpy(dst, &src->kev, sizeof(*dst));
+        return (accept_copyout(dst, src));
+    }
+
     dbg_printf("epoll: %s", epoll_event_dump(ev));
     memcpy(dst, &src->kev, sizeof(*dst));
 #if defined(HAVE_EPOLLRDHUP)
@@ -116,24 +479,20 @@ evfilt_read_copyout(struct kevent *dst, struct knote *src, void *ptr)
         dst->fflags = 1; /* FIXME: Return the actual socket error */
           
     if (src->kn_flags & KNFL_PASSIVE_SOCKET) {
-        /* On return, data contains the length of the 
-           socket backlog. This is not available under Linux.
-         */
-        dst->data = 1;
+        /* On return, data contains the length of the socket backlog */
+        dst->data = get_backlog(src);
+        if (dst->data == 0 && !(dst->flags & EV_EOF) && !(ev->events & EPOLLERR))
+            dst->filter = 0;    /* Another thread accepted the connections */
+    } else if (src->kn_flags & KNFL_LOWAT_CHECK) {
+        if (linux_sockq_size(dst, SIOCINQ) < src->kev.data && !(dst->flags & EV_EOF))
+            dst->filter = 0;    /* Will cause the kevent to be discarded */
+    } else if (src->kev.fflags & NOTE_NODATA) {
+        dst->data = 0;
     } else {
         /* On return, data contains the number of bytes of protocol
            data available to read.
          */
-        int i;
-        if (ioctl(dst->ident, SIOCINQ, &i) < 0) {
-            /* race condition with socket close, so ignore this error */
-            dbg_puts("ioctl(2) of socket failed");
-            dst->data = 0;
-        } else {
-            dst->data = i;
-            if (dst->data == 0)
-                dst->flags |= EV_EOF;
-        }
+        linux_sockq_data(dst, SIOCINQ);
     }
 
     return (0);
@@ -142,11 +501,26 @@ evfilt_read_copyout(struct kevent *dst, struct knote *src, void *ptr)
 int
 evfilt_read_knote_create(struct filter *filt, struct knote *kn)
 {
-    struct epoll_event ev;
+    int flags;
 
     if (linux_get_descriptor_type(kn) < 0)
         return (-1);
 
+    /*
+     * Only a listening socket can accept connections. It is made
+     * non-blocking, so that accept_copyout() stops when none is left.
+     */
+    if (kn->kev.fflags & NOTE_ACCEPT) {
+        if (!(kn->kn_flags & KNFL_PASSIVE_SOCKET))
+            return (-1);
+        if ((flags = fcntl(kn->kev.ident, F_GETFL)) < 0 ||
+                (!(flags & O_NONBLOCK) && fcntl(kn->kev.ident, F_SETFL, flags | O_NONBLOCK) < 0)) {
+            dbg_perror("fcntl(2)");
+            return (-1);
+        }
+        kn->kn_flags |= KNFL_ACCEPT;
+    }
+
     /* Convert the kevent into an epoll_event */
 #if defined(HAVE_EPOLLRDHUP)
     kn->data.events = EPOLLIN | EPOLLRDHUP;
@@ -158,36 +532,26 @@ evfilt_read_knote_create(struct filter *filt, struct knote *kn)
     if (kn->kev.flags & EV_CLEAR)
         kn->data.events |= EPOLLET;
 
-    memset(&ev, 0, sizeof(ev));
-    ev.events = kn->data.events;
-    ev.data.ptr = kn;
-
-    /* Special case: for regular files, add a surrogate eventfd that is always readable */
+    /*
+     * Special case: a regular file is always readable, so its knote goes
+     * straight on the ready list, without a descriptor to poll.
+     */
     if (kn->kn_flags & KNFL_REGULAR_FILE) {
-        int evfd;
-
-        kn->kn_epollfd = filter_epfd(filt);
-        evfd = eventfd(0, 0);
-        if (evfd < 0) {
-            dbg_perror("eventfd(2)");
-            return (-1);
-        }
-        if (eventfd_write(evfd, 1) < 0) {
-            dbg_perror("eventfd_write(3)");
-            (void) close(evfd);
-            return (-1);
-        }
-
-        kn->kdata.kn_eventfd = evfd;
-
-        if (epoll_ctl(kn->kn_epollfd, EPOLL_CTL_ADD, kn->kdata.kn_eventfd, &ev) < 0) {
-            dbg_printf("epoll_ctl(2): %s", strerror(errno));
-            return (-1);
-        }
+        kn->kdata.kn_file.f_size = -1;
+        kn->kdata.kn_file.f_wd = -1;
+        linux_knote_ready(kn);
         return (0);
     }
 
-    return epoll_update(EPOLL_CTL_ADD, filt, kn, &ev);
+    kn->kdata.kn_sock.s_lowat = -1;
+    if ((kn->kev.fflags & NOTE_LOWAT) && !(kn->kn_flags & KNFL_PASSIVE_SOCKET))
+        lowat_watch(kn);
+    if (linux_fd_attach(filt, kn) < 0) {
+        lowat_unwatch(kn);
+        return (-1);
+    }
+
+    return (0);
 }
 
 int
@@ -203,65 +567,39 @@ evfilt_read_knote_modify(struct filter *filt, struct knote *kn,
 int
 evfilt_read_knote_delete(struct filter *filt, struct knote *kn)
 {
-    if (kn->kev.flags & EV_DISABLE)
-        return (0);
-
-    if ((kn->kn_flags & KNFL_REGULAR_FILE) && (kn->kdata.kn_eventfd != -1)) {
-        if (epoll_ctl(kn->kn_epollfd, EPOLL_CTL_DEL, kn->kdata.kn_eventfd, NULL) < 0) {
-            dbg_perror("epoll_ctl(2)");
-            return (-1);
-        }
-        (void) close(kn->kdata.kn_eventfd);
-        kn->kdata.kn_eventfd = -1;
-    } else {
-        return epoll_update(EPOLL_CTL_DEL, filt, kn, NULL);
+    if (!(kn->kn_flags & KNFL_REGULAR_FILE)) {
+        lowat_unwatch(kn);
+        return (linux_fd_detach(filt, kn));
     }
 
-    // clang will complain about not returning a value otherwise
-    return (-1);
+    file_unwatch(filt, kn);
+    return (0);
 }
 
 int
 evfilt_read_knote_enable(struct filter *filt, struct knote *kn)
 {
-    struct epoll_event ev;
-
-    memset(&ev, 0, sizeof(ev));
-    ev.events = kn->data.events;
-    ev.data.ptr = kn;
-
-    if (kn->kn_flags & KNFL_REGULAR_FILE) {
-        if (epoll_ctl(kn->kn_epollfd, EPOLL_CTL_ADD, kn->kdata.kn_eventfd, &ev) < 0) {
-            dbg_perror("epoll_ctl(2)");
-            return (-1);
-        }
-        return (0);
-    } else {
-        return epoll_update(EPOLL_CTL_ADD, filt, kn, &ev);
-    }
+    if (!(kn->kn_flags & KNFL_REGULAR_FILE))
+        return (linux_fd_update(filt, kn->kn_fds));
 
-    // clang will complain about not returning a value otherwise
-    return (-1);
+    linux_knote_ready(kn);
+    return (0);
 }
 
 int
 evfilt_read_knote_disable(struct filter *filt, struct knote *kn)
 {
-    if (kn->kn_flags & KNFL_REGULAR_FILE) {
-        if (epoll_ctl(kn->kn_epollfd, EPOLL_CTL_DEL, kn->kdata.kn_eventfd, NULL) < 0) {
-            dbg_perror("epoll_ctl(2)");
-            return (-1);
-        }
-        return (0);
-    } else {
-        return epoll_update(EPOLL_CTL_DEL, filt, kn, NULL);
-    }
+    linux_knote_unready(kn);
+    if (!(kn->kn_flags & KNFL_REGULAR_FILE))
+        return (linux_fd_update(filt, kn->kn_fds));
+
+    return (0);
 }
 
 const struct filter evfilt_read = {
     EVFILT_READ,
     NULL,
-    NULL,
+    evfilt_read_destroy,
     evfilt_read_copyout,
     evfilt_read_knote_create,
     evfilt_read_knote_modify,
@@ -43,98 +43,184 @@ struct signalfd_siginfo
 };
 #endif
 
+/* Number of siginfo structures read from the signalfd at a time */
+#define SIGNALFD_BATCH 32
+
+/*
+ * All signals watched by a kqueue share one signalfd, whose mask is
+ * the set of signals with a knote, whether it is enabled or not.
+ */
+struct evfilt_data {
+    int             sf_fd;
+    sigset_t        sf_mask;
+    struct knote   *sf_knote[_NSIG];
+};
+
+/* Discard any instance of the signal that is already pending */
 static void
-signalfd_reset(int sigfd)
+signal_discard(int signum)
 {
-    struct signalfd_siginfo sig;
-    ssize_t n;
+    static const struct timespec zero = { 0, 0 };
+    sigset_t sigmask;
 
-    /* Discard any pending signal */
-    n = read(sigfd, &sig, sizeof(sig));
-    if (n < 0 || n != sizeof(sig)) {
-        if (errno == EWOULDBLOCK)
-            return;
-        //FIXME: eintr?
-        dbg_perror("read(2) from signalfd");
-        abort();
-    }
+    sigemptyset(&sigmask);
+    sigaddset(&sigmask, signum);
+    while (sigtimedwait(&sigmask, NULL, &zero) == signum)
+        ;
 }
 
 static int
-signalfd_add(int epfd, int sigfd, void *ptr)
+signalfd_update(struct evfilt_data *sf)
 {
-    struct epoll_event ev;
-    int rv;
-
-    /* Add the signalfd to the kqueue's epoll descriptor set */
-    memset(&ev, 0, sizeof(ev));
-    ev.events = EPOLLIN;
-    ev.data.ptr = ptr;
-    rv = epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &ev);
-    if (rv < 0) {
-        dbg_perror("epoll_ctl(2)");
+    if (signalfd(sf->sf_fd, &sf->sf_mask, 0) < 0) {
+        dbg_perror("signalfd(2)");
         return (-1);
     }
 
     return (0);
 }
 
+/* Count every pending signal and make the matching knotes ready */
+static void
+signalfd_drain(struct evfilt_data *sf)
+{
+    struct signalfd_siginfo sig[SIGNALFD_BATCH];
+    struct knote *kn;
+    ssize_t n;
+    int i;
+
+    do {
+        n = read(sf->sf_fd, &sig, sizeof(sig));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN)
+                dbg_perror("read(2) from signalfd");
+            return;
+        }
+        for (i = 0; i < n / (ssize_t) sizeof(sig[0]); i++) {
+            if (sig[i].ssi_signo >= _NSIG)
+                continue;
+            kn = sf->sf_knote[sig[i].ssi_signo];
+            if (kn == NULL || (kn->kev.flags & EV_DISABLE))
+                continue;
+            kn->kdata.kn_sigcount++;
+            linux_knote_ready(kn);
+        }
+    } while (n == sizeof(sig));
+}
+
+static void
+evfilt_signal_harvest(struct filter *filt, struct epoll_event *ev UNUSED)
+{
+    signalfd_drain(filt->kf_data);
+}
+
 static int
-signalfd_create(int epfd, void *ptr, int signum)
+signalfd_create(struct filter *filt)
 {
     static int flags = SFD_NONBLOCK;
-    sigset_t sigmask;
-    int sigfd;
+    struct evfilt_data *sf;
+    struct epoll_event ev;
 
-    /* Create a signalfd */
-    sigemptyset(&sigmask);
-    sigaddset(&sigmask, signum);
-    sigfd = signalfd(-1, &sigmask, flags);
+    sf = calloc(1, sizeof(*sf));
+    if (sf == NULL)
+        return (-1);
+    sigemptyset(&sf->sf_mask);
+
+    sf->sf_fd = signalfd(-1, &sf->sf_mask, flags);
 
     /* WORKAROUND: Flags are broken on kernels older than Linux 2.6.27 */
-    if (sigfd < 0 && errno == EINVAL && flags != 0) {
+    if (sf->sf_fd < 0 && errno == EINVAL && flags != 0) {
         flags = 0;
-        sigfd = signalfd(-1, &sigmask, flags);
+        sf->sf_fd = signalfd(-1, &sf->sf_mask, flags);
     }
-    if (sigfd < 0) {
+    if (sf->sf_fd < 0) {
         dbg_perror("signalfd(2)");
-        goto errout;
+        free(sf);
+        return (-1);
     }
-
-    /* Block the signal handler from being invoked */
-    if (sigprocmask(SIG_BLOCK, &sigmask, NULL) < 0) {
-        dbg_perror("sigprocmask(2)");
+    if (flags == 0 && fcntl(sf->sf_fd, F_SETFL, O_NONBLOCK) < 0) {
+        dbg_perror("fcntl(2)");
         goto errout;
     }
 
-    signalfd_reset(sigfd);
+    filt->kf_udata.ud_type = EPOLL_UDATA_FILTER;
+    filt->kf_udata.ud_ptr = filt;
+    filt->kf_harvest = evfilt_signal_harvest;
 
-    if (signalfd_add(epfd, sigfd, ptr) < 0)
+    /* Add the signalfd to the kqueue's epoll descriptor set */
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = &filt->kf_udata;
+    if (linux_poll_ctl(filt->kf_kqueue, EPOLL_CTL_ADD, sf->sf_fd, &ev) < 0) {
+        dbg_perror("epoll_ctl(2)");
         goto errout;
+    }
 
-    dbg_printf("added sigfd %d to epfd %d (signum=%d)", sigfd, epfd, signum);
+    dbg_printf("added sigfd %d to epfd %d", sf->sf_fd, filter_epfd(filt));
 
-    return (sigfd);
+    filt->kf_data = sf;
+    return (0);
 
 errout:
-    (void) close(sigfd);
+    (void) close(sf->sf_fd);
+    free(sf);
     return (-1);
 }
 
-int
-evfilt_signal_copyout(struct kevent *dst, struct knote *src, void *x UNUSED)
+static void
+evfilt_signal_destroy(struct filter *filt)
+{
+    struct evfilt_data *sf = filt->kf_data;
+
+    if (sf == NULL)
+        return;
+    (void) close(sf->sf_fd);
+    free(sf);
+    filt->kf_data = NULL;
+}
+
+/*
+ * Start watching the signal; instances sent before this are ignored. A
+ * disabled knote keeps its signal in the mask, and signalfd_drain() drops
+ * the instances it reads for it, so enabling it again only has to discard
+ * the ones that are still pending.
+ */
+static int
+signal_watch(struct filter *filt, struct knote *kn)
 {
-    int sigfd;
+    struct evfilt_data *sf = filt->kf_data;
+    const int signum = kn->kev.ident;
+
+    signal_discard(signum);
+    if (sigismember(&sf->sf_mask, signum))
+        return (0);
+    sigaddset(&sf->sf_mask, signum);
+    return (signalfd_update(sf));
+}
 
-    sigfd = src->kdata.kn_signalfd;
+static int
+signal_unwatch(struct filter *filt, struct knote *kn)
+{
+    struct evfilt_data *sf = filt->kf_data;
 
-    signalfd_reset(sigfd);
+    kn->kdata.kn_sigcount = 0;
+    linux_knote_unready(kn);
+    if (!sigismember(&sf->sf_mask, kn->kev.ident))
+        return (0);
+    sigdelset(&sf->sf_mask, kn->kev.ident);
+    return (signalfd_update(sf));
+}
 
+int
+evfilt_signal_copyout(struct kevent *dst, struct knote *src, void *x UNUSED)
+{
     memcpy(dst, &src->kev, sizeof(*dst));
-    /* NOTE: dst->data should be the number of times the signal occurred,
-       but that information is not available.
-     */
-    dst->data = 1;  
+
+    /* The number of times the signal occurred since the last copyout */
+    dst->data = src->kdata.kn_sigcount;
+    src->kdata.kn_sigcount = 0;
 
     return (0);
 }
@@ -142,17 +228,30 @@ evfilt_signal_copyout(struct kevent *dst, struct knote *src, void *x UNUSED)
 int
 evfilt_signal_knote_create(struct filter *filt, struct knote *kn)
 {
-    int fd;
+    sigset_t sigmask;
 
-    fd = signalfd_create(filter_epfd(filt), kn, kn->kev.ident);
-    if (fd > 0) {
-        kn->kev.flags |= EV_CLEAR;
-        kn->kdata.kn_signalfd = fd;
-        return (0);
-    } else {
-        kn->kdata.kn_signalfd = -1;
+    if (kn->kev.ident == 0 || kn->kev.ident >= _NSIG) {
+        errno = EINVAL;
         return (-1);
     }
+    if (filt->kf_data == NULL && signalfd_create(filt) < 0)
+        return (-1);
+
+    /* Block the signal handler from being invoked */
+    sigemptyset(&sigmask);
+    sigaddset(&sigmask, kn->kev.ident);
+    if (sigprocmask(SIG_BLOCK, &sigmask, NULL) < 0) {
+        dbg_perror("sigprocmask(2)");
+        return (-1);
+    }
+
+    kn->kev.flags |= EV_CLEAR;
+    kn->kdata.kn_sigcount = 0;
+    if (signal_watch(filt, kn) < 0)
+        return (-1);
+    filt->kf_data->sf_knote[kn->kev.ident] = kn;
+
+    return (0);
 }
 
 int
@@ -168,47 +267,33 @@ evfilt_signal_knote_modify(struct filter *filt UNUSED,
 int
 evfilt_signal_knote_delete(struct filter *filt, struct knote *kn)
 {
-    const int sigfd = kn->kdata.kn_signalfd;
-
-    /* Needed so that delete() can be called after disable() */
-    if (kn->kdata.kn_signalfd == -1)
-        return (0);
-
-    if (epoll_ctl(filter_epfd(filt), EPOLL_CTL_DEL, sigfd, NULL) < 0) {
-        dbg_perror("epoll_ctl(2)");
-        return (-1);
-    }
-
-    if (close(sigfd) < 0) {
-        dbg_perror("close(2)");
-        return (-1);
-    }
+    filt->kf_data->sf_knote[kn->kev.ident] = NULL;
 
     /* NOTE: This does not call sigprocmask(3) to unblock the signal. */
-    kn->kdata.kn_signalfd = -1;
-
-    return (0);
+    return (signal_unwatch(filt, kn));
 }
 
 int
 evfilt_signal_knote_enable(struct filter *filt, struct knote *kn)
 {
     dbg_printf("enabling ident %u", (unsigned int) kn->kev.ident);
-    return evfilt_signal_knote_create(filt, kn);
+    return (signal_watch(filt, kn));
 }
 
 int
-evfilt_signal_knote_disable(struct filter *filt, struct knote *kn)
+evfilt_signal_knote_disable(struct filter *filt UNUSED, struct knote *kn)
 {
     dbg_printf("disabling ident %u", (unsigned int) kn->kev.ident);
-    return evfilt_signal_knote_delete(filt, kn);
+    kn->kdata.kn_sigcount = 0;
+    linux_knote_unready(kn);
+    return (0);
 }
 
 
 const struct filter evfilt_signal = {
     EVFILT_SIGNAL,
     NULL,
-    NULL,
+    evfilt_signal_destroy,
     evfilt_signal_copyout,
     evfilt_signal_knote_create,
     evfilt_signal_knote_modify,
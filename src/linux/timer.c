@@ -61,180 +61,414 @@ int timerfd_gettime(int ufc, struct itimerspec *otmr)
 
 #endif
 
-#ifndef NDEBUG
-static char *
-itimerspec_dump(struct itimerspec *ts)
-{
-    static __thread char buf[1024];
+/*
+ * All EVFILT_TIMER knotes of a kqueue share a hierarchical timing wheel
+ * that is driven by a single timerfd. Adding, cancelling and rearming
+ * a timer only touches the wheel; the timerfd is reprogrammed when the
+ * earliest deadline moves closer, and otherwise when it fires.
+ *
+ * Each of the WHEEL_LEVELS levels has WHEEL_SIZE slots, and a slot at
+ * level N spans WHEEL_SIZE^N nanoseconds. A timer is stored at the lowest
+ * level that can hold its remaining time, and is moved (cascaded) to a
+ * lower level when the wheel reaches the start of its slot. The knotes
+ * in a level 0 slot all expire at the same nanosecond.
+ */
+#define WHEEL_BITS      6
+#define WHEEL_SIZE      (1 << WHEEL_BITS)
+#define WHEEL_MASK      (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS    10
+#define WHEEL_NOSLOT    ((unsigned int) -1)
+
+/* Timers further out than this are parked in the last level, and re-filed */
+#define WHEEL_MAX_DELTA ((UINT64_C(1) << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+#define LEVEL_SHIFT(lvl) ((lvl) * WHEEL_BITS)
+
+LIST_HEAD(wheel_slot, knote);
+
+struct evfilt_data {
+    int         tw_timerfd;
+    uint64_t    tw_now;                    /* Last tick processed, in ns */
+    uint64_t    tw_armed;                  /* Deadline of the timerfd, or 0 */
+    uint64_t    tw_bitmap[WHEEL_LEVELS];   /* Non-empty slots per level */
+    uint64_t    tw_first[WHEEL_LEVELS][WHEEL_SIZE]; /* Lower bound of the expirations in a slot */
+    struct wheel_slot tw_slot[WHEEL_LEVELS][WHEEL_SIZE];
+};
 
-    snprintf(buf, sizeof(buf),
-            "itimer: [ interval=%lu s %lu ns, next expire=%lu s %lu ns ]",
-            ts->it_interval.tv_sec,
-            ts->it_interval.tv_nsec,
-            ts->it_value.tv_sec,
-            ts->it_value.tv_nsec
-           );
+static uint64_t
+timer_now(void)
+{
+    struct timespec ts;
 
-    return (buf);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec);
 }
-#endif
 
-/* Convert time data into seconds+nanoseconds */
+/* Convert time data into nanoseconds */
 
 #define NOTE_TIMER_MASK (NOTE_ABSOLUTE-1)
 
+static uint64_t
+convert_timedata_to_ns(long src, unsigned int flags)
+{
+    if (src <= 0)
+        return (0);
+
+    switch (flags & NOTE_TIMER_MASK) {
+    case NOTE_USECONDS:
+        return ((uint64_t) src * 1000);
+    case NOTE_NSECONDS:
+        return ((uint64_t) src);
+    case NOTE_SECONDS:
+        return ((uint64_t) src * 1000000000);
+    default: /* milliseconds */
+        return ((uint64_t) src * 1000000);
+    }
+}
+
+static void
+wheel_insert(struct evfilt_data *tw, struct knote *kn)
+{
+    uint64_t expire, delta;
+    unsigned int lvl, slot;
+
+    expire = kn->kdata.kn_timer.t_expire;
+    delta = expire - tw->tw_now;
+    if (delta > WHEEL_MAX_DELTA) {
+        delta = WHEEL_MAX_DELTA;
+        expire = tw->tw_now + delta;
+    }
+    if (delta < WHEEL_SIZE)
+        lvl = 0;
+    else
+        lvl = (63 - __builtin_clzll(delta)) / WHEEL_BITS;
+    slot = (expire >> LEVEL_SHIFT(lvl)) & WHEEL_MASK;
+
+    LIST_INSERT_HEAD(&tw->tw_slot[lvl][slot], kn, kdata.kn_timer.t_entries);
+    tw->tw_bitmap[lvl] |= UINT64_C(1) << slot;
+    if (expire < tw->tw_first[lvl][slot])
+        tw->tw_first[lvl][slot] = expire;
+    kn->kdata.kn_timer.t_slot = (lvl * WHEEL_SIZE) + slot;
+}
+
+static void
+wheel_remove(struct evfilt_data *tw, struct knote *kn)
+{
+    unsigned int lvl, slot;
+
+    lvl = kn->kdata.kn_timer.t_slot / WHEEL_SIZE;
+    slot = kn->kdata.kn_timer.t_slot % WHEEL_SIZE;
+
+    LIST_REMOVE(kn, kdata.kn_timer.t_entries);
+    if (LIST_EMPTY(&tw->tw_slot[lvl][slot])) {
+        tw->tw_bitmap[lvl] &= ~(UINT64_C(1) << slot);
+        tw->tw_first[lvl][slot] = UINT64_MAX;
+    }
+    kn->kdata.kn_timer.t_slot = WHEEL_NOSLOT;
+}
+
+/*
+ * Return the next tick after tw_now at which a slot must be processed,
+ * either because it expires (level 0) or because it must be cascaded.
+ * <deadline> is set to the earliest time the timerfd needs to fire.
+ */
+static uint64_t
+wheel_next(struct evfilt_data *tw, uint64_t *deadline)
+{
+    uint64_t bits, span, base, tick, next, first;
+    unsigned int lvl, cur, slot;
+
+    next = UINT64_MAX;
+    *deadline = UINT64_MAX;
+    for (lvl = 0; lvl < WHEEL_LEVELS; lvl++) {
+        bits = tw->tw_bitmap[lvl];
+        if (bits == 0)
+            continue;
+
+        cur = (tw->tw_now >> LEVEL_SHIFT(lvl)) & WHEEL_MASK;
+        span = UINT64_C(1) << LEVEL_SHIFT(lvl + 1);
+        base = tw->tw_now & ~(span - 1);
+
+        /* Slots after the current one come around in this rotation */
+        if (cur < WHEEL_MASK && (bits >> (cur + 1)) != 0) {
+            slot = cur + 1 + __builtin_ctzll(bits >> (cur + 1));
+        } else {
+            slot = __builtin_ctzll(bits);
+            base += span;
+        }
+        tick = base + ((uint64_t) slot << LEVEL_SHIFT(lvl));
+        if (tick < next)
+            next = tick;
+
+        /* A cascade is not worth a wakeup of its own */
+        first = tw->tw_first[lvl][slot];
+        if (first < tick)
+            first = tick;
+        if (first < *deadline)
+            *deadline = first;
+    }
+
+    return (next);
+}
+
 static void
-convert_timedata_to_itimerspec(struct itimerspec *dst, long src,
-						       unsigned int flags, int oneshot)
-{
-    time_t sec, nsec;
-
-	switch (flags & NOTE_TIMER_MASK) {
-	case NOTE_USECONDS:
-        sec = src / 1000000;
-        nsec = (src % 1000000);
-        break;
-	case NOTE_NSECONDS:
-        sec = src / 1000000000;
-        nsec = (src % 1000000000);
-        break;
-	case NOTE_SECONDS:
-        sec = src;
-        nsec = 0;
-        break;
-	default: /* milliseconds */
-        sec = src / 1000;
-        nsec = (src % 1000) * 1000000;
-	}
-
-    /* Set the interval */
-    if (oneshot) {
-        dst->it_interval.tv_sec = 0;
-        dst->it_interval.tv_nsec = 0;
+timer_expire(struct evfilt_data *tw, struct knote *kn, uint64_t now)
+{
+    uint64_t n;
+
+    if (kn->kdata.kn_timer.t_period == 0) {
+        kn->kdata.kn_timer.t_count++;
     } else {
-        dst->it_interval.tv_sec = sec;
-        dst->it_interval.tv_nsec = nsec;
+        /* Account for every period that has elapsed since the expiration */
+        n = 1 + (now - kn->kdata.kn_timer.t_expire) / kn->kdata.kn_timer.t_period;
+        kn->kdata.kn_timer.t_count += n;
+        kn->kdata.kn_timer.t_expire += n * kn->kdata.kn_timer.t_period;
+        wheel_insert(tw, kn);
     }
+    linux_knote_ready(kn);
+}
 
-    /* Set the initial expiration */
-    dst->it_value.tv_sec = sec;
-    dst->it_value.tv_nsec = nsec;
-    dbg_printf("%s", itimerspec_dump(dst));
+/* Process every slot of the wheel up to <now> */
+static void
+wheel_advance(struct evfilt_data *tw, uint64_t now)
+{
+    struct wheel_slot *head;
+    struct knote *kn;
+    uint64_t tick, deadline;
+    unsigned int lvl;
+
+    while ((tick = wheel_next(tw, &deadline)) <= now) {
+        tw->tw_now = tick;
+
+        for (lvl = 1; lvl < WHEEL_LEVELS; lvl++) {
+            if (tick & ((UINT64_C(1) << LEVEL_SHIFT(lvl)) - 1))
+                break;
+            head = &tw->tw_slot[lvl][(tick >> LEVEL_SHIFT(lvl)) & WHEEL_MASK];
+            while ((kn = LIST_FIRST(head)) != NULL) {
+                wheel_remove(tw, kn);
+                wheel_insert(tw, kn);
+            }
+        }
+
+        head = &tw->tw_slot[0][tick & WHEEL_MASK];
+        while ((kn = LIST_FIRST(head)) != NULL) {
+            wheel_remove(tw, kn);
+            timer_expire(tw, kn, now);
+        }
+    }
+    tw->tw_now = now;
 }
 
-int
-evfilt_timer_copyout(struct kevent *dst, struct knote *src, void *ptr)
+/* 
+ * Program the timerfd for the earliest deadline in the wheel, unless
+ * it is already set to fire at or before that time.
+ */
+static int
+wheel_arm(struct evfilt_data *tw)
 {
-    struct epoll_event * const ev = (struct epoll_event *) ptr;
-    uint64_t expired;
-    ssize_t n;
+    struct itimerspec ts;
+    uint64_t deadline;
 
-    memcpy(dst, &src->kev, sizeof(*dst));
-    if (ev->events & EPOLLERR)
-        dst->fflags = 1; /* FIXME: Return the actual timer error */
-          
-    /* On return, data contains the number of times the
-       timer has been trigered.
-     */
-    n = read(src->data.pfd, &expired, sizeof(expired));
-    if (n != sizeof(expired)) {
-        dbg_puts("invalid read from timerfd");
-        expired = 1;  /* Fail gracefully */
-    } 
-    dst->data = expired;
+    (void) wheel_next(tw, &deadline);
+    if (deadline == UINT64_MAX)
+        return (0);
+    if (tw->tw_armed != 0 && tw->tw_armed <= deadline)
+        return (0);
+
+    memset(&ts, 0, sizeof(ts));
+    ts.it_value.tv_sec = deadline / 1000000000;
+    ts.it_value.tv_nsec = deadline % 1000000000;
+    dbg_printf("timerfd %d: next deadline=%lu s %lu ns", tw->tw_timerfd,
+            (unsigned long) ts.it_value.tv_sec,
+            (unsigned long) ts.it_value.tv_nsec);
+    if (timerfd_settime(tw->tw_timerfd, TFD_TIMER_ABSTIME, &ts, NULL) < 0) {
+        dbg_printf("timerfd_settime(2): %s", strerror(errno));
+        return (-1);
+    }
+    tw->tw_armed = deadline;
 
     return (0);
 }
 
-int
-evfilt_timer_knote_create(struct filter *filt, struct knote *kn)
+static void
+evfilt_timer_harvest(struct filter *filt, struct epoll_event *ev UNUSED)
+{
+    struct evfilt_data *tw = filt->kf_data;
+
+    /* The timerfd is not read(2); expirations are counted by the wheel. */
+    tw->tw_armed = 0;
+    wheel_advance(tw, timer_now());
+    (void) wheel_arm(tw);
+}
+
+static int
+wheel_create(struct filter *filt)
 {
+    struct evfilt_data *tw;
     struct epoll_event ev;
-    struct itimerspec ts;
-    int tfd;
-    int flags;
+    unsigned int lvl, slot;
 
-    kn->kev.flags |= EV_CLEAR;
+    tw = calloc(1, sizeof(*tw));
+    if (tw == NULL)
+        return (-1);
 
-    tfd = timerfd_create(CLOCK_MONOTONIC, 0);
-    if (tfd < 0) {
+    tw->tw_timerfd = timerfd_create(CLOCK_MONOTONIC, 0);
+    if (tw->tw_timerfd < 0) {
         dbg_printf("timerfd_create(2): %s", strerror(errno));
+        free(tw);
         return (-1);
     }
-    dbg_printf("created timerfd %d", tfd);
+    dbg_printf("created timerfd %d", tw->tw_timerfd);
 
-    convert_timedata_to_itimerspec(&ts, kn->kev.data, kn->kev.fflags,
-								   kn->kev.flags & EV_ONESHOT);
-	flags = (kn->kev.fflags & NOTE_ABSOLUTE) ? TFD_TIMER_ABSTIME : 0;
-    if (timerfd_settime(tfd, flags, &ts, NULL) < 0) {
-        dbg_printf("timerfd_settime(2): %s", strerror(errno));
-        close(tfd);
-        return (-1);
+    for (lvl = 0; lvl < WHEEL_LEVELS; lvl++) {
+        for (slot = 0; slot < WHEEL_SIZE; slot++) {
+            LIST_INIT(&tw->tw_slot[lvl][slot]);
+            tw->tw_first[lvl][slot] = UINT64_MAX;
+        }
     }
+    tw->tw_now = timer_now();
 
+    filt->kf_udata.ud_type = EPOLL_UDATA_FILTER;
+    filt->kf_udata.ud_ptr = filt;
+    filt->kf_harvest = evfilt_timer_harvest;
+
+    /* Edge-triggered, since the expiration counter is never read(2) */
     memset(&ev, 0, sizeof(ev));
     ev.events = EPOLLIN | EPOLLET;
-    if (kn->kev.flags & (EV_ONESHOT | EV_DISPATCH))
-        ev.events |= EPOLLONESHOT;
-
-    ev.data.ptr = kn;
-    if (epoll_ctl(filter_epfd(filt), EPOLL_CTL_ADD, tfd, &ev) < 0) {
+    ev.data.ptr = &filt->kf_udata;
+    if (linux_poll_ctl(filt->kf_kqueue, EPOLL_CTL_ADD, tw->tw_timerfd, &ev) < 0) {
         dbg_printf("epoll_ctl(2): %d", errno);
-        close(tfd);
+        close(tw->tw_timerfd);
+        free(tw);
         return (-1);
     }
 
-    kn->data.pfd = tfd;
+    filt->kf_data = tw;
     return (0);
 }
 
+static void
+evfilt_timer_destroy(struct filter *filt)
+{
+    struct evfilt_data *tw = filt->kf_data;
+
+    if (tw == NULL)
+        return;
+    (void) close(tw->tw_timerfd);
+    free(tw);
+    filt->kf_data = NULL;
+}
+
+static int
+timer_start(struct filter *filt, struct knote *kn)
+{
+    struct evfilt_data *tw = filt->kf_data;
+    uint64_t ns;
+
+    /* Restart a timer that is already running */
+    if (kn->kdata.kn_timer.t_slot != WHEEL_NOSLOT)
+        wheel_remove(tw, kn);
+
+    ns = convert_timedata_to_ns(kn->kev.data, kn->kev.fflags);
+    if (ns == 0) {
+        /* Like timerfd_settime(2), a zero timeout leaves the timer disarmed */
+        return (0);
+    } else if (kn->kev.fflags & NOTE_ABSOLUTE) {
+        kn->kdata.kn_timer.t_expire = ns;
+        kn->kdata.kn_timer.t_period = 0;
+    } else {
+        kn->kdata.kn_timer.t_expire = timer_now() + ns;
+        if (kn->kev.flags & EV_ONESHOT)
+            kn->kdata.kn_timer.t_period = 0;
+        else
+            kn->kdata.kn_timer.t_period = ns;
+    }
+
+    /* An absolute time in the past expires right away */
+    if (kn->kdata.kn_timer.t_expire <= tw->tw_now) {
+        kn->kdata.kn_timer.t_count++;
+        linux_knote_ready(kn);
+        return (0);
+    }
+
+    wheel_insert(tw, kn);
+    return (wheel_arm(tw));
+}
+
+static void
+timer_stop(struct filter *filt, struct knote *kn)
+{
+    if (kn->kdata.kn_timer.t_slot != WHEEL_NOSLOT)
+        wheel_remove(filt->kf_data, kn);
+    kn->kdata.kn_timer.t_count = 0;
+    linux_knote_unready(kn);
+}
+
 int
-evfilt_timer_knote_modify(struct filter *filt, struct knote *kn, 
-        const struct kevent *kev)
+evfilt_timer_copyout(struct kevent *dst, struct knote *src, void *ptr UNUSED)
 {
-    (void)filt;
-    (void)kn;
-    (void)kev;
-    return (0); /* STUB */
+    memcpy(dst, &src->kev, sizeof(*dst));
+          
+    /* On return, data contains the number of times the
+       timer has been trigered.
+     */
+    dst->data = src->kdata.kn_timer.t_count;
+    src->kdata.kn_timer.t_count = 0;
+
+    return (0);
 }
 
 int
-evfilt_timer_knote_delete(struct filter *filt, struct knote *kn)
+evfilt_timer_knote_create(struct filter *filt, struct knote *kn)
 {
-    int rv = 0;
+    if (filt->kf_data == NULL && wheel_create(filt) < 0)
+        return (-1);
 
-    if (kn->data.pfd == -1)
+    kn->kev.flags |= EV_CLEAR;
+    kn->kdata.kn_timer.t_slot = WHEEL_NOSLOT;
+    kn->kdata.kn_timer.t_count = 0;
+
+    return (timer_start(filt, kn));
+}
+
+int
+evfilt_timer_knote_modify(struct filter *filt, struct knote *kn, 
+        const struct kevent *kev)
+{
+    /* Restart the timer with the new timeout */
+    kn->kev.data = kev->data;
+    kn->kev.fflags = kev->fflags;
+    timer_stop(filt, kn);
+    if (kn->kev.flags & EV_DISABLE)
         return (0);
 
-    if (epoll_ctl(filter_epfd(filt), EPOLL_CTL_DEL, kn->data.pfd, NULL) < 0) {
-        dbg_printf("epoll_ctl(2): %s", strerror(errno));
-        rv = -1;
-    }
-    if (close(kn->data.pfd) < 0) {
-        dbg_printf("close(2): %s", strerror(errno));
-        rv = -1;
-    }
+    return (timer_start(filt, kn));
+}
 
-    kn->data.pfd = -1;
-    return (rv);
+int
+evfilt_timer_knote_delete(struct filter *filt, struct knote *kn)
+{
+    timer_stop(filt, kn);
+    return (0);
 }
 
 int
 evfilt_timer_knote_enable(struct filter *filt, struct knote *kn)
 {
-    return evfilt_timer_knote_create(filt, kn);
+    return (timer_start(filt, kn));
 }
 
 int
 evfilt_timer_knote_disable(struct filter *filt, struct knote *kn)
 {
-    return evfilt_timer_knote_delete(filt, kn);
+    timer_stop(filt, kn);
+    return (0);
 }
 
 const struct filter evfilt_timer = {
     EVFILT_TIMER,
     NULL,
-    NULL,
+    evfilt_timer_destroy,
     evfilt_timer_copyout,
     evfilt_timer_knote_create,
     evfilt_timer_knote_modify,
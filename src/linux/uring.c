@@ -0,0 +1,1021 @@
+/*
+ * Copyright (c) 2011 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A kqueue backend built on io_uring instead of epoll.
+ *
+ * The kqueue still keeps its descriptors in an epoll set, but it changes
+ * the set with IORING_OP_EPOLL_CTL requests and learns that descriptors
+ * are ready by polling the epoll descriptor from the ring. The filters
+ * describe what they want to watch with struct epoll_event as before,
+ * and linux_poll_ctl() hands each change to linux_uring_ctl(), which only
+ * queues it. The changes are submitted by the io_uring_enter(2) call that
+ * waits for completions, so a changelist and the wait that follows it
+ * cost a single system call. When the poll completes, the ready
+ * descriptors are read with epoll_wait() and handed to the same copyout
+ * code as epoll.
+ *
+ * Since epoll keeps the set, descriptors behave exactly as with the epoll
+ * backend: EPOLLET, EPOLLONESHOT and level-triggered entries are reported
+ * the same way, and closing a descriptor removes it from the set.
+ *
+ * The poll of the epoll descriptor is single-shot. A thread that blocks
+ * in kevent() arms it again with the submission of its next wait, so that
+ * a call that harvests events costs one io_uring_enter(2) and one
+ * epoll_wait(2), as with epoll. When another thread is waiting, or the
+ * call did not block, as when it is driven by poll(2) on the kqueue
+ * descriptor, the poll is armed again at the end of the call instead. A
+ * new poll completes at once if epoll still holds ready descriptors, such
+ * as level-triggered ones that have not been drained, so that a thread
+ * that is already waiting learns about them, as it would from epoll.
+ *
+ * The changes that are submitted together are linked, so that the kernel
+ * applies them in order even if it has to finish one of them in a worker
+ * thread. The result of a change is only known when it completes, so its
+ * errors are handled then: an EPOLL_CTL_ADD that fails with EEXIST is
+ * redone as EPOLL_CTL_MOD, an EPOLL_CTL_MOD that fails with ENOENT, as
+ * after the descriptor was closed and its number reused, is redone as
+ * EPOLL_CTL_ADD, and EPOLL_CTL_DEL of a descriptor that is gone is
+ * ignored.
+ */
+
+#include "../common/private.h"
+
+#if HAVE_LINUX_IO_URING
+
+#include <limits.h>
+#include <sys/mman.h>
+#include <linux/io_uring.h>
+
+#ifndef __NR_io_uring_setup
+# define __NR_io_uring_setup    425
+#endif
+#ifndef __NR_io_uring_enter
+# define __NR_io_uring_enter    426
+#endif
+#ifndef __NR_io_uring_register
+# define __NR_io_uring_register 427
+#endif
+
+#define URING_SQ_ENTRIES    256
+#define URING_CQ_ENTRIES    4096
+
+/* The calling thread's last wait could block, so its next one re-arms */
+static __thread int uring_blocking;
+
+/* An entry of the epoll set, as the kqueue last asked for it */
+struct uring_poll {
+    uint64_t    up_data;        /* epoll_event.data for the descriptor */
+    uint32_t    up_events;      /* epoll_event.events for the descriptor */
+    uint32_t    up_gen;         /* Identifies the last change */
+    int         up_op;          /* The last change */
+    int         up_inset;       /* The descriptor is in the set */
+};
+
+/*
+ * The user_data of a change is the descriptor and the generation of its
+ * entry, so that the failure of a change that has been superseded is
+ * recognized and ignored. The poll of the epoll descriptor uses
+ * URING_DATA_EPOLL.
+ */
+#define URING_DATA(fd, gen)     (((uint64_t) (fd) << 32) | (gen))
+#define URING_DATA_FD(data)     ((int) ((data) >> 32))
+#define URING_DATA_GEN(data)    ((uint32_t) (data))
+#define URING_DATA_EPOLL        (~(uint64_t) 0)
+
+struct uring {
+    int                  ur_fd;
+    unsigned int         ur_features;
+
+    /* Submission queue */
+    volatile unsigned   *ur_sq_head;
+    volatile unsigned   *ur_sq_tail;
+    unsigned int         ur_sq_mask;
+    unsigned int         ur_sq_entries;
+    unsigned int        *ur_sq_array;
+    struct io_uring_sqe *ur_sqes;
+    unsigned int         ur_sq_local;   /* Tail, including unpublished SQEs */
+
+    /* Completion queue */
+    volatile unsigned   *ur_cq_head;
+    volatile unsigned   *ur_cq_tail;
+    unsigned int         ur_cq_mask;
+    struct io_uring_cqe *ur_cqes;
+
+    void                *ur_sq_ring;
+    size_t               ur_sq_ring_len;
+    void                *ur_cq_ring;
+    size_t               ur_cq_ring_len;
+    size_t               ur_sqes_len;
+
+    int                  ur_epfd;       /* The epoll set */
+    int                  ur_armed;      /* The epoll set is being polled */
+    struct uring_poll   *ur_poll;       /* The entries, indexed by fd */
+    size_t               ur_npoll;
+    struct epoll_event  *ur_ctl_ev;     /* The event of each queued change */
+
+    /* Protects everything above; no other lock is taken while it is held */
+    pthread_mutex_t      ur_mtx;
+};
+
+static int
+uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+    return ((int) syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int
+uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+        unsigned int flags, void *arg, size_t argsz)
+{
+    return ((int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                flags, arg, argsz));
+}
+
+/* The number of SQEs that the kernel has not consumed yet; needs ur_mtx */
+static unsigned int
+uring_sq_pending(struct uring *ur)
+{
+    atomic_barrier();
+    return (ur->ur_sq_local - *ur->ur_sq_head);
+}
+
+/*
+ * The number of SQEs to submit. The chain of linked changes is ended at
+ * the last one, since the kernel hands an unfinished chain over to a
+ * worker thread; needs ur_mtx
+ */
+static unsigned int
+uring_sq_submit(struct uring *ur)
+{
+    unsigned int n;
+
+    if ((n = uring_sq_pending(ur)) > 0)
+        ur->ur_sqes[(ur->ur_sq_local - 1) & ur->ur_sq_mask].flags &= ~IOSQE_IO_HARDLINK;
+    return (n);
+}
+
+/* The number of CQEs that have not been reaped yet */
+static unsigned int
+uring_cq_ready(struct uring *ur)
+{
+    unsigned int n;
+
+    n = *ur->ur_cq_tail - *ur->ur_cq_head;
+    atomic_barrier();
+    return (n);
+}
+
+/* Get the next free SQE, submitting the queue if it is full; needs ur_mtx */
+static struct io_uring_sqe *
+uring_sqe(struct uring *ur)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int idx;
+
+    if (uring_sq_pending(ur) == ur->ur_sq_entries) {
+        if (uring_enter(ur->ur_fd, uring_sq_submit(ur), 0, 0, NULL, 0) < 0) {
+            dbg_perror("io_uring_enter(2)");
+            return (NULL);
+        }
+    }
+
+    idx = ur->ur_sq_local & ur->ur_sq_mask;
+    sqe = &ur->ur_sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ur->ur_sq_array[idx] = idx;
+    return (sqe);
+}
+
+/* Make the SQE returned by uring_sqe() visible to the kernel */
+static void
+uring_sqe_publish(struct uring *ur)
+{
+    ur->ur_sq_local++;
+    atomic_barrier();
+    *ur->ur_sq_tail = ur->ur_sq_local;
+}
+
+/* Queue the change <op> of the entry <up> of <fd>; needs ur_mtx */
+static int
+uring_epoll_ctl(struct uring *ur, int op, int fd, struct uring_poll *up)
+{
+    struct io_uring_sqe *sqe;
+    struct epoll_event *ev;
+
+    if ((sqe = uring_sqe(ur)) == NULL)
+        return (-1);
+
+    /* The kernel copies the event when it consumes the SQE */
+    ev = &ur->ur_ctl_ev[ur->ur_sq_local & ur->ur_sq_mask];
+    ev->events = up->up_events;
+    ev->data.u64 = up->up_data;
+
+    if (++up->up_gen == 0)
+        up->up_gen = 1;
+    up->up_op = op;
+
+    sqe->opcode = IORING_OP_EPOLL_CTL;
+    sqe->fd = ur->ur_epfd;
+    sqe->len = op;
+    sqe->off = fd;
+    sqe->addr = (uintptr_t) ev;
+    sqe->flags = IOSQE_IO_HARDLINK;
+#ifdef IORING_FEAT_CQE_SKIP
+    if (ur->ur_features & IORING_FEAT_CQE_SKIP)
+        sqe->flags |= IOSQE_CQE_SKIP_SUCCESS;
+#endif
+    sqe->user_data = URING_DATA(fd, up->up_gen);
+    uring_sqe_publish(ur);
+
+    return (0);
+}
+
+/* Poll the epoll set, unless a poll is outstanding; needs ur_mtx */
+static void
+uring_rearm(struct uring *ur)
+{
+    struct io_uring_sqe *sqe;
+
+    if (ur->ur_armed || (sqe = uring_sqe(ur)) == NULL)
+        return;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = ur->ur_epfd;
+    sqe->poll32_events = EPOLLIN;
+#if __BYTE_ORDER == __BIG_ENDIAN
+    sqe->poll32_events = (sqe->poll32_events << 16) | (sqe->poll32_events >> 16);
+#endif
+    sqe->user_data = URING_DATA_EPOLL;
+    uring_sqe_publish(ur);
+    ur->ur_armed = 1;
+}
+
+static void
+uring_unmap(struct uring *ur)
+{
+    if (ur->ur_sqes != NULL)
+        (void) munmap(ur->ur_sqes, ur->ur_sqes_len);
+    if (ur->ur_cq_ring != NULL && ur->ur_cq_ring != ur->ur_sq_ring)
+        (void) munmap(ur->ur_cq_ring, ur->ur_cq_ring_len);
+    if (ur->ur_sq_ring != NULL)
+        (void) munmap(ur->ur_sq_ring, ur->ur_sq_ring_len);
+}
+
+static int
+uring_map(struct uring *ur, struct io_uring_params *p)
+{
+    char *sq, *cq;
+
+    ur->ur_sq_ring_len = p->sq_off.array + p->sq_entries * sizeof(unsigned int);
+    ur->ur_cq_ring_len = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        if (ur->ur_cq_ring_len > ur->ur_sq_ring_len)
+            ur->ur_sq_ring_len = ur->ur_cq_ring_len;
+        ur->ur_cq_ring_len = ur->ur_sq_ring_len;
+    }
+
+    sq = mmap(NULL, ur->ur_sq_ring_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ur->ur_fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED) {
+        dbg_perror("mmap(2)");
+        return (-1);
+    }
+    ur->ur_sq_ring = sq;
+
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        cq = sq;
+    } else {
+        cq = mmap(NULL, ur->ur_cq_ring_len, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ur->ur_fd, IORING_OFF_CQ_RING);
+        if (cq == MAP_FAILED) {
+            dbg_perror("mmap(2)");
+            return (-1);
+        }
+    }
+    ur->ur_cq_ring = cq;
+
+    ur->ur_sqes_len = p->sq_entries * sizeof(struct io_uring_sqe);
+    ur->ur_sqes = mmap(NULL, ur->ur_sqes_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ur->ur_fd, IORING_OFF_SQES);
+    if (ur->ur_sqes == MAP_FAILED) {
+        ur->ur_sqes = NULL;
+        dbg_perror("mmap(2)");
+        return (-1);
+    }
+
+    ur->ur_sq_head = (unsigned *) (sq + p->sq_off.head);
+    ur->ur_sq_tail = (unsigned *) (sq + p->sq_off.tail);
+    ur->ur_sq_mask = *(unsigned *) (sq + p->sq_off.ring_mask);
+    ur->ur_sq_entries = *(unsigned *) (sq + p->sq_off.ring_entries);
+    ur->ur_sq_array = (unsigned *) (sq + p->sq_off.array);
+    ur->ur_sq_local = *ur->ur_sq_tail;
+
+    ur->ur_cq_head = (unsigned *) (cq + p->cq_off.head);
+    ur->ur_cq_tail = (unsigned *) (cq + p->cq_off.tail);
+    ur->ur_cq_mask = *(unsigned *) (cq + p->cq_off.ring_mask);
+    ur->ur_cqes = (struct io_uring_cqe *) (cq + p->cq_off.cqes);
+
+    return (0);
+}
+
+/*
+ * Create the ring and the epoll set for a kqueue. The ring descriptor
+ * becomes the kqueue descriptor; it is readable whenever completions are
+ * waiting.
+ */
+int
+linux_uring_init(struct kqueue *kq)
+{
+    struct io_uring_params p;
+    struct uring *ur;
+
+    ur = calloc(1, sizeof(*ur));
+    if (ur == NULL)
+        return (-1);
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = URING_CQ_ENTRIES;
+#ifdef IORING_SETUP_SUBMIT_ALL
+    /* Keep submitting the changelist when one of its requests fails */
+    p.flags |= IORING_SETUP_SUBMIT_ALL;
+    ur->ur_fd = uring_setup(URING_SQ_ENTRIES, &p);
+    if (ur->ur_fd < 0 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = URING_CQ_ENTRIES;
+        ur->ur_fd = uring_setup(URING_SQ_ENTRIES, &p);
+    }
+#else
+    ur->ur_fd = uring_setup(URING_SQ_ENTRIES, &p);
+#endif
+    if (ur->ur_fd < 0) {
+        dbg_perror("io_uring_setup(2)");
+        free(ur);
+        return (-1);
+    }
+
+    /* A timeout can only be passed to io_uring_enter(2) since Linux 5.11 */
+    if (!(p.features & IORING_FEAT_EXT_ARG)) {
+        dbg_puts("io_uring_enter(2) does not take a timeout");
+        close(ur->ur_fd);
+        free(ur);
+        errno = ENOSYS;
+        return (-1);
+    }
+    ur->ur_features = p.features;
+
+    ur->ur_epfd = -1;
+    if (uring_map(ur, &p) < 0 ||
+            (ur->ur_ctl_ev = calloc(ur->ur_sq_entries, sizeof(*ur->ur_ctl_ev))) == NULL ||
+            (ur->ur_epfd = epoll_create(1)) < 0) {
+        if (ur->ur_epfd < 0 && ur->ur_ctl_ev != NULL)
+            dbg_perror("epoll_create(2)");
+        uring_unmap(ur);
+        close(ur->ur_fd);
+        free(ur->ur_ctl_ev);
+        free(ur);
+        return (-1);
+    }
+    pthread_mutex_init(&ur->ur_mtx, NULL);
+
+    kq->kq_id = ur->ur_fd;
+    kq->kq_ring = ur;
+    dbg_printf("created io_uring %d, features=0x%x", ur->ur_fd, ur->ur_features);
+
+    return (0);
+}
+
+void
+linux_uring_free(struct kqueue *kq)
+{
+    struct uring *ur = kq->kq_ring;
+
+    uring_unmap(ur);
+    close(ur->ur_fd);
+    close(ur->ur_epfd);
+    pthread_mutex_destroy(&ur->ur_mtx);
+    free(ur->ur_poll);
+    free(ur->ur_ctl_ev);
+    free(ur);
+    kq->kq_ring = NULL;
+}
+
+/* Make room in the table of entries for <fd>; needs ur_mtx */
+static int
+uring_poll_grow(struct uring *ur, int fd)
+{
+    struct uring_poll *p;
+    size_t n;
+
+    n = (ur->ur_npoll == 0) ? 64 : ur->ur_npoll;
+    while (n <= (size_t) fd)
+        n *= 2;
+    p = realloc(ur->ur_poll, n * sizeof(*p));
+    if (p == NULL) {
+        dbg_perror("realloc(3)");
+        return (-1);
+    }
+    memset(&p[ur->ur_npoll], 0, (n - ur->ur_npoll) * sizeof(*p));
+    ur->ur_poll = p;
+    ur->ur_npoll = n;
+
+    return (0);
+}
+
+/*
+ * The io_uring counterpart of epoll_ctl(2). The change is queued, and is
+ * submitted by the next io_uring_enter(2) call.
+ */
+int
+linux_uring_ctl(struct kqueue *kq, int op, int fd, struct epoll_event *ev)
+{
+    struct uring *ur = kq->kq_ring;
+    struct uring_poll *up;
+    int rv = 0;
+
+    if (fd < 0) {
+        errno = EBADF;
+        return (-1);
+    }
+
+    pthread_mutex_lock(&ur->ur_mtx);
+    if ((size_t) fd >= ur->ur_npoll) {
+        if (op != EPOLL_CTL_ADD) {
+            errno = ENOENT;
+            rv = -1;
+            goto out;
+        }
+        if (uring_poll_grow(ur, fd) < 0) {
+            errno = ENOMEM;
+            rv = -1;
+            goto out;
+        }
+    }
+    up = &ur->ur_poll[fd];
+
+    if (op != EPOLL_CTL_ADD && !up->up_inset) {
+        errno = ENOENT;
+        rv = -1;
+        goto out;
+    }
+
+    switch (op) {
+        case EPOLL_CTL_ADD:
+        case EPOLL_CTL_MOD:
+            up->up_inset = 1;
+            up->up_events = ev->events;
+            up->up_data = ev->data.u64;
+            break;
+
+        case EPOLL_CTL_DEL:
+            up->up_inset = 0;
+            break;
+
+        default:
+            errno = EINVAL;
+            rv = -1;
+            goto out;
+    }
+    rv = uring_epoll_ctl(ur, op, fd, up);
+
+out:
+    pthread_mutex_unlock(&ur->ur_mtx);
+    return (rv);
+}
+
+/* Redo a change that failed, unless it has been superseded; needs ur_mtx */
+static void
+uring_ctl_failed(struct uring *ur, uint64_t data, int res)
+{
+    struct uring_poll *up;
+    int fd;
+
+    fd = URING_DATA_FD(data);
+    if (fd < 0 || (size_t) fd >= ur->ur_npoll)
+        return;
+    up = &ur->ur_poll[fd];
+    if (up->up_gen != URING_DATA_GEN(data))
+        return;
+
+    if (res == -EEXIST && up->up_op == EPOLL_CTL_ADD)
+        (void) uring_epoll_ctl(ur, EPOLL_CTL_MOD, fd, up);
+    else if (res == -ENOENT && up->up_op == EPOLL_CTL_MOD)
+        (void) uring_epoll_ctl(ur, EPOLL_CTL_ADD, fd, up);
+    else if (up->up_op != EPOLL_CTL_DEL || (res != -ENOENT && res != -EBADF))
+        dbg_printf("epoll_ctl(2) on fd %d failed: %s", fd, strerror(-res));
+}
+
+/*
+ * Submit the queued changes and wait for a completion. The timeout is
+ * passed to the kernel as is, so there is no separate high-resolution path.
+ */
+static int
+linux_uring_wait(struct kqueue *kq, int nevents UNUSED, const struct timespec *ts)
+{
+    struct uring *ur = kq->kq_ring;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec kts;
+    unsigned int to_submit, flags, wait;
+    int rv;
+
+    /* Announce the waiter before looking at the ready lists */
+    atomic_inc(&kq->kq_nwaiters);
+    uring_blocking = !(ts != NULL && ts->tv_sec == 0 && ts->tv_nsec == 0);
+
+    wait = !(ts != NULL && ts->tv_sec == 0 && ts->tv_nsec == 0) &&
+        TAILQ_EMPTY(&kq->kq_ready) && kq->kq_pending == NULL;
+
+    memset(&arg, 0, sizeof(arg));
+    if (ts != NULL) {
+        kts.tv_sec = ts->tv_sec;
+        kts.tv_nsec = ts->tv_nsec;
+        arg.ts = (uintptr_t) &kts;
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&ur->ur_mtx);
+        uring_rearm(ur);
+        to_submit = uring_sq_submit(ur);
+        pthread_mutex_unlock(&ur->ur_mtx);
+
+        if (!wait && to_submit == 0)
+            break;
+        flags = wait ? (IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG) : 0;
+        dbg_printf("io_uring_enter: to_submit=%u wait=%u", to_submit, wait);
+        rv = uring_enter(ur->ur_fd, to_submit, wait ? 1 : 0, flags,
+                wait ? &arg : NULL, wait ? sizeof(arg) : 0);
+        if (rv < 0) {
+            if (errno == ETIME || errno == EBUSY)
+                break;
+            atomic_dec(&kq->kq_nwaiters);
+            if (errno == EINTR)
+                dbg_puts("signal caught");
+            else
+                dbg_perror("io_uring_enter(2)");
+            return (-1);
+        }
+
+        /*
+         * When requests were submitted, the kernel returns their number and
+         * hides a timeout or an interruption of the wait. Another thread
+         * may also have reaped the completions already. Only wait again
+         * if the caller is willing to wait forever.
+         */
+        if (!wait || uring_cq_ready(ur) > 0 || ts != NULL || !TAILQ_EMPTY(&kq->kq_ready))
+            break;
+    }
+    atomic_dec(&kq->kq_nwaiters);
+
+    rv = uring_cq_ready(ur);
+    if (rv == 0 && (!TAILQ_EMPTY(&kq->kq_ready) || kq->kq_pending != NULL))
+        return (1);
+
+    return (rv);
+}
+
+/*
+ * Take the completions off the ring. Failed changes are redone or
+ * dropped, and if the poll of the epoll set has completed, up to <max>
+ * ready descriptors are read from it.
+ */
+static int
+uring_reap(struct uring *ur, struct epoll_event *evs, int max)
+{
+    struct io_uring_cqe *cqe;
+    unsigned int head, tail;
+    int polled = 0;
+    int n;
+
+    pthread_mutex_lock(&ur->ur_mtx);
+    head = *ur->ur_cq_head;
+    tail = *ur->ur_cq_tail;
+    atomic_barrier();
+    for (; head != tail; head++) {
+        cqe = &ur->ur_cqes[head & ur->ur_cq_mask];
+        if (cqe->user_data == URING_DATA_EPOLL) {
+            /* Re-armed by linux_uring_flush(), or by the next wait */
+            ur->ur_armed = 0;
+            polled = 1;
+        } else if (cqe->res < 0) {
+            uring_ctl_failed(ur, cqe->user_data, cqe->res);
+        }
+    }
+    atomic_barrier();
+    *ur->ur_cq_head = head;
+    pthread_mutex_unlock(&ur->ur_mtx);
+
+    if (!polled)
+        return (0);
+    n = epoll_wait(ur->ur_epfd, evs, max, 0);
+    if (n < 0)
+        dbg_perror("epoll_wait(2)");
+
+    return (n);
+}
+
+static int
+linux_uring_copyout(struct kqueue *kq, int nready UNUSED,
+        struct kevent *eventlist, int nevents)
+{
+    struct epoll_event *evs;
+    int n;
+
+    n = linux_epoll_buffer(&evs, nevents);
+    if (n < 0)
+        return (-1);
+    n = uring_reap(kq->kq_ring, evs, n);
+    if (n < 0)
+        return (-1);
+    return (linux_epoll_copyout(kq, evs, n, eventlist, nevents));
+}
+
+/*
+ * Called at the end of kevent(), to submit the changes that were queued
+ * after the wait, or without one. Until then, neither a thread that is
+ * already waiting nor poll(2) on the kqueue descriptor would see them.
+ * If the copyout consumed the poll of the epoll set, it is armed again
+ * here only when the changes are submitted anyway, when another thread is
+ * waiting, or when the call did not block; otherwise the next wait of
+ * this thread arms it without a system call of its own.
+ */
+static void
+linux_uring_flush(struct kqueue *kq)
+{
+    struct uring *ur = kq->kq_ring;
+    unsigned int to_submit;
+    int saved_errno = errno;
+
+    pthread_mutex_lock(&ur->ur_mtx);
+    if (!uring_blocking || kq->kq_nwaiters > 0 || uring_sq_pending(ur))
+        uring_rearm(ur);
+    uring_blocking = 0;
+    to_submit = uring_sq_submit(ur);
+    if (to_submit > 0 && uring_enter(ur->ur_fd, to_submit, 0, 0, NULL, 0) < 0)
+        dbg_perror("io_uring_enter(2)");
+    pthread_mutex_unlock(&ur->ur_mtx);
+    errno = saved_errno;
+}
+
+/*
+ * Batched socket queue sizes
+ *
+ * A socket answers SIOCINQ and SIOCOUTQ through IORING_OP_URING_CMD since
+ * Linux 6.7, so the requests of a copyout can share one io_uring_enter(2)
+ * call. They go through a small ring of the calling thread, so that their
+ * completions do not mix with those of the kqueue's ring.
+ * A socket that cannot be queried this way, such as an AF_UNIX one, falls
+ * back to ioctl(2). Batching is only given up for good if the kernel does
+ * not know IORING_OP_URING_CMD at all.
+ */
+#if HAVE_LINUX_URING_SOCKQ
+
+#ifndef SOCKET_URING_OP_SIOCINQ
+# define SOCKET_URING_OP_SIOCINQ     0
+# define SOCKET_URING_OP_SIOCOUTQ    1
+#endif
+
+#define SOCKQ_RING_ENTRIES  64
+
+static __thread struct uring *sockq_ring;
+static __thread uint32_t sockq_gen;     /* Counts the batches of sockq_ring */
+static int sockq_unsupported;
+
+/*
+ * The user_data of a request is the batch and the index of the request.
+ * A completion that arrives after its batch was given up, for instance
+ * when io_uring_enter(2) was interrupted, belongs to an older batch, and
+ * is dropped.
+ */
+#define SOCKQ_DATA(gen, i)      (((uint64_t) (gen) << 32) | (uint32_t) (i))
+#define SOCKQ_DATA_GEN(data)    ((uint32_t) ((data) >> 32))
+#define SOCKQ_DATA_INDEX(data)  ((uint32_t) (data))
+
+static pthread_key_t  sockq_ring_key;
+static pthread_once_t sockq_ring_once = PTHREAD_ONCE_INIT;
+
+static void
+sockq_ring_free(void *arg)
+{
+    struct uring *ur = arg;
+
+    uring_unmap(ur);
+    (void) close(ur->ur_fd);
+    free(ur);
+}
+
+static void
+sockq_ring_key_init(void)
+{
+    (void) pthread_key_create(&sockq_ring_key, sockq_ring_free);
+}
+
+/* Ask the kernel whether it knows the opcode <op> (Linux 5.6) */
+static int
+sockq_op_supported(struct uring *ur, int op)
+{
+    struct io_uring_probe *probe;
+    size_t len;
+    int rv;
+
+    len = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+    if ((probe = calloc(1, len)) == NULL)
+        return (0);
+    rv = (syscall(__NR_io_uring_register, ur->ur_fd, IORING_REGISTER_PROBE,
+                probe, 256) == 0 && op <= probe->last_op &&
+            (probe->ops[op].flags & IO_URING_OP_SUPPORTED));
+    free(probe);
+
+    return (rv);
+}
+
+static struct uring *
+sockq_ring_get(void)
+{
+    struct io_uring_params p;
+    struct uring *ur;
+
+    if (sockq_ring != NULL)
+        return (sockq_ring);
+
+    ur = calloc(1, sizeof(*ur));
+    if (ur == NULL)
+        return (NULL);
+    memset(&p, 0, sizeof(p));
+    ur->ur_fd = uring_setup(SOCKQ_RING_ENTRIES, &p);
+    if (ur->ur_fd < 0) {
+        dbg_perror("io_uring_setup(2)");
+        free(ur);
+        return (NULL);
+    }
+    if (uring_map(ur, &p) < 0) {
+        sockq_ring_free(ur);
+        return (NULL);
+    }
+    if (!sockq_op_supported(ur, IORING_OP_URING_CMD)) {
+        dbg_puts("io_uring does not answer socket ioctls");
+        sockq_unsupported = 1;
+        sockq_ring_free(ur);
+        return (NULL);
+    }
+
+    (void) pthread_once(&sockq_ring_once, sockq_ring_key_init);
+    (void) pthread_setspecific(sockq_ring_key, ur);
+    sockq_ring = ur;
+    return (ur);
+}
+
+/*
+ * Answer <n> requests with one io_uring_enter(2) call per ring full.
+ * Returns -1 if none of them could be answered this way.
+ */
+int
+linux_uring_sockq(struct sockq_req *req, int n)
+{
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    struct uring *ur;
+    unsigned int head;
+    uint32_t idx;
+    int i, j, k, ok, rv;
+
+    if (sockq_unsupported || (ur = sockq_ring_get()) == NULL)
+        return (-1);
+
+    sockq_gen++;
+    ok = 0;
+    for (i = 0; i < n; i += k) {
+        k = n - i;
+        if (k > (int) ur->ur_sq_entries)
+            k = ur->ur_sq_entries;
+        for (j = i; j < i + k; j++) {
+            sqe = uring_sqe(ur);
+            sqe->opcode = IORING_OP_URING_CMD;
+            sqe->fd = req[j].sq_dst->ident;
+            sqe->cmd_op = (req[j].sq_cmd == SIOCINQ) ?
+                SOCKET_URING_OP_SIOCINQ : SOCKET_URING_OP_SIOCOUTQ;
+            sqe->user_data = SOCKQ_DATA(sockq_gen, j);
+            uring_sqe_publish(ur);
+            req[j].sq_res = -EOPNOTSUPP;
+        }
+        rv = uring_enter(ur->ur_fd, k, k, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (rv < 0)
+            dbg_perror("io_uring_enter(2)");
+
+        /* Take back the requests that were not submitted */
+        if (uring_sq_pending(ur) > 0) {
+            ur->ur_sq_local = *ur->ur_sq_head;
+            atomic_barrier();
+            *ur->ur_sq_tail = ur->ur_sq_local;
+        }
+
+        head = *ur->ur_cq_head;
+        while (head != *ur->ur_cq_tail) {
+            atomic_barrier();
+            cqe = &ur->ur_cqes[head & ur->ur_cq_mask];
+            idx = SOCKQ_DATA_INDEX(cqe->user_data);
+            if (SOCKQ_DATA_GEN(cqe->user_data) == sockq_gen && idx < (uint32_t) n) {
+                req[idx].sq_res = cqe->res;
+                ok |= (cqe->res >= 0);
+            }
+            head++;
+        }
+        atomic_barrier();
+        *ur->ur_cq_head = head;
+        if (rv < 0)
+            return (-1);
+    }
+
+    /* Such as a batch of AF_UNIX sockets only */
+    if (!ok)
+        return (-1);
+
+    return (0);
+}
+
+#endif /* HAVE_LINUX_URING_SOCKQ */
+
+/*
+ * Asynchronous file I/O
+ *
+ * EVFILT_AIO gives a kqueue a ring of its own for file reads and writes
+ * (see aio.c). Its descriptor is polled like any other, whichever backend
+ * the kqueue uses, and the filter reaps the completions. Each request is
+ * submitted as soon as it is made, since the caller may go on to wait on
+ * another kqueue, or on none at all.
+ */
+#define AIO_RING_ENTRIES    256
+
+struct uring *
+linux_uring_aio_new(void)
+{
+    struct io_uring_params p;
+    struct uring *ur;
+
+    ur = calloc(1, sizeof(*ur));
+    if (ur == NULL)
+        return (NULL);
+    memset(&p, 0, sizeof(p));
+    ur->ur_fd = uring_setup(AIO_RING_ENTRIES, &p);
+    if (ur->ur_fd < 0) {
+        dbg_perror("io_uring_setup(2)");
+        free(ur);
+        return (NULL);
+    }
+    ur->ur_features = p.features;
+    if (uring_map(ur, &p) < 0) {
+        uring_unmap(ur);
+        (void) close(ur->ur_fd);
+        free(ur);
+        return (NULL);
+    }
+    pthread_mutex_init(&ur->ur_mtx, NULL);
+
+    return (ur);
+}
+
+/* Closing the ring cancels the requests still in flight */
+void
+linux_uring_aio_free(struct uring *ur)
+{
+    uring_unmap(ur);
+    (void) close(ur->ur_fd);
+    pthread_mutex_destroy(&ur->ur_mtx);
+    free(ur);
+}
+
+int
+linux_uring_aio_fd(struct uring *ur)
+{
+    return (ur->ur_fd);
+}
+
+/* Submit the last SQE, or take it back if the kernel refuses it; needs ur_mtx */
+static int
+uring_aio_enter(struct uring *ur)
+{
+    int saved_errno;
+
+    if (uring_enter(ur->ur_fd, uring_sq_pending(ur), 0, 0, NULL, 0) > 0)
+        return (0);
+
+    saved_errno = errno;
+    dbg_perror("io_uring_enter(2)");
+    if (uring_sq_pending(ur) > 0) {
+        ur->ur_sq_local--;
+        atomic_barrier();
+        *ur->ur_sq_tail = ur->ur_sq_local;
+    }
+    errno = saved_errno;
+    return (-1);
+}
+
+/*
+ * Start reading or writing <len> bytes at offset <off> of <fd>. The
+ * completion is reported with <udata> by linux_uring_aio_reap().
+ */
+int
+linux_uring_aio_submit(struct uring *ur, int write, int fd, void *buf,
+        size_t len, off_t off, void *udata)
+{
+    struct io_uring_sqe *sqe;
+    int rv;
+
+    pthread_mutex_lock(&ur->ur_mtx);
+    if ((sqe = uring_sqe(ur)) == NULL) {
+        pthread_mutex_unlock(&ur->ur_mtx);
+        return (-1);
+    }
+    sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t) buf;
+    sqe->len = (len > UINT_MAX) ? UINT_MAX : len;   /* A short transfer */
+    sqe->off = off;
+    sqe->user_data = (uintptr_t) udata;
+    uring_sqe_publish(ur);
+    rv = uring_aio_enter(ur);
+    pthread_mutex_unlock(&ur->ur_mtx);
+
+    return (rv);
+}
+
+/* Ask the kernel to stop a request early; it still completes, with -ECANCELED */
+void
+linux_uring_aio_cancel(struct uring *ur, void *udata)
+{
+    struct io_uring_sqe *sqe;
+
+    pthread_mutex_lock(&ur->ur_mtx);
+    if ((sqe = uring_sqe(ur)) != NULL) {
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = (uintptr_t) udata;
+        sqe->user_data = 0;
+#ifdef IORING_FEAT_CQE_SKIP
+        if (ur->ur_features & IORING_FEAT_CQE_SKIP)
+            sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+#endif
+        uring_sqe_publish(ur);
+        (void) uring_aio_enter(ur);
+    }
+    pthread_mutex_unlock(&ur->ur_mtx);
+}
+
+/*
+ * Take up to <max> completions off the ring, and store their udata and
+ * results. The udata of a cancellation is NULL.
+ */
+int
+linux_uring_aio_reap(struct uring *ur, void **udata, int *res, int max)
+{
+    struct io_uring_cqe *cqe;
+    unsigned int head;
+    int n;
+
+    pthread_mutex_lock(&ur->ur_mtx);
+    head = *ur->ur_cq_head;
+    for (n = 0; n < max && head != *ur->ur_cq_tail; n++, head++) {
+        atomic_barrier();
+        cqe = &ur->ur_cqes[head & ur->ur_cq_mask];
+        udata[n] = (void *) (uintptr_t) cqe->user_data;
+        res[n] = cqe->res;
+    }
+    atomic_barrier();
+    *ur->ur_cq_head = head;
+    pthread_mutex_unlock(&ur->ur_mtx);
+
+    return (n);
+}
+
+const struct kqueue_vtable linux_uring_kqops = {
+    linux_kqueue_init,
+    linux_kqueue_free,
+    linux_uring_wait,
+    linux_uring_copyout,
+    NULL,
+    NULL,
+    linux_eventfd_init,
+    linux_eventfd_close,
+    linux_eventfd_raise,
+    linux_eventfd_lower,
+    linux_eventfd_descriptor,
+    linux_uring_flush,
+    NULL,
+    NULL,
+    linux_kqueue_batch_data
+};
+
+#endif /* HAVE_LINUX_IO_URING */
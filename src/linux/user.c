@@ -29,64 +29,63 @@
 #include "sys/event.h"
 #include "private.h"
 
-/* NOTE: copy+pasted from linux_eventfd_raise() */
-static int
-eventfd_raise(int evfd)
+/*
+ * All user events in a kqueue share one eventfd. It is registered with
+ * EPOLLET and never read: a write only serves to interrupt epoll_wait(),
+ * and the triggered knotes are passed to the waiter through kq_pending.
+ */
+
+static void
+evfilt_user_harvest(struct filter *filt UNUSED, struct epoll_event *ev UNUSED)
 {
-    uint64_t counter;
-    int rv = 0;
-
-    dbg_puts("raising event level");
-    counter = 1;
-    if (write(evfd, &counter, sizeof(counter)) < 0) {
-        switch (errno) {
-            case EAGAIN:    
-                /* Not considered an error */
-                break;
-
-            case EINTR:
-                rv = -EINTR;
-                break;
-
-            default:
-                dbg_printf("write(2): %s", strerror(errno));
-                rv = -1;
-        }
-    }
-    return (rv);
+    /* Nothing to do; linux_kevent_copyout() collects kq_pending itself */
+}
+
+int
+linux_evfilt_user_init(struct filter *filt)
+{
+    filt->kf_efd.ef_id = -1;
+    filt->kf_udata.ud_type = EPOLL_UDATA_FILTER;
+    filt->kf_udata.ud_ptr = filt;
+    filt->kf_harvest = evfilt_user_harvest;
+
+    return (0);
+}
+
+void
+linux_evfilt_user_destroy(struct filter *filt)
+{
+    if (filt->kf_efd.ef_id >= 0)
+        kqops.eventfd_close(&filt->kf_efd);
 }
 
-/* NOTE: copy+pasted from linux_eventfd_lower() */
 static int
-eventfd_lower(int evfd)
+evfilt_user_eventfd_create(struct filter *filt)
 {
-    uint64_t cur;
-    ssize_t n;
-    int rv = 0;
-
-    /* Reset the counter */
-    dbg_puts("lowering event level");
-    n = read(evfd, &cur, sizeof(cur));
-    if (n < 0) {
-        switch (errno) {
-            case EAGAIN:    
-                /* Not considered an error */
-                break;
-
-            case EINTR:
-                rv = -EINTR;
-                break;
-
-            default:
-                dbg_printf("read(2): %s", strerror(errno));
-                rv = -1;
-        }
-    } else if (n != sizeof(cur)) {
-        dbg_puts("short read");
-        rv = -1;
+    struct epoll_event ev;
+
+    if (kqops.eventfd_init(&filt->kf_efd) < 0)
+        return (-1);
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &filt->kf_udata;
+    if (linux_poll_ctl(filt->kf_kqueue, EPOLL_CTL_ADD,
+                kqops.eventfd_descriptor(&filt->kf_efd), &ev) < 0) {
+        dbg_perror("epoll_ctl(2)");
+        kqops.eventfd_close(&filt->kf_efd);
+        return (-1);
     }
 
-    return (rv);
+    return (0);
+}
+
+/* Forget a pending trigger; the knote lock is held */
+static void
+evfilt_user_untrigger(struct knote *kn)
+{
+    linux_knote_unpend(kn);
+    linux_knote_unready(kn);
 }
 
 int
@@ -102,51 +101,27 @@ linux_evfilt_user_copyout(struct kevent *dst, struct knote *src, void *ptr UNUSE
     }
     if (src->kev.flags & EV_CLEAR)
         src->kev.fflags &= ~NOTE_TRIGGER;
-    if (src->kev.flags & (EV_DISPATCH | EV_CLEAR | EV_ONESHOT)) {
-        if (eventfd_lower(src->kdata.kn_eventfd) < 0)
-            return (-1);
-    }
-
     if (src->kev.flags & EV_DISPATCH)
         src->kev.fflags &= ~NOTE_TRIGGER;
 
+    /* Without EV_CLEAR the event stays triggered until it is deleted */
+    if (!(src->kev.flags & (EV_DISPATCH | EV_CLEAR | EV_ONESHOT)))
+        linux_knote_ready(src);
+
     return (0);
 }
 
 int
-linux_evfilt_user_knote_create(struct filter *filt, struct knote *kn)
+linux_evfilt_user_knote_create(struct filter *filt, struct knote *kn UNUSED)
 {
-    struct epoll_event ev;
-    int evfd;
-
-    /* Create an eventfd */
-    evfd = eventfd(0, 0);
-    if (evfd < 0) {
-        dbg_perror("eventfd");
-        goto errout;
-    }
-
-    /* Add the eventfd to the epoll set */
-    memset(&ev, 0, sizeof(ev));
-    ev.events = EPOLLIN;
-    ev.data.ptr = kn;
-    if (epoll_ctl(filter_epfd(filt), EPOLL_CTL_ADD, evfd, &ev) < 0) {
-        dbg_perror("epoll_ctl(2)");
-        goto errout;
-    }
-
-    kn->kdata.kn_eventfd = evfd;
+    if (filt->kf_efd.ef_id < 0)
+        return (evfilt_user_eventfd_create(filt));
 
     return (0);
-
-errout:
-    (void) close(evfd);
-    kn->kdata.kn_eventfd = -1;
-    return (-1);
 }
 
 int
-linux_evfilt_user_knote_modify(struct filter *filt UNUSED, struct knote *kn, 
+linux_evfilt_user_knote_modify(struct filter *filt, struct knote *kn, 
         const struct kevent *kev)
 {
     unsigned int ffctrl;
@@ -178,7 +153,8 @@ linux_evfilt_user_knote_modify(struct filter *filt UNUSED, struct knote *kn,
 
     if ((!(kn->kev.flags & EV_DISABLE)) && kev->fflags & NOTE_TRIGGER) {
         kn->kev.fflags |= NOTE_TRIGGER;
-        if (eventfd_raise(kn->kdata.kn_eventfd) < 0)
+        if (linux_knote_ready_async(kn) &&
+                kqops.eventfd_raise(&filt->kf_efd) < 0)
             return (-1);
     }
 
@@ -186,41 +162,31 @@ linux_evfilt_user_knote_modify(struct filter *filt UNUSED, struct knote *kn,
 }
 
 int
-linux_evfilt_user_knote_delete(struct filter *filt, struct knote *kn)
+linux_evfilt_user_knote_delete(struct filter *filt UNUSED, struct knote *kn)
 {
-    if (epoll_ctl(filter_epfd(filt), EPOLL_CTL_DEL, 
-                kn->kdata.kn_eventfd, NULL) < 0) {
-        dbg_perror("epoll_ctl(2)");
-        return (-1);
-    }
-    if (close(kn->kdata.kn_eventfd) < 0) {
-        dbg_perror("close(2)");
-        return (-1);
-    }
-    dbg_printf("removed eventfd %d from the epollfd", kn->kdata.kn_eventfd); 
-    kn->kdata.kn_eventfd = -1;
-
+    evfilt_user_untrigger(kn);
     return (0);
 }
 
 int
-linux_evfilt_user_knote_enable(struct filter *filt, struct knote *kn)
+linux_evfilt_user_knote_enable(struct filter *filt UNUSED, struct knote *kn UNUSED)
 {
     /* FIXME: what happens if NOTE_TRIGGER is in fflags?
        should the event fire? */
-    return linux_evfilt_user_knote_create(filt, kn);
+    return (0);
 }
 
 int
-linux_evfilt_user_knote_disable(struct filter *filt, struct knote *kn)
+linux_evfilt_user_knote_disable(struct filter *filt UNUSED, struct knote *kn)
 {
-    return linux_evfilt_user_knote_delete(filt, kn);
+    evfilt_user_untrigger(kn);
+    return (0);
 }
 
 const struct filter evfilt_user = {
     EVFILT_USER,
-    NULL,
-    NULL,
+    linux_evfilt_user_init,
+    linux_evfilt_user_destroy,
     linux_evfilt_user_copyout,
     linux_evfilt_user_knote_create,
     linux_evfilt_user_knote_modify,
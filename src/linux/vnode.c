@@ -59,48 +59,199 @@ inotify_event_dump(struct inotify_event *evt)
 #endif /* !NDEBUG */
 
 
-/* TODO: USE this to get events with name field */
-int
-get_one_event(struct inotify_event *dst, int inofd)
+/* Size of the buffer that inotify events are read into */
+#define VNODE_BUFSIZE   (64 * 1024)
+
+/* Initial number of buckets in the watch descriptor index */
+#define VNODE_HASHSIZE  64
+
+/*
+ * Every vnode knote in a kqueue shares one inotify descriptor. Knotes are
+ * indexed by watch descriptor; several knotes have the same one when they
+ * refer to the same file.
+ */
+struct evfilt_data {
+    int         vn_inotifyfd;
+    size_t      vn_count;
+    size_t      vn_size;                /* Number of buckets, a power of two */
+    LIST_HEAD(vnode_hash, knote) *vn_hash;
+    char        vn_buf[VNODE_BUFSIZE]
+                    __attribute__ ((aligned(__alignof__(struct inotify_event))));
+};
+
+static struct vnode_hash *
+vnode_bucket(struct evfilt_data *vn, int wd)
+{
+    return (&vn->vn_hash[(unsigned int) wd & (vn->vn_size - 1)]);
+}
+
+static int
+vnode_hash_grow(struct evfilt_data *vn)
+{
+    struct vnode_hash *old = vn->vn_hash;
+    size_t i, oldsize = vn->vn_size;
+    struct knote *kn;
+
+    vn->vn_hash = calloc(oldsize * 2, sizeof(*vn->vn_hash));
+    if (vn->vn_hash == NULL) {
+        vn->vn_hash = old;
+        return (-1);
+    }
+    vn->vn_size = oldsize * 2;
+    for (i = 0; i < vn->vn_size; i++)
+        LIST_INIT(&vn->vn_hash[i]);
+
+    for (i = 0; i < oldsize; i++) {
+        while ((kn = LIST_FIRST(&old[i])) != NULL) {
+            LIST_REMOVE(kn, kdata.kn_vnode.v_entries);
+            LIST_INSERT_HEAD(vnode_bucket(vn, kn->kdata.kn_vnode.v_wd), 
+                    kn, kdata.kn_vnode.v_entries);
+        }
+    }
+    free(old);
+
+    return (0);
+}
+
+/* Accumulate the events of every knote watching a file */
+static void
+vnode_event(struct evfilt_data *vn, struct inotify_event *evt)
 {
-    ssize_t n;
+    struct knote *kn, *next;
+
+    dbg_printf("inotify event: %s", inotify_event_dump(evt));
+    if (evt->wd < 0) {
+        /* IN_Q_OVERFLOW: there is nothing sensible to report */
+        dbg_puts("inotify event queue overflow");
+        return;
+    }
+
+    for (kn = LIST_FIRST(vnode_bucket(vn, evt->wd)); kn != NULL; kn = next) {
+        next = LIST_NEXT(kn, kdata.kn_vnode.v_entries);
+        if (kn->kdata.kn_vnode.v_wd != evt->wd)
+            continue;
+
+        if (evt->mask & IN_IGNORED) {
+            /* The kernel removed the watch, e.g. the file was deleted */
+            LIST_REMOVE(kn, kdata.kn_vnode.v_entries);
+            kn->kdata.kn_vnode.v_wd = -1;
+            vn->vn_count--;
+            continue;
+        }
+
+        kn->kdata.kn_vnode.v_events |= evt->mask;
+        linux_knote_ready(kn);
+    }
+}
+
+static void
+evfilt_vnode_harvest(struct filter *filt, struct epoll_event *ev UNUSED)
+{
+    struct evfilt_data *vn = filt->kf_data;
+    struct inotify_event *evt;
+    ssize_t n, off;
 
-    dbg_puts("reading one inotify event");
     for (;;) {
-        n = read(inofd, dst, sizeof(*dst));
+        n = read(vn->vn_inotifyfd, vn->vn_buf, sizeof(vn->vn_buf));
         if (n < 0) {
             if (errno == EINTR)
                 continue;
-            dbg_perror("read");
-            return (-1);
-        } else {
-            break;
+            if (errno != EAGAIN)
+                dbg_perror("read(2) from inotify");
+            return;
         }
+        dbg_printf("read(2) from inotify: %ld bytes", (long) n);
+
+        for (off = 0; off < n; off += sizeof(*evt) + evt->len) {
+            evt = (struct inotify_event *) (vn->vn_buf + off);
+            vnode_event(vn, evt);
+        }
+
+        /* Stop once there is clearly nothing left to read */
+        if ((size_t) n < sizeof(vn->vn_buf) - (sizeof(*evt) + NAME_MAX + 1))
+            return;
     }
-    dbg_printf("read(2) from inotify wd: %ld bytes", (long) n);
+}
 
-    /* FIXME-TODO: if len > 0, read(len) */
-    if (dst->len != 0) 
-        abort();
+static int
+vnode_create(struct filter *filt)
+{
+    struct evfilt_data *vn;
+    struct epoll_event ev;
+    size_t i;
 
+    vn = calloc(1, sizeof(*vn));
+    if (vn == NULL)
+        return (-1);
+    vn->vn_size = VNODE_HASHSIZE;
+    vn->vn_hash = calloc(vn->vn_size, sizeof(*vn->vn_hash));
+    if (vn->vn_hash == NULL) {
+        free(vn);
+        return (-1);
+    }
+    for (i = 0; i < vn->vn_size; i++)
+        LIST_INIT(&vn->vn_hash[i]);
+
+    vn->vn_inotifyfd = inotify_init();
+    if (vn->vn_inotifyfd < 0) {
+        dbg_perror("inotify_init(2)");
+        goto errout;
+    }
+    if (fcntl(vn->vn_inotifyfd, F_SETFL, O_NONBLOCK) < 0) {
+        dbg_perror("fcntl(2)");
+        goto errout;
+    }
+
+    filt->kf_udata.ud_type = EPOLL_UDATA_FILTER;
+    filt->kf_udata.ud_ptr = filt;
+    filt->kf_harvest = evfilt_vnode_harvest;
 
+    /* Add the inotify fd to the epoll set */
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = &filt->kf_udata;
+    if (linux_poll_ctl(filt->kf_kqueue, EPOLL_CTL_ADD, vn->vn_inotifyfd, &ev) < 0) {
+        dbg_perror("epoll_ctl(2)");
+        goto errout;
+    }
+
+    filt->kf_data = vn;
     return (0);
+
+errout:
+    if (vn->vn_inotifyfd >= 0)
+        (void) close(vn->vn_inotifyfd);
+    free(vn->vn_hash);
+    free(vn);
+    return (-1);
+}
+
+static void
+evfilt_vnode_destroy(struct filter *filt)
+{
+    struct evfilt_data *vn = filt->kf_data;
+
+    if (vn == NULL)
+        return;
+    (void) close(vn->vn_inotifyfd);
+    free(vn->vn_hash);
+    free(vn);
+    filt->kf_data = NULL;
 }
 
 static int
 add_watch(struct filter *filt, struct knote *kn)
 {
-    struct epoll_event ev;
-    int ifd;
-    char path[PATH_MAX];
+    struct evfilt_data *vn = filt->kf_data;
+    char path[64];
     uint32_t mask;
+    int wd;
 
-    /* Convert the fd to a pathname */
-    if (linux_fd_to_path(&path[0], sizeof(path), kn->kev.ident) < 0)
-        return (-1);
+    /* The magic link is followed to the file behind the descriptor */
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", (int) kn->kev.ident);
 
     /* Convert the fflags to the inotify mask */
-    mask = IN_CLOSE;
+    mask = 0;
     if (kn->kev.fflags & NOTE_DELETE)
         mask |= IN_ATTRIB | IN_DELETE_SELF;
     if (kn->kev.fflags & NOTE_WRITE)      
@@ -112,57 +263,54 @@ add_watch(struct filter *filt, struct knote *kn)
         mask |= IN_ATTRIB;
     if (kn->kev.fflags & NOTE_RENAME)
         mask |= IN_MOVE_SELF;
-    if (kn->kev.flags & EV_ONESHOT)
-        mask |= IN_ONESHOT;
 
-    /* Create an inotify descriptor */
-    ifd = inotify_init();
-    if (ifd < 0) {
-        dbg_perror("inotify_init(2)");
-        return (-1);
-    }
-
-    /* Add the watch */
+    /* 
+     * The watch may be shared with other knotes on the same file, so
+     * the mask is only ever extended. EV_ONESHOT is left to kevent_copyout().
+     */
     dbg_printf("inotify_add_watch(2); inofd=%d, %s, path=%s", 
-            ifd, inotify_mask_dump(mask), path);
-    kn->kev.data = inotify_add_watch(ifd, path, mask);
-    if (kn->kev.data < 0) {
+            vn->vn_inotifyfd, inotify_mask_dump(mask), path);
+    wd = inotify_add_watch(vn->vn_inotifyfd, path, mask | IN_MASK_ADD);
+    if (wd < 0) {
         dbg_perror("inotify_add_watch(2)");
-        goto errout;
-    }
-
-    /* Add the inotify fd to the epoll set */
-    memset(&ev, 0, sizeof(ev));
-    ev.events = EPOLLIN;
-    ev.data.ptr = kn;
-    if (epoll_ctl(filter_epfd(filt), EPOLL_CTL_ADD, ifd, &ev) < 0) {
-        dbg_perror("epoll_ctl(2)");
-        goto errout;
+        return (-1);
     }
 
-    kn->kdata.kn_inotifyfd = ifd;
+    if (vn->vn_count >= vn->vn_size)
+        (void) vnode_hash_grow(vn);
+    kn->kdata.kn_vnode.v_wd = wd;
+    kn->kdata.kn_vnode.v_events = 0;
+    LIST_INSERT_HEAD(vnode_bucket(vn, wd), kn, kdata.kn_vnode.v_entries);
+    vn->vn_count++;
 
     return (0);
-
-errout:
-    kn->kdata.kn_inotifyfd = -1;
-    (void) close(ifd);
-    return (-1);
 }
 
 static int
 delete_watch(struct filter *filt, struct knote *kn)
 {
-    int ifd = kn->kdata.kn_inotifyfd;
+    struct evfilt_data *vn = filt->kf_data;
+    struct knote *ent;
+    int wd = kn->kdata.kn_vnode.v_wd;
 
-    if (ifd < 0)
+    linux_knote_unready(kn);
+    kn->kdata.kn_vnode.v_events = 0;
+    if (wd < 0)
         return (0);
-    if (epoll_ctl(filter_epfd(filt), EPOLL_CTL_DEL, ifd, NULL) < 0) {
-        dbg_perror("epoll_ctl(2)");
+
+    LIST_REMOVE(kn, kdata.kn_vnode.v_entries);
+    kn->kdata.kn_vnode.v_wd = -1;
+    vn->vn_count--;
+
+    /* Keep the watch while another knote refers to the same file */
+    LIST_FOREACH(ent, vnode_bucket(vn, wd), kdata.kn_vnode.v_entries) {
+        if (ent->kdata.kn_vnode.v_wd == wd)
+            return (0);
+    }
+    if (inotify_rm_watch(vn->vn_inotifyfd, wd) < 0 && errno != EINVAL) {
+        dbg_perror("inotify_rm_watch(2)");
         return (-1);
     }
-    (void) close(ifd);
-    kn->kdata.kn_inotifyfd = -1;
 
     return (0);
 }
@@ -170,35 +318,19 @@ delete_watch(struct filter *filt, struct knote *kn)
 int
 evfilt_vnode_copyout(struct kevent *dst, struct knote *src, void *ptr UNUSED)
 {
-    struct inotify_event evt;
     struct stat sb;
+    uint32_t events;
 
-    if (get_one_event(&evt, src->kdata.kn_inotifyfd) < 0)
-        return (-1);
-
-    dbg_printf("inotify event: %s", inotify_event_dump(&evt));
-    if (evt.mask & IN_IGNORED) {
-        /* TODO: possibly return error when fs is unmounted */
-        dst->filter = 0;
-        return (0);
-    }
-
-    /* Check if the watched file has been closed, and 
-       XXX-this may not exactly match the kevent() behavior if multiple file de
-scriptors reference the same file.
-    */
-    if (evt.mask & IN_CLOSE_WRITE || evt.mask & IN_CLOSE_NOWRITE) {
-        src->kn_flags |= EV_ONESHOT; /* KLUDGE: causes the knote to be deleted */
-        dst->filter = 0; /* KLUDGE: causes the event to be discarded */
-        return (0);
-    }
+    events = src->kdata.kn_vnode.v_events;
+    src->kdata.kn_vnode.v_events = 0;
 
     memcpy(dst, &src->kev, sizeof(*dst));
+    dst->fflags = 0;
     dst->data = 0;
 
     /* No error checking because fstat(2) should rarely fail */
     //FIXME: EINTR
-    if ((evt.mask & IN_ATTRIB || evt.mask & IN_MODIFY) 
+    if ((events & IN_ATTRIB || events & IN_MODIFY) 
         && fstat(src->kev.ident, &sb) == 0) {
         if (sb.st_nlink == 0 && src->kev.fflags & NOTE_DELETE) 
             dst->fflags |= NOTE_DELETE;
@@ -214,23 +346,18 @@ scriptors reference the same file.
        src->data.vnode.size = sb.st_size;
     }
 
-    if (evt.mask & IN_MODIFY && src->kev.fflags & NOTE_WRITE) 
+    if (events & IN_MODIFY && src->kev.fflags & NOTE_WRITE) 
         dst->fflags |= NOTE_WRITE;
-    if (evt.mask & IN_ATTRIB && src->kev.fflags & NOTE_ATTRIB) 
+    if (events & IN_ATTRIB && src->kev.fflags & NOTE_ATTRIB) 
         dst->fflags |= NOTE_ATTRIB;
-    if (evt.mask & IN_MOVE_SELF && src->kev.fflags & NOTE_RENAME) 
+    if (events & IN_MOVE_SELF && src->kev.fflags & NOTE_RENAME) 
         dst->fflags |= NOTE_RENAME;
-    if (evt.mask & IN_DELETE_SELF && src->kev.fflags & NOTE_DELETE) 
+    if (events & IN_DELETE_SELF && src->kev.fflags & NOTE_DELETE) 
         dst->fflags |= NOTE_DELETE;
 
-    if (evt.mask & IN_MODIFY && src->kev.fflags & NOTE_WRITE) 
-        dst->fflags |= NOTE_WRITE;
-    if (evt.mask & IN_ATTRIB && src->kev.fflags & NOTE_ATTRIB) 
-        dst->fflags |= NOTE_ATTRIB;
-    if (evt.mask & IN_MOVE_SELF && src->kev.fflags & NOTE_RENAME) 
-        dst->fflags |= NOTE_RENAME;
-    if (evt.mask & IN_DELETE_SELF && src->kev.fflags & NOTE_DELETE) 
-        dst->fflags |= NOTE_DELETE;
+    /* The watch may report changes that this knote did not ask for */
+    if (dst->fflags == 0)
+        dst->filter = 0;
 
     return (0);
 }
@@ -240,6 +367,9 @@ evfilt_vnode_knote_create(struct filter *filt, struct knote *kn)
 {
     struct stat sb;
 
+    if (filt->kf_data == NULL && vnode_create(filt) < 0)
+        return (-1);
+
     if (fstat(kn->kev.ident, &sb) < 0) {
         dbg_puts("fstat failed");
         return (-1);
@@ -247,10 +377,10 @@ evfilt_vnode_knote_create(struct filter *filt, struct knote *kn)
     kn->data.vnode.nlink = sb.st_nlink;
     kn->data.vnode.size = sb.st_size;
     kn->kev.data = -1;
+    kn->kdata.kn_vnode.v_wd = -1;
 
     return (add_watch(filt, kn));
 }
-
 int
 evfilt_vnode_knote_modify(struct filter *filt, struct knote *kn, 
         const struct kevent *kev)
@@ -270,6 +400,10 @@ evfilt_vnode_knote_delete(struct filter *filt, struct knote *kn)
 int
 evfilt_vnode_knote_enable(struct filter *filt, struct knote *kn)
 {
+    /* The knote is already watched */
+    if (kn->kdata.kn_vnode.v_wd >= 0)
+        return (0);
+
     return add_watch(filt, kn);
 }
 
@@ -282,7 +416,7 @@ evfilt_vnode_knote_disable(struct filter *filt, struct knote *kn)
 const struct filter evfilt_vnode = {
     EVFILT_VNODE,
     NULL,
-    NULL,
+    evfilt_vnode_destroy,
     evfilt_vnode_copyout,
     evfilt_vnode_knote_create,
     evfilt_vnode_knote_modify,
@@ -30,6 +30,32 @@
 
 #include "private.h"
 
+/*
+ * Report the socket as writable only once NOTE_LOWAT bytes can be queued.
+ * Linux does not let SO_SNDLOWAT be changed, and TCP_NOTSENT_LOWAT limits
+ * the unsent bytes rather than asking for room, so the copyout compares
+ * the room left in the send buffer against the mark for every socket. The
+ * knote becomes edge-triggered, so that a full buffer is not reported
+ * again until the peer has taken some of it.
+ */
+static void
+lowat_watch(struct knote *kn)
+{
+    socklen_t slen;
+
+    if (kn->kev.data <= 1)
+        return;
+
+    slen = sizeof(kn->kdata.kn_sock.s_sndbuf);
+    if (getsockopt(kn->kev.ident, SOL_SOCKET, SO_SNDBUF,
+                &kn->kdata.kn_sock.s_sndbuf, &slen) < 0) {
+        dbg_perror("getsockopt(2)");
+        return;
+    }
+    kn->kn_flags |= KNFL_LOWAT_CHECK;
+    kn->data.events = (kn->data.events & ~EPOLLONESHOT) | EPOLLET;
+}
+
 int
 evfilt_socket_copyout(struct kevent *dst, struct knote *src, void *ptr)
 {
@@ -48,11 +74,15 @@ evfilt_socket_copyout(struct kevent *dst, struct knote *src, void *ptr)
         dst->fflags = 1; /* FIXME: Return the actual socket error */
           
     /* On return, data contains the the amount of space remaining in the write buffer */
-    if (ioctl(dst->ident, SIOCOUTQ, &dst->data) < 0) {
-            /* race condition with socket close, so ignore this error */
-            dbg_puts("ioctl(2) of socket failed");
-            dst->data = 0;
-    }
+    if (src->kn_flags & KNFL_LOWAT_CHECK) {
+        if (linux_sockq_size(dst, SIOCOUTQ) < 0 ||
+                src->kdata.kn_sock.s_sndbuf - dst->data < src->kev.data)
+            if (!(dst->flags & EV_EOF) && !(ev->events & EPOLLERR))
+                dst->filter = 0;    /* Will cause the kevent to be discarded */
+    } else if (src->kev.fflags & NOTE_NODATA)
+        dst->data = 0;
+    else
+        linux_sockq_data(dst, SIOCOUTQ);
 
     return (0);
 }
@@ -60,8 +90,6 @@ evfilt_socket_copyout(struct kevent *dst, struct knote *src, void *ptr)
 int
 evfilt_socket_knote_create(struct filter *filt, struct knote *kn)
 {
-    struct epoll_event ev;
-
     if (linux_get_descriptor_type(kn) < 0)
         return (-1);
 
@@ -76,11 +104,10 @@ evfilt_socket_knote_create(struct filter *filt, struct knote *kn)
     if (kn->kev.flags & EV_CLEAR)
         kn->data.events |= EPOLLET;
 
-    memset(&ev, 0, sizeof(ev));
-    ev.events = kn->data.events;
-    ev.data.ptr = kn;
+    if (kn->kev.fflags & NOTE_LOWAT)
+        lowat_watch(kn);
 
-    return epoll_update(EPOLL_CTL_ADD, filt, kn, &ev);
+    return (linux_fd_attach(filt, kn));
 }
 
 int
@@ -96,28 +123,20 @@ evfilt_socket_knote_modify(struct filter *filt, struct knote *kn,
 int
 evfilt_socket_knote_delete(struct filter *filt, struct knote *kn)
 {
-    if (kn->kev.flags & EV_DISABLE)
-        return (0);
-    else
-        return epoll_update(EPOLL_CTL_DEL, filt, kn, NULL);
+    return (linux_fd_detach(filt, kn));
 }
 
 int
 evfilt_socket_knote_enable(struct filter *filt, struct knote *kn)
 {
-    struct epoll_event ev;
-
-    memset(&ev, 0, sizeof(ev));
-    ev.events = kn->data.events;
-    ev.data.ptr = kn;
-
-    return epoll_update(EPOLL_CTL_ADD, filt, kn, &ev);
+    return (linux_fd_update(filt, kn->kn_fds));
 }
 
 int
 evfilt_socket_knote_disable(struct filter *filt, struct knote *kn)
 {
-    return epoll_update(EPOLL_CTL_DEL, filt, kn, NULL);
+    linux_knote_unready(kn);
+    return (linux_fd_update(filt, kn->kn_fds));
 }
 
 const struct filter evfilt_write = {
@@ -27,8 +27,10 @@
  */
 #define atomic_inc(p)   __sync_add_and_fetch((p), 1)
 #define atomic_dec(p)   __sync_sub_and_fetch((p), 1)
+#define atomic_add(p, n) __sync_add_and_fetch((p), (n))
 #define atomic_cas(p, oval, nval) __sync_val_compare_and_swap(p, oval, nval)
 #define atomic_ptr_cas(p, oval, nval) __sync_val_compare_and_swap(p, oval, nval)
+#define atomic_barrier() __sync_synchronize()
 
 /*
  * GCC-compatible branch prediction macros
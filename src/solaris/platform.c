@@ -18,12 +18,14 @@
 
 const struct filter evfilt_vnode = EVFILT_NOTIMPL;
 const struct filter evfilt_proc  = EVFILT_NOTIMPL;
+const struct filter evfilt_aio   = EVFILT_NOTIMPL;
 
 /*
  * Per-thread port event buffer used to ferry data between
- * kevent_wait() and kevent_copyout().
+ * kevent_wait() and kevent_copyout(). Only one event is retrieved
+ * at a time.
  */
-static __thread port_event_t evbuf[MAX_KEVENT];
+static __thread port_event_t evbuf[1];
 
 #ifndef NDEBUG
 
@@ -31,6 +31,8 @@
 #define atomic_cas      atomic_cas_ptr
 #undef atomic_ptr_cas
 #define atomic_ptr_cas      atomic_cas_ptr
+#undef atomic_barrier
+#define atomic_barrier()    membar_enter()
 
 /*
  * Event ports
@@ -50,6 +50,7 @@
 #define atomic_dec   InterlockedDecrement
 #define atomic_cas(p, oval, nval) InterlockedCompareExchange(p, nval, oval)
 #define atomic_ptr_cas(p, oval, nval) InterlockedCompareExchangePointer(p, nval, oval)
+#define atomic_barrier() MemoryBarrier()
 
 /*
  * Additional members of struct kqueue
@@ -139,6 +140,7 @@ typedef CRITICAL_SECTION pthread_rwlock_t;
 #define _cs_unlock(x)  LeaveCriticalSection ((x))
 #define pthread_mutex_lock _cs_lock
 #define pthread_mutex_unlock _cs_unlock
+#define pthread_mutex_trylock(x) (TryEnterCriticalSection((x)) ? 0 : EBUSY)
 #define pthread_mutex_init(x,y) _cs_init((x))
 #define pthread_spin_lock _cs_lock
 #define pthread_spin_unlock _cs_unlock
@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2011 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <aio.h>
+
+#include "common.h"
+
+#if HAVE_LINUX_IO_URING
+
+static void
+aio_start(struct test_context *ctx, struct aiocb *cb)
+{
+    struct kevent kev;
+
+    EV_SET(&kev, (uintptr_t) cb, EVFILT_AIO, EV_ADD, 0, 0, cb);
+    if (kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL) < 0)
+        die("kevent");
+}
+
+static void
+test_kevent_aio_write_and_read(struct test_context *ctx)
+{
+    char path[] = "/tmp/kqueue-test-aio.XXXXXX";
+    char wbuf[] = "hello, world";
+    char rbuf[sizeof(wbuf)];
+    struct aiocb cb;
+    struct kevent kev;
+    int fd;
+
+    if ((fd = mkstemp(path)) < 0)
+        die("mkstemp");
+    unlink(path);
+
+    memset(&cb, 0, sizeof(cb));
+    cb.aio_fildes = fd;
+    cb.aio_buf = wbuf;
+    cb.aio_nbytes = sizeof(wbuf);
+    cb.aio_offset = 4;
+    cb.aio_lio_opcode = LIO_WRITE;
+    aio_start(ctx, &cb);
+
+    kevent_get(&kev, ctx->kqfd);
+    if (kev.udata != &cb || kev.flags != (EV_ADD | EV_ONESHOT) ||
+            kev.data != (intptr_t) sizeof(wbuf))
+        err(1, "%s - bad write completion (data %d)",
+                ctx->cur_test_id, (int) kev.data);
+
+    /* The transfer reads back what the first one wrote */
+    memset(rbuf, 0, sizeof(rbuf));
+    cb.aio_buf = rbuf;
+    cb.aio_lio_opcode = LIO_READ;
+    aio_start(ctx, &cb);
+
+    kevent_get(&kev, ctx->kqfd);
+    if (kev.data != (intptr_t) sizeof(rbuf) || memcmp(rbuf, wbuf, sizeof(rbuf)))
+        err(1, "%s - bad read completion (data %d)",
+                ctx->cur_test_id, (int) kev.data);
+
+    test_no_kevents(ctx->kqfd);
+    close(fd);
+}
+
+static void
+test_kevent_aio_error(struct test_context *ctx)
+{
+    char buf[16];
+    struct aiocb cb;
+    struct kevent kev;
+    int fd;
+
+    /* An unknown opcode is refused when the knote is added */
+    memset(&cb, 0, sizeof(cb));
+    cb.aio_lio_opcode = LIO_NOP;
+    EV_SET(&kev, (uintptr_t) &cb, EVFILT_AIO, EV_ADD, 0, 0, &cb);
+    if (kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL) == 0)
+        die("kevent");
+
+    /* A failed transfer is reported with EV_ERROR */
+    if ((fd = open("/dev/null", O_WRONLY)) < 0)
+        die("open");
+    cb.aio_fildes = fd;
+    cb.aio_buf = buf;
+    cb.aio_nbytes = sizeof(buf);
+    cb.aio_lio_opcode = LIO_READ;
+    aio_start(ctx, &cb);
+
+    kevent_get(&kev, ctx->kqfd);
+    if (!(kev.flags & EV_ERROR) || kev.data != EBADF)
+        err(1, "%s - expected EBADF (data %d)",
+                ctx->cur_test_id, (int) kev.data);
+
+    test_no_kevents(ctx->kqfd);
+    close(fd);
+}
+
+/* Deleting the knote cancels a transfer that has not completed */
+static void
+test_kevent_aio_delete_in_flight(struct test_context *ctx)
+{
+    char buf[16];
+    struct aiocb cb;
+    struct kevent kev;
+    int fd[2];
+
+    if (pipe(fd) < 0)
+        die("pipe");
+
+    /* The read waits for data that is never written */
+    memset(buf, 0, sizeof(buf));
+    memset(&cb, 0, sizeof(cb));
+    cb.aio_fildes = fd[0];
+    cb.aio_buf = buf;
+    cb.aio_nbytes = sizeof(buf);
+    cb.aio_lio_opcode = LIO_READ;
+    aio_start(ctx, &cb);
+    test_no_kevents(ctx->kqfd);
+
+    EV_SET(&kev, (uintptr_t) &cb, EVFILT_AIO, EV_DELETE, 0, 0, &cb);
+    if (kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL) < 0)
+        die("kevent");
+
+    /* The cancelled read neither fires nor consumes what comes later */
+    test_no_kevents(ctx->kqfd);
+    if (write(fd[1], "x", 1) != 1)
+        die("write");
+    test_no_kevents(ctx->kqfd);
+    if (buf[0] != '\0')
+        err(1, "%s - cancelled read completed", ctx->cur_test_id);
+
+    /* The aiocb can be reused once the knote is gone */
+    aio_start(ctx, &cb);
+    kevent_get(&kev, ctx->kqfd);
+    if (kev.udata != &cb || kev.data != 1 || buf[0] != 'x')
+        err(1, "%s - bad read completion (data %d)",
+                ctx->cur_test_id, (int) kev.data);
+
+    test_no_kevents(ctx->kqfd);
+    close(fd[0]);
+    close(fd[1]);
+}
+
+void
+test_evfilt_aio(struct test_context *ctx)
+{
+    test(kevent_aio_write_and_read, ctx);
+    test(kevent_aio_error, ctx);
+    test(kevent_aio_delete_in_flight, ctx);
+}
+#endif /* HAVE_LINUX_IO_URING */
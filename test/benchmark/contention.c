@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2011 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Measure kevent() throughput when many threads share one kqueue.
+ *
+ * Each socket in a pool is kept readable and registered with EV_DISPATCH,
+ * so that only one thread at a time owns it. A thread harvests up to
+ * NEVENTS events and re-enables them with the changelist of its next
+ * call, which is what an event loop with a pool of workers does.
+ *
+ * Usage: contention [-s sockets] [-t seconds] [max threads]
+ */
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/event.h>
+
+#define NEVENTS 64
+
+static int kqfd;
+static int nsockets = 1024;
+static int seconds = 2;
+static volatile int running;
+
+static double
+now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (tv.tv_sec + tv.tv_usec / 1000000.0);
+}
+
+static void *
+worker(void *arg)
+{
+    struct kevent changes[NEVENTS], events[NEVENTS];
+    unsigned long *count = (unsigned long *) arg;
+    struct timespec ts = { 0, 10000000 };
+    int i, n, nchanges = 0;
+
+    while (running) {
+        n = kevent(kqfd, changes, nchanges, events, NEVENTS, &ts);
+        if (n < 0)
+            err(1, "kevent");
+        for (i = 0; i < n; i++) {
+            EV_SET(&changes[i], events[i].ident, EVFILT_READ, EV_ENABLE,
+                    0, 0, NULL);
+        }
+        nchanges = n;
+        *count += n;
+    }
+
+    /* Give back the sockets this thread still owns */
+    if (nchanges > 0 && kevent(kqfd, changes, nchanges, NULL, 0, NULL) < 0)
+        err(1, "kevent");
+    return (NULL);
+}
+
+static double
+run(int nthreads)
+{
+    pthread_t *tid;
+    unsigned long *count, total;
+    double start, elapsed;
+    int i;
+
+    tid = calloc(nthreads, sizeof(*tid));
+    count = calloc(nthreads, sizeof(*count) * 16);   /* One line per thread */
+    if (tid == NULL || count == NULL)
+        err(1, "calloc");
+
+    running = 1;
+    start = now();
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&tid[i], NULL, worker, &count[i * 16]) != 0)
+            err(1, "pthread_create");
+    }
+    sleep(seconds);
+    running = 0;
+    for (i = 0; i < nthreads; i++)
+        pthread_join(tid[i], NULL);
+    elapsed = now() - start;
+
+    for (total = 0, i = 0; i < nthreads; i++)
+        total += count[i * 16];
+    free(tid);
+    free(count);
+
+    return (total / elapsed);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct kevent kev;
+    int sv[2], i, c, maxthreads = 32;
+    double rate, base = 0;
+
+    while ((c = getopt(argc, argv, "s:t:")) != -1) {
+        switch (c) {
+            case 's':
+                nsockets = atoi(optarg);
+                break;
+            case 't':
+                seconds = atoi(optarg);
+                break;
+            default:
+                errx(1, "usage: contention [-s sockets] [-t seconds] [max threads]");
+        }
+    }
+    if (optind < argc)
+        maxthreads = atoi(argv[optind]);
+
+    if ((kqfd = kqueue()) < 0)
+        err(1, "kqueue");
+
+    for (i = 0; i < nsockets; i++) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+            err(1, "socketpair");
+        if (write(sv[1], ".", 1) != 1)
+            err(1, "write");
+        EV_SET(&kev, sv[0], EVFILT_READ, EV_ADD | EV_DISPATCH, 0, 0, NULL);
+        if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0)
+            err(1, "kevent");
+    }
+
+    printf("%8s %14s %8s\n", "threads", "events/sec", "speedup");
+    for (i = 1; i <= maxthreads; i *= 2) {
+        rate = run(i);
+        if (i == 1)
+            base = rate;
+        printf("%8d %14.0f %8.2f\n", i, rate, rate / base);
+    }
+
+    return (0);
+}
@@ -0,0 +1,207 @@
+/*
+ * Copyright (c) 2011 Mark Heily <mark@heily.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Measure the wakeups of threads that block on one kqueue.
+ *
+ * A producer sends a byte to a burst of sockets, waits for the workers to
+ * consume them, and starts over. Every worker blocks in kevent() for one
+ * event at a time, which is what a thread pool does. For each wakeup mode,
+ * the benchmark reports the context switches and the futile wakeups per
+ * event: the waits that returned nothing, and the events for a socket
+ * whose byte another thread had already read.
+ *
+ * Usage: herd [-b burst] [-t seconds] [-l] [-u] [threads]
+ *   -l   use level-triggered knotes instead of EV_CLEAR
+ *   -u   use EVFILT_USER knotes instead of sockets
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/event.h>
+
+static int kqfd;
+static int burst = 8;
+static int seconds = 2;
+static int use_user;
+static int level;
+static int sock[64][2];
+static volatile int running;
+static volatile unsigned long consumed;
+static volatile unsigned long stale;
+
+static void *
+worker(void *arg)
+{
+    struct kevent kev;
+    struct timespec ts = { 0, 100000000 };
+    char buf;
+    int n;
+
+    (void) arg;
+    while (running) {
+        n = kevent(kqfd, NULL, 0, &kev, 1, &ts);
+        if (n < 0)
+            err(1, "kevent");
+        if (n == 0)
+            continue;
+        if (!use_user && read(sock[(intptr_t) kev.udata][0], &buf, 1) != 1) {
+            if (errno != EAGAIN)
+                err(1, "read");
+            __sync_add_and_fetch(&stale, 1);    /* Another thread was first */
+            continue;
+        }
+        __sync_add_and_fetch(&consumed, 1);
+    }
+    return (NULL);
+}
+
+static void
+produce(void)
+{
+    struct kevent kev;
+    unsigned long target;
+    int i;
+
+    target = consumed + burst;
+    for (i = 0; i < burst; i++) {
+        if (use_user) {
+            EV_SET(&kev, i, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+            if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0)
+                err(1, "kevent");
+        } else if (write(sock[i][1], ".", 1) != 1) {
+            err(1, "write");
+        }
+    }
+    while (consumed < target && running)
+        sched_yield();
+}
+
+static double
+now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (tv.tv_sec + tv.tv_usec / 1000000.0);
+}
+
+static void
+run(int nthreads, int exclusive)
+{
+    struct kqueue_stats st0, st1;
+    struct rusage ru0, ru1;
+    pthread_t *tid;
+    unsigned long events;
+    double end;
+    long csw;
+    int i;
+
+    if (kqueue_exclusive(kqfd, exclusive) < 0)
+        err(1, "kqueue_exclusive");
+    if ((tid = calloc(nthreads, sizeof(*tid))) == NULL)
+        err(1, "calloc");
+
+    kqueue_stats(kqfd, &st0);
+    getrusage(RUSAGE_SELF, &ru0);
+    consumed = 0;
+    stale = 0;
+    running = 1;
+    for (i = 0; i < nthreads; i++) {
+        if (pthread_create(&tid[i], NULL, worker, NULL) != 0)
+            err(1, "pthread_create");
+    }
+    for (end = now() + seconds; now() < end; )
+        produce();
+    running = 0;
+    for (i = 0; i < nthreads; i++)
+        pthread_join(tid[i], NULL);
+    getrusage(RUSAGE_SELF, &ru1);
+    kqueue_stats(kqfd, &st1);
+    free(tid);
+
+    events = consumed;
+    csw = (ru1.ru_nvcsw - ru0.ru_nvcsw) + (ru1.ru_nivcsw - ru0.ru_nivcsw);
+    printf("%8d %10s %12lu %12.2f %12.3f\n", nthreads,
+            exclusive ? "exclusive" : "shared", events,
+            (double) csw / events,
+            (double) (st1.ks_futile_wakeups - st0.ks_futile_wakeups + stale) / events);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct kevent kev;
+    int i, c, maxthreads = 16;
+
+    while ((c = getopt(argc, argv, "b:lt:u")) != -1) {
+        switch (c) {
+            case 'b':
+                burst = atoi(optarg);
+                break;
+            case 'l':
+                level = 1;
+                break;
+            case 't':
+                seconds = atoi(optarg);
+                break;
+            case 'u':
+                use_user = 1;
+                break;
+            default:
+                errx(1, "usage: herd [-b burst] [-t seconds] [-l] [-u] [threads]");
+        }
+    }
+    if (optind < argc)
+        maxthreads = atoi(argv[optind]);
+    if (burst < 1 || burst > 64)
+        errx(1, "the burst must be between 1 and 64");
+
+    if ((kqfd = kqueue()) < 0)
+        err(1, "kqueue");
+    for (i = 0; i < burst; i++) {
+        if (use_user) {
+            EV_SET(&kev, i, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
+        } else {
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, sock[i]) < 0)
+                err(1, "socketpair");
+            if (fcntl(sock[i][0], F_SETFL, O_NONBLOCK) < 0)
+                err(1, "fcntl");
+            EV_SET(&kev, sock[i][0], EVFILT_READ, level ? EV_ADD : EV_ADD | EV_CLEAR,
+                    0, 0, (void *) (intptr_t) i);
+        }
+        if (kevent(kqfd, &kev, 1, NULL, 0, NULL) < 0)
+            err(1, "kevent");
+    }
+
+    printf("%8s %10s %12s %12s %12s\n", "threads", "wakeups", "events",
+            "csw/event", "futile/event");
+    for (i = 1; i <= maxthreads; i *= 2) {
+        run(i, 0);
+        run(i, 1);
+    }
+
+    return (0);
+}
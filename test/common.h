@@ -43,6 +43,7 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <sys/event.h>
 #include <arpa/inet.h>
@@ -55,6 +56,12 @@
 # include "src/windows/platform.h"
 #endif
 
+/* libkqueue implements EVFILT_AIO with the io_uring code, as in src/linux/platform.h */
+#if defined(__linux__) && HAVE_LINUX_IO_URING_H && HAVE_DECL_IORING_FEAT_EXT_ARG && \
+    HAVE_DECL_IORING_ENTER_EXT_ARG && HAVE_DECL_IORING_OP_EPOLL_CTL
+# define HAVE_LINUX_IO_URING 1
+#endif
+
 struct test_context;
 
 struct unit_test {
@@ -88,6 +95,9 @@ void test_evfilt_proc(struct test_context *);
 #ifdef EVFILT_USER
 void test_evfilt_user(struct test_context *);
 #endif
+#if HAVE_LINUX_IO_URING
+void test_evfilt_aio(struct test_context *);
+#endif
 
 #define test(f,ctx,...) do {                                            \
     assert(ctx != NULL); \
@@ -109,6 +109,34 @@ test_kevent(void *unused)
         die("invalid kq parameter");
 }
 
+/* A wait without events lasts at least as long as its timeout */
+void
+test_kevent_timeout(void *unused)
+{
+#if !defined(_WIN32)
+    static const long timeouts[] = { 250000, 1500000, 2500000 };
+    struct timespec ts, start, end;
+    struct kevent kev;
+    long elapsed;
+    int i, kq;
+
+    if ((kq = kqueue()) < 0)
+        die("kqueue()");
+    for (i = 0; i < 3; i++) {
+        ts.tv_sec = 0;
+        ts.tv_nsec = timeouts[i];
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (kevent(kq, NULL, 0, &kev, 1, &ts) != 0)
+            die("kevent");
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        elapsed = (end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec);
+        if (elapsed < timeouts[i])
+            errx(1, "kevent() returned early");
+    }
+    close(kq);
+#endif
+}
+
 void
 test_ev_receipt(void *unused)
 {
@@ -159,6 +187,7 @@ test_harness(struct unit_test tests[MAX_TESTS], int iterations)
 
     test(kqueue, ctx);
     test(kevent, ctx);
+    test(kevent_timeout, ctx);
 
     if ((kqfd = kqueue()) < 0)
         die("kqueue()");
@@ -193,7 +222,7 @@ usage(void)
     printf("usage: [-hn] [testclass ...]\n"
            " -h        This message\n"
            " -n        Number of iterations (default: 1)\n"
-           " testclass Tests suites to run: [socket signal timer vnode user]\n"
+           " testclass Tests suites to run: [socket signal proc timer vnode user aio]\n"
            "           All tests are run by default\n"
            "\n"
           );
@@ -209,7 +238,7 @@ main(int argc, char **argv)
         // XXX-FIXME -- BROKEN ON LINUX WHEN RUN IN A SEPARATE THREAD
         { "signal", 1, test_evfilt_signal },
 #endif
-#if FIXME
+#if defined(__linux__) && !defined(__ANDROID__)
         { "proc", 1, test_evfilt_proc },
 #endif
 		{ "timer", 1, test_evfilt_timer },
@@ -218,6 +247,9 @@ main(int argc, char **argv)
 #endif
 #ifdef EVFILT_USER
         { "user", 1, test_evfilt_user },
+#endif
+#if HAVE_LINUX_IO_URING
+        { "aio", 1, test_evfilt_aio },
 #endif
         { NULL, 0, NULL },
     };
@@ -16,9 +16,8 @@
 
 #include "common.h"
 
-static int sigusr1_caught = 0;
+static volatile sig_atomic_t sigusr1_caught = 0;
 static pid_t pid;
-static int kqfd;
 
 static void
 sig_handler(int signum)
@@ -31,9 +30,9 @@ test_kevent_proc_add(struct test_context *ctx)
 {
     struct kevent kev;
 
-    test_no_kevents(kqfd);
-    kevent_add(kqfd, &kev, pid, EVFILT_PROC, EV_ADD, 0, 0, NULL);
-    test_no_kevents(kqfd);
+    test_no_kevents(ctx->kqfd);
+    kevent_add(ctx->kqfd, &kev, pid, EVFILT_PROC, EV_ADD, 0, 0, NULL);
+    test_no_kevents(ctx->kqfd);
 }
 
 static void
@@ -41,38 +40,92 @@ test_kevent_proc_delete(struct test_context *ctx)
 {
     struct kevent kev;
 
-    test_no_kevents(kqfd);
-    kevent_add(kqfd, &kev, pid, EVFILT_PROC, EV_DELETE, 0, 0, NULL);
+    test_no_kevents(ctx->kqfd);
+    kevent_add(ctx->kqfd, &kev, pid, EVFILT_PROC, EV_DELETE, 0, 0, NULL);
     if (kill(pid, SIGKILL) < 0)
         die("kill");
     sleep(1);
-    test_no_kevents(kqfd);
+    test_no_kevents(ctx->kqfd);
+    waitpid(pid, NULL, 0);
 }
 
 static void
 test_kevent_proc_get(struct test_context *ctx)
 {
     struct kevent kev, buf;
+    sigset_t mask;
 
     /* Create a child that waits to be killed and then exits */
     pid = fork();
     if (pid == 0) {
-        pause();
+        /* The signal tests leave SIGUSR1 blocked */
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGUSR1);
+        sigprocmask(SIG_UNBLOCK, &mask, NULL);
+
+        /* Polled, since the signal may arrive before pause(2) is called */
+        while (!sigusr1_caught)
+            usleep(10000);
         printf(" -- child caught signal, exiting\n");
-        exit(2);
+        _exit(2);
     }
     printf(" -- child created (pid %d)\n", (int) pid);
 
-    test_no_kevents(kqfd);
-    kevent_add(kqfd, &kev, pid, EVFILT_PROC, EV_ADD, 0, 0, NULL);
+    test_no_kevents(ctx->kqfd);
+    kevent_add(ctx->kqfd, &kev, pid, EVFILT_PROC, EV_ADD, NOTE_EXIT, 0, NULL);
 
     /* Cause the child to exit, then retrieve the event */
     printf(" -- killing process %d\n", (int) pid);
     if (kill(pid, SIGUSR1) < 0)
         die("kill");
-    kevent_get(&buf, kqfd);
+    kevent_get(&buf, ctx->kqfd);
+    if (!WIFEXITED(buf.data) || WEXITSTATUS(buf.data) != 2)
+        err(1, "%s - incorrect exit status %d", test_id, (int) buf.data);
+    kev.flags |= EV_EOF | EV_ONESHOT;
+    kev.data = buf.data;
+    kevent_cmp(&kev, &buf);
+    test_no_kevents(ctx->kqfd);
+    waitpid(pid, NULL, 0);
+}
+
+/* Processes that are not children can be watched too, without an exit status */
+static void
+test_kevent_proc_not_child(struct test_context *ctx)
+{
+    struct kevent kev, buf;
+    pid_t child;
+    int fd[2];
+
+    if (pipe(fd) < 0)
+        die("pipe");
+
+    /* The grandchild is reparented when the child exits */
+    child = fork();
+    if (child == 0) {
+        pid = fork();
+        if (pid == 0) {
+            pause();
+            _exit(0);
+        }
+        if (write(fd[1], &pid, sizeof(pid)) != sizeof(pid))
+            _exit(1);
+        _exit(0);
+    }
+    if (read(fd[0], &pid, sizeof(pid)) != sizeof(pid))
+        die("read");
+    waitpid(child, NULL, 0);
+    close(fd[0]);
+    close(fd[1]);
+
+    kevent_add(ctx->kqfd, &kev, pid, EVFILT_PROC, EV_ADD, NOTE_EXIT, 0, NULL);
+    test_no_kevents(ctx->kqfd);
+
+    if (kill(pid, SIGKILL) < 0)
+        die("kill");
+    kevent_get(&buf, ctx->kqfd);
+    kev.flags |= EV_EOF | EV_ONESHOT;
     kevent_cmp(&kev, &buf);
-    test_no_kevents(kqfd);
+    test_no_kevents(ctx->kqfd);
 }
 
 #ifdef TODO
@@ -208,13 +261,14 @@ test_evfilt_proc(struct test_context *ctx)
     pid = fork();
     if (pid == 0) {
         pause();
-        exit(2);
+        _exit(2);
     }
     printf(" -- child created (pid %d)\n", (int) pid);
 
     test(kevent_proc_add, ctx);
     test(kevent_proc_delete, ctx);
     test(kevent_proc_get, ctx);
+    test(kevent_proc_not_child, ctx);
 
     signal(SIGUSR1, SIG_DFL);
 
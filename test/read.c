@@ -17,6 +17,9 @@
 
 #include "common.h"
 
+#ifndef _WIN32
+#include <netinet/tcp.h>
+#endif
 
 /*
  * Create a connected TCP socket.
@@ -250,7 +253,7 @@ test_kevent_socket_listen_backlog(struct test_context *ctx)
     socklen_t sa_len = sizeof(sain);
     int one = 1;
     short port;
-    int clnt, srvr;
+    int clnt, clnt2, srvr;
 
     port = 14973 + ctx->iteration;
 
@@ -281,9 +284,13 @@ test_kevent_socket_listen_backlog(struct test_context *ctx)
         err(1, "socket()");
     if (connect(clnt, (struct sockaddr *) &sain, sa_len) < 0)
         err(1, "connect()");
+    if ((clnt2 = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        err(1, "socket()");
+    if (connect(clnt2, (struct sockaddr *) &sain, sa_len) < 0)
+        err(1, "connect()");
 
-    /* Verify that data=1 */
-    kev.data = 1;
+    /* Verify that data is the number of pending connections */
+    kev.data = 2;
     kevent_get(&ret, ctx->kqfd);
     kevent_cmp(&kev, &ret); 
     test_no_kevents(ctx->kqfd);
@@ -323,37 +330,150 @@ test_kevent_socket_dispatch(struct test_context *ctx)
 }
 #endif  /* EV_DISPATCH */
 
-#if BROKEN_ON_LINUX
+#ifdef NOTE_LOWAT
 void
 test_kevent_socket_lowat(struct test_context *ctx)
 {
-    struct kevent kev;
-
-    test_begin(test_id);
+    struct kevent kev, ret;
 
-    /* Re-add the watch and make sure no events are pending */
-    puts("-- re-adding knote, setting low watermark to 2 bytes");
-    EV_SET(&kev, ctx->client_fd, EVFILT_READ, EV_ADD | EV_ONESHOT, NOTE_LOWAT, 2, &ctx->client_fd);
-    if (kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL) < 0)
-        die("%s", test_id);
-    test_no_kevents();
+    /* Re-add the watch with a low-water mark of 2 bytes */
+    kevent_add(ctx->kqfd, &kev, ctx->client_fd, EVFILT_READ, EV_ADD | EV_ONESHOT, NOTE_LOWAT, 2, &ctx->client_fd);
+    test_no_kevents(ctx->kqfd);
 
-    puts("-- checking that one byte does not trigger an event..");
+    /* One byte does not trigger an event */
     kevent_socket_fill(ctx);
-    test_no_kevents();
+    test_no_kevents(ctx->kqfd);
 
-    puts("-- checking that two bytes triggers an event..");
+    /* Two bytes do */
     kevent_socket_fill(ctx);
-    if (kevent(ctx->kqfd, NULL, 0, &kev, 1, NULL) != 1)
-        die("%s", test_id);
-    KEV_CMP(kev, ctx->client_fd, EVFILT_READ, 0);
-    test_no_kevents();
+    kevent_get(&ret, ctx->kqfd);
+    kevent_cmp(&kev, &ret);
+    test_no_kevents(ctx->kqfd);
 
     kevent_socket_drain(ctx);
     kevent_socket_drain(ctx);
 }
+
+/* The low-water mark of a socket that does not honor SO_RCVLOWAT */
+void
+test_kevent_socket_lowat_unix(struct test_context *ctx)
+{
+    struct kevent kev, ret;
+    char buf[1];
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+        die("socketpair");
+    kevent_add(ctx->kqfd, &kev, sv[0], EVFILT_READ, EV_ADD, NOTE_LOWAT, 2, NULL);
+
+    if (write(sv[1], ".", 1) != 1)
+        die("write");
+    test_no_kevents(ctx->kqfd);
+
+    /* The knote is level-triggered, so it is reported until it is read */
+    if (write(sv[1], ".", 1) != 1)
+        die("write");
+    kevent_get(&ret, ctx->kqfd);
+    kevent_cmp(&kev, &ret);
+    kevent_get(&ret, ctx->kqfd);
+    kevent_cmp(&kev, &ret);
+
+    if (read(sv[0], &buf[0], 1) != 1)
+        die("read");
+    test_no_kevents(ctx->kqfd);
+    if (write(sv[1], ".", 1) != 1)
+        die("write");
+    kevent_get(&ret, ctx->kqfd);
+    kevent_cmp(&kev, &ret);
+    kevent_add(ctx->kqfd, &kev, sv[0], EVFILT_READ, EV_DELETE, 0, 0, NULL);
+
+    /* There is never enough room in the send buffer for this mark */
+    kevent_add(ctx->kqfd, &kev, sv[1], EVFILT_WRITE, EV_ADD, NOTE_LOWAT, 1 << 30, NULL);
+    test_no_kevents(ctx->kqfd);
+    kevent_add(ctx->kqfd, &kev, sv[1], EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+
+    close(sv[0]);
+    close(sv[1]);
+}
+
+/* The write mark of a TCP socket asks for room in the send buffer */
+void
+test_kevent_socket_lowat_write(struct test_context *ctx)
+{
+    struct kevent kev, ret;
+#ifdef TCP_NOTSENT_LOWAT
+    socklen_t slen;
+    int before, after;
+
+    slen = sizeof(before);
+    if (getsockopt(ctx->client_fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &before, &slen) < 0)
+        die("getsockopt");
+#endif
+
+    /* There is never enough room in the send buffer for this mark */
+    kevent_add(ctx->kqfd, &kev, ctx->client_fd, EVFILT_WRITE, EV_ADD, NOTE_LOWAT, 1 << 30, &ctx->client_fd);
+    test_no_kevents(ctx->kqfd);
+#ifdef TCP_NOTSENT_LOWAT
+    slen = sizeof(after);
+    if (getsockopt(ctx->client_fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &after, &slen) < 0)
+        die("getsockopt");
+    if (after != before)
+        err(1, "%s - TCP_NOTSENT_LOWAT changed to %d", ctx->cur_test_id, after);
+#endif
+    kevent_add(ctx->kqfd, &kev, ctx->client_fd, EVFILT_WRITE, EV_DELETE, 0, 0, &ctx->client_fd);
+
+    /* An empty send buffer has room for a small mark */
+    kevent_add(ctx->kqfd, &kev, ctx->client_fd, EVFILT_WRITE, EV_ADD, NOTE_LOWAT, 64, &ctx->client_fd);
+    kevent_get(&ret, ctx->kqfd);
+    if (ret.ident != (uintptr_t) ctx->client_fd || ret.filter != EVFILT_WRITE)
+        err(1, "%s - bad event", ctx->cur_test_id);
+    kevent_add(ctx->kqfd, &kev, ctx->client_fd, EVFILT_WRITE, EV_DELETE, 0, 0, &ctx->client_fd);
+    test_no_kevents(ctx->kqfd);
+}
 #endif
 
+/* EVFILT_READ and EVFILT_WRITE on the same socket */
+void
+test_kevent_socket_read_and_write(struct test_context *ctx)
+{
+    struct kevent kev[2], ret[2];
+    int i, nfds;
+
+    test_no_kevents(ctx->kqfd);
+
+    kevent_add(ctx->kqfd, &kev[0], ctx->client_fd, EVFILT_READ, EV_ADD, 0, 0, &ctx->client_fd);
+    kevent_add(ctx->kqfd, &kev[1], ctx->client_fd, EVFILT_WRITE, EV_ADD | EV_CLEAR, 0, 0, &ctx->client_fd);
+
+    /* Only the write filter is ready */
+    nfds = kevent(ctx->kqfd, NULL, 0, ret, 2, NULL);
+    if (nfds != 1 || ret[0].filter != EVFILT_WRITE)
+        err(1, "%s - expected a single EVFILT_WRITE event", test_id);
+    test_no_kevents(ctx->kqfd);
+
+    /* The read filter stays ready until the data is read */
+    kevent_socket_fill(ctx);
+    for (i = 0; i < 2; i++) {
+        nfds = kevent(ctx->kqfd, NULL, 0, ret, 2, NULL);
+        if (nfds < 1)
+            die("kevent");
+        if (ret[0].filter != EVFILT_READ && (nfds < 2 || ret[1].filter != EVFILT_READ))
+            err(1, "%s - missing EVFILT_READ event", test_id);
+    }
+    kevent_socket_drain(ctx);
+
+    /* Deleting one filter leaves the other one in place */
+    kevent_add(ctx->kqfd, &kev[1], ctx->client_fd, EVFILT_WRITE, EV_DELETE, 0, 0, &ctx->client_fd);
+    test_no_kevents(ctx->kqfd);
+    kevent_socket_fill(ctx);
+    kev[0].data = 1;
+    kevent_get(&ret[0], ctx->kqfd);
+    kevent_cmp(&kev[0], &ret[0]);
+    kevent_socket_drain(ctx);
+
+    kevent_add(ctx->kqfd, &kev[0], ctx->client_fd, EVFILT_READ, EV_DELETE, 0, 0, &ctx->client_fd);
+    test_no_kevents(ctx->kqfd);
+}
+
 void
 test_kevent_socket_eof(struct test_context *ctx)
 {
@@ -419,6 +539,634 @@ test_kevent_regular_file(struct test_context *ctx)
     close(fd);
 }
 
+/* A reader at the end of a regular file waits for it to grow */
+void
+test_kevent_regular_file_tail(struct test_context *ctx)
+{
+    struct kevent kev, ret;
+    char path[1024], buf[8];
+    const char *tmpdir;
+    int fd, wfd;
+
+    if ((tmpdir = getenv("TMPDIR")) == NULL)
+        tmpdir = "/tmp";
+    snprintf(path, sizeof(path), "%s/kqueue-tail.XXXXXX", tmpdir);
+    if ((wfd = mkstemp(path)) < 0)
+        die("mkstemp");
+    if ((fd = open(path, O_RDONLY)) < 0)
+        die("open");
+    unlink(path);
+
+    kevent_add(ctx->kqfd, &kev, fd, EVFILT_READ, EV_ADD, 0, 0, &fd);
+    test_no_kevents(ctx->kqfd);
+
+    if (write(wfd, "hello", 5) != 5)
+        die("write(2)");
+    kev.data = 5;
+    kevent_get(&ret, ctx->kqfd);
+    kevent_cmp(&kev, &ret);
+    if (read(fd, buf, sizeof(buf)) != 5)
+        die("read(2)");
+    test_no_kevents(ctx->kqfd);
+
+    /* A truncated file is reported with a negative offset */
+    if (ftruncate(wfd, 2) < 0)
+        die("ftruncate(2)");
+    kev.data = -3;
+    kevent_get(&ret, ctx->kqfd);
+    kevent_cmp(&kev, &ret);
+
+    kevent_add(ctx->kqfd, &kev, fd, EVFILT_READ, EV_DELETE, 0, 0, &fd);
+    test_no_kevents(ctx->kqfd);
+    close(fd);
+    close(wfd);
+}
+
+/* The knote of a regular file does not need a descriptor of its own */
+void
+test_kevent_regular_file_nofd(struct test_context *ctx)
+{
+    struct kevent kev, ret;
+    int fd, probe;
+
+    fd = open("/etc/hosts", O_RDONLY);
+    if (fd < 0)
+        die("open");
+    if ((probe = dup(fd)) < 0)
+        die("dup");
+    close(probe);
+
+    kevent_add(ctx->kqfd, &kev, fd, EVFILT_READ, EV_ADD | EV_DISPATCH, 0, 0, &fd);
+    if (dup(fd) != probe)
+        err(1, "%s - the knote took a descriptor", ctx->cur_test_id);
+    close(probe);
+
+    /* It is ready until disabled, and ready again once enabled */
+    kevent_get(&ret, ctx->kqfd);
+    test_no_kevents(ctx->kqfd);
+    kevent_add(ctx->kqfd, &kev, fd, EVFILT_READ, EV_ENABLE | EV_DISPATCH, 0, 0, &fd);
+    kevent_get(&ret, ctx->kqfd);
+
+    kevent_add(ctx->kqfd, &kev, fd, EVFILT_READ, EV_DELETE, 0, 0, &fd);
+    test_no_kevents(ctx->kqfd);
+    close(fd);
+}
+
+/* Several changes to the same knote in one changelist */
+void
+test_kevent_socket_changelist(struct test_context *ctx)
+{
+    struct kevent kev[4], ret[4];
+    struct timespec timeo = { 0, 0 };
+    int fd, i, nret;
+
+    /* A knote that is added and deleted again is never reported */
+    EV_SET(&kev[0], ctx->client_fd, EVFILT_READ, EV_ADD | EV_RECEIPT, 0, 0, &ctx->client_fd);
+    EV_SET(&kev[1], ctx->client_fd, EVFILT_READ, EV_DELETE | EV_RECEIPT, 0, 0, &ctx->client_fd);
+    nret = kevent(ctx->kqfd, kev, 2, ret, 4, &timeo);
+    if (nret != 2)
+        die("kevent");
+    for (i = 0; i < 2; i++) {
+        if (!(ret[i].flags & EV_ERROR) || ret[i].data != 0)
+            err(1, "%s - unexpected receipt %s", ctx->cur_test_id, kevent_to_str(&ret[i]));
+    }
+    kevent_socket_fill(ctx);
+    test_no_kevents(ctx->kqfd);
+
+    /* The add still reports its error when a delete follows it */
+    if ((fd = dup(ctx->client_fd)) < 0)
+        die("dup(2)");
+    close(fd);
+    EV_SET(&kev[0], fd, EVFILT_READ, EV_ADD | EV_RECEIPT, 0, 0, NULL);
+    EV_SET(&kev[1], fd, EVFILT_READ, EV_DELETE | EV_RECEIPT, 0, 0, NULL);
+    nret = kevent(ctx->kqfd, kev, 2, ret, 4, &timeo);
+    if (nret != 2 || ret[0].data == 0 || ret[1].data != ENOENT)
+        err(1, "%s - unexpected results for a closed descriptor", ctx->cur_test_id);
+
+    /* Each change gets its own result: the first delete fails */
+    EV_SET(&kev[0], ctx->client_fd, EVFILT_READ, EV_DELETE, 0, 0, &ctx->client_fd);
+    EV_SET(&kev[1], ctx->client_fd, EVFILT_READ, EV_ADD, 0, 0, &ctx->client_fd);
+    EV_SET(&kev[2], ctx->client_fd, EVFILT_READ, EV_DISABLE, 0, 0, &ctx->client_fd);
+    EV_SET(&kev[3], ctx->client_fd, EVFILT_READ, EV_ENABLE | EV_RECEIPT, 0, 0, &ctx->client_fd);
+    nret = kevent(ctx->kqfd, kev, 4, ret, 2, &timeo);
+    if (nret != 2 || ret[0].data != ENOENT || ret[0].flags != (EV_DELETE | EV_ERROR)
+            || !(ret[1].flags & EV_ENABLE) || ret[1].data != 0)
+        err(1, "%s - unexpected results", ctx->cur_test_id);
+
+    /* The knote ends up enabled */
+    EV_SET(&kev[0], ctx->client_fd, EVFILT_READ, EV_ADD, 0, 1, &ctx->client_fd);
+    kevent_get(&ret[0], ctx->kqfd);
+    kevent_cmp(&kev[0], &ret[0]);
+    kevent_socket_drain(ctx);
+
+    /* Disabling and enabling a knote again leaves it enabled */
+    EV_SET(&kev[0], ctx->client_fd, EVFILT_READ, EV_DISABLE, 0, 0, &ctx->client_fd);
+    EV_SET(&kev[1], ctx->client_fd, EVFILT_READ, EV_ENABLE, 0, 0, &ctx->client_fd);
+    if (kevent(ctx->kqfd, kev, 2, NULL, 0, NULL) < 0)
+        die("kevent");
+    kevent_socket_fill(ctx);
+    kevent_get(&ret[0], ctx->kqfd);
+    kevent_socket_drain(ctx);
+
+    kevent_add(ctx->kqfd, &kev[0], ctx->client_fd, EVFILT_READ, EV_DELETE, 0, 0, &ctx->client_fd);
+    test_no_kevents(ctx->kqfd);
+}
+
+/* More than 512 events are returned by a single call */
+void
+test_kevent_socket_many(struct test_context *ctx)
+{
+    struct kevent kev, *ret;
+    struct timespec timeo = { 0, 0 };
+    int fd[600];
+    const int nfds = sizeof(fd) / sizeof(fd[0]);
+    int i, nret;
+
+    if ((ret = calloc(nfds + 1, sizeof(*ret))) == NULL)
+        die("calloc");
+    for (i = 0; i < nfds; i++) {
+        if ((fd[i] = dup(ctx->client_fd)) < 0)
+            die("dup(2)");
+        kevent_add(ctx->kqfd, &kev, fd[i], EVFILT_READ, EV_ADD, 0, 0, NULL);
+    }
+    kevent_socket_fill(ctx);
+
+    nret = kevent(ctx->kqfd, NULL, 0, ret, nfds + 1, &timeo);
+    if (nret != nfds)
+        err(1, "%s - expected %d events, got %d", ctx->cur_test_id, nfds, nret);
+
+    for (i = 0; i < nfds; i++) {
+        kevent_add(ctx->kqfd, &kev, fd[i], EVFILT_READ, EV_DELETE, 0, 0, NULL);
+        close(fd[i]);
+    }
+    kevent_socket_drain(ctx);
+    test_no_kevents(ctx->kqfd);
+    free(ret);
+}
+
+#ifdef HAVE_KEVENT_BATCH
+static int batch_fd[4];
+
+static void *
+batch_writer(void *arg)
+{
+    int i;
+
+    (void) arg;
+    for (i = 0; i < 4; i++) {
+        usleep(20000);
+        if (write(batch_fd[i], ".", 1) < 1)
+            err(1, "write(2)");
+    }
+    return (NULL);
+}
+
+static long
+elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000);
+}
+
+/*
+ * kevent_batch() gathers events until there are enough, or for a while.
+ * Level-triggered knotes end a batch early, so the knotes use EV_CLEAR.
+ */
+void
+test_kevent_socket_batch(struct test_context *ctx)
+{
+    struct kevent kev, ret[8];
+    struct timespec start, latency = { 5, 0 };
+    int sv[4][2];
+    pthread_t tid;
+    int i, nret;
+    char buf;
+
+    for (i = 0; i < 4; i++) {
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv[i]) < 0)
+            die("socketpair");
+        batch_fd[i] = sv[i][1];
+        kevent_add(ctx->kqfd, &kev, sv[i][0], EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, NULL);
+    }
+
+    /* Events that trickle in are returned together */
+    if (pthread_create(&tid, NULL, batch_writer, NULL) != 0)
+        err(1, "pthread_create");
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    nret = kevent_batch(ctx->kqfd, NULL, 0, ret, 8, 4, NULL, &latency);
+    pthread_join(tid, NULL);
+    if (nret != 4 || elapsed_ms(&start) >= 5000)
+        err(1, "%s - expected 4 events, got %d", ctx->cur_test_id, nret);
+    for (i = 0; i < 4; i++) {
+        if (read(sv[i][0], &buf, 1) < 1)
+            die("read(2)");
+    }
+
+    /* A batch that does not fill up ends with the latency */
+    if (write(sv[0][1], ".", 1) < 1)
+        die("write(2)");
+    latency.tv_sec = 0;
+    latency.tv_nsec = 100000000;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    nret = kevent_batch(ctx->kqfd, NULL, 0, ret, 8, 4, NULL, &latency);
+    if (nret != 1 || elapsed_ms(&start) < 90)
+        err(1, "%s - expected 1 event after 100ms, got %d", ctx->cur_test_id, nret);
+
+    for (i = 0; i < 4; i++) {
+        kevent_add(ctx->kqfd, &kev, sv[i][0], EVFILT_READ, EV_DELETE, 0, 0, NULL);
+        close(sv[i][0]);
+        close(sv[i][1]);
+    }
+    test_no_kevents(ctx->kqfd);
+}
+#endif
+
+#ifdef HAVE_KQUEUE_BUSY_POLL
+/* A kqueue in busy-poll mode counts the spins that found events */
+void
+test_kevent_socket_busy_poll(struct test_context *ctx)
+{
+    struct kevent kev, ret;
+    struct kqueue_stats stats;
+    struct timespec timeo = { 0, 1000000 };
+    int kqfd;
+
+    if ((kqfd = kqueue()) < 0)
+        die("kqueue");
+    if (kqueue_busy_poll(kqfd, 200) < 0) {
+        if (errno != ENOTSUP)
+            die("kqueue_busy_poll");
+        puts("Skipped -- busy polling is not supported by this backend");
+        close(kqfd);
+        return;
+    }
+    kevent_add(kqfd, &kev, ctx->client_fd, EVFILT_READ, EV_ADD, 0, 0, &ctx->client_fd);
+
+    kevent_socket_fill(ctx);
+    if (kevent(kqfd, NULL, 0, &ret, 1, &timeo) != 1)
+        err(1, "%s - missing event", ctx->cur_test_id);
+    kevent_socket_drain(ctx);
+    if (kevent(kqfd, NULL, 0, &ret, 1, &timeo) != 0)
+        err(1, "%s - unexpected event", ctx->cur_test_id);
+
+    if (kqueue_stats(kqfd, &stats) < 0)
+        die("kqueue_stats");
+    if (stats.ks_waits != 2 || stats.ks_spin_hits != 1 || stats.ks_spin_misses != 1)
+        err(1, "%s - wrong statistics", ctx->cur_test_id);
+    close(kqfd);
+}
+
+#ifdef NOTE_ACCEPT
+/* A listening socket in NOTE_ACCEPT mode returns the new connections */
+void
+test_kevent_socket_accept(struct test_context *ctx)
+{
+    struct kevent kev, ret[4];
+    struct sockaddr_in sain;
+    socklen_t sa_len = sizeof(sain);
+    int one = 1;
+    int clnt[2], conn[2], srvr, i, n;
+
+    memset(&sain, 0, sizeof(sain));
+    sain.sin_family = AF_INET;
+    sain.sin_port = htons(15973 + ctx->iteration);
+    sain.sin_addr.s_addr = inet_addr("127.0.0.1");
+    if ((srvr = socket(PF_INET, SOCK_STREAM, 0)) < 0)
+        die("socket");
+    if (setsockopt(srvr, SOL_SOCKET, SO_REUSEADDR, (char *) &one, sizeof(one)) != 0)
+        die("setsockopt");
+    if (bind(srvr, (struct sockaddr *) &sain, sa_len) < 0)
+        die("bind");
+    if (listen(srvr, 100) < 0)
+        die("listen");
+
+    EV_SET(&kev, srvr, EVFILT_READ, EV_ADD, NOTE_ACCEPT | NOTE_ACCEPT_READ, 0, &ctx->server_fd);
+    if (kevent(ctx->kqfd, &kev, 1, NULL, 0, NULL) < 0)
+        die("kevent");
+    test_no_kevents(ctx->kqfd);
+
+    for (i = 0; i < 2; i++) {
+        if ((clnt[i] = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+            die("socket");
+        if (connect(clnt[i], (struct sockaddr *) &sain, sa_len) < 0)
+            die("connect");
+    }
+
+    /* Both connections are returned by one call, and watched for reading */
+    n = kevent(ctx->kqfd, NULL, 0, ret, 4, NULL);
+    if (n != 2)
+        err(1, "%s - %d events, expected 2", ctx->cur_test_id, n);
+    for (i = 0; i < n; i++) {
+        kev.data = conn[i] = ret[i].data;
+        kevent_cmp(&kev, &ret[i]);
+    }
+    test_no_kevents(ctx->kqfd);
+
+    if (send(clnt[0], ".", 1, 0) < 1)
+        die("send");
+    if (kevent(ctx->kqfd, NULL, 0, ret, 4, NULL) != 1 ||
+            (int) ret[0].ident != conn[0] || ret[0].udata != &ctx->server_fd)
+        die("wrong event for the first connection");
+
+    for (i = 0; i < 2; i++) {
+        kevent_add(ctx->kqfd, &kev, conn[i], EVFILT_READ, EV_DELETE, 0, 0, NULL);
+        close(conn[i]);
+        close(clnt[i]);
+    }
+    kevent_add(ctx->kqfd, &kev, srvr, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+    close(srvr);
+}
+#endif
+
+#if defined(NOTE_ACCEPT) && defined(HAVE_KEVENT_BATCH)
+static struct sockaddr_in accept_sain;
+static int accept_clnt;
+
+static void *
+accept_connector(void *arg)
+{
+    (void) arg;
+    usleep(20000);
+    if ((accept_clnt = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        err(1, "socket(2)");
+    if (connect(accept_clnt, (struct sockaddr *) &accept_sain, sizeof(accept_sain)) < 0)
+        err(1, "connect(2)");
+    return (NULL);
+}
+
+/* Connections accepted by different waits of a batch are all returned */
+void
+test_kevent_socket_accept_batch(struct test_context *ctx)
+{
+    struct kevent kev, ret[4];
+    struct timespec latency = { 0, 300000000 };
+    pthread_t tid;
+    int one = 1;
+    int clnt, srvr, i, nret;
+
+    memset(&accept_sain, 0, sizeof(accept_sain));
+    accept_sain.sin_family = AF_INET;
+    accept_sain.sin_port = htons(16973 + ctx->iteration);
+    accept_sain.sin_addr.s_addr = inet_addr("127.0.0.1");
+    if ((srvr = socket(PF_INET, SOCK_STREAM, 0)) < 0)
+        die("socket");
+    if (setsockopt(srvr, SOL_SOCKET, SO_REUSEADDR, (char *) &one, sizeof(one)) != 0)
+        die("setsockopt");
+    if (bind(srvr, (struct sockaddr *) &accept_sain, sizeof(accept_sain)) < 0)
+        die("bind");
+    if (listen(srvr, 100) < 0)
+        die("listen");
+    kevent_add(ctx->kqfd, &kev, srvr, EVFILT_READ, EV_ADD, NOTE_ACCEPT, 0, NULL);
+
+    /* One connection is waiting, and the other arrives during the batch */
+    if ((clnt = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        die("socket");
+    if (connect(clnt, (struct sockaddr *) &accept_sain, sizeof(accept_sain)) < 0)
+        die("connect");
+    if (pthread_create(&tid, NULL, accept_connector, NULL) != 0)
+        err(1, "pthread_create");
+    nret = kevent_batch(ctx->kqfd, NULL, 0, ret, 4, 4, NULL, &latency);
+    pthread_join(tid, NULL);
+    if (nret != 2 || ret[0].data == ret[1].data)
+        err(1, "%s - expected 2 connections, got %d", ctx->cur_test_id, nret);
+    for (i = 0; i < nret; i++) {
+        if ((int) ret[i].ident != srvr || ret[i].data < 0)
+            err(1, "%s - bad event", ctx->cur_test_id);
+        close(ret[i].data);
+    }
+
+    kevent_add(ctx->kqfd, &kev, srvr, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+    test_no_kevents(ctx->kqfd);
+    close(accept_clnt);
+    close(clnt);
+    close(srvr);
+}
+#endif
+
+#ifdef NOTE_NODATA
+/* A knote with NOTE_NODATA does not report the bytes in the queue */
+void
+test_kevent_socket_nodata(struct test_context *ctx)
+{
+    struct kevent kev, ret;
+
+    kevent_add(ctx->kqfd, &kev, ctx->client_fd, EVFILT_READ, EV_ADD, NOTE_NODATA, 0, &ctx->client_fd);
+    kevent_socket_fill(ctx);
+
+    kev.data = 0;
+    kevent_get(&ret, ctx->kqfd);
+    kevent_cmp(&kev, &ret);
+
+    kevent_socket_drain(ctx);
+    kevent_add(ctx->kqfd, &kev, ctx->client_fd, EVFILT_READ, EV_DELETE, 0, 0, &ctx->client_fd);
+    test_no_kevents(ctx->kqfd);
+}
+#endif
+
+#ifdef HAVE_KQUEUE_BATCH_DATA
+/* The data of the events of a copyout are fetched together */
+void
+test_kevent_socket_batch_data(struct test_context *ctx)
+{
+    struct kevent kev, ret[4];
+    struct timespec timeo = { 1, 0 };
+    char buf[2];
+    int kqfd, i, n, seen;
+
+    if ((kqfd = kqueue()) < 0)
+        die("kqueue");
+    if (kqueue_batch_data(kqfd, 1) < 0) {
+        if (errno != ENOTSUP)
+            die("kqueue_batch_data");
+        puts("Skipped -- batched data is not supported by this backend");
+        close(kqfd);
+        return;
+    }
+    kevent_add(kqfd, &kev, ctx->client_fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
+    kevent_add(kqfd, &kev, ctx->server_fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
+    kevent_socket_fill(ctx);
+    if (send(ctx->client_fd, "..", 2, 0) < 2)
+        die("send(2)");
+
+    for (seen = 0; seen != 3; ) {
+        if ((n = kevent(kqfd, NULL, 0, ret, 4, &timeo)) < 1)
+            err(1, "%s - missing events", ctx->cur_test_id);
+        for (i = 0; i < n; i++) {
+            if (ret[i].flags & EV_EOF)
+                err(1, "%s - unexpected EV_EOF", ctx->cur_test_id);
+            if ((int) ret[i].ident == ctx->client_fd && ret[i].data == 1)
+                seen |= 1;
+            else if ((int) ret[i].ident == ctx->server_fd && ret[i].data == 2)
+                seen |= 2;
+            else
+                err(1, "%s - wrong data %d for fd %d", ctx->cur_test_id,
+                        (int) ret[i].data, (int) ret[i].ident);
+        }
+    }
+
+    kevent_socket_drain(ctx);
+    if (recv(ctx->server_fd, buf, 2, 0) < 2)
+        die("recv(2)");
+    close(kqfd);
+}
+#endif
+
+static uint64_t
+kevent_ctl_calls(int kqfd)
+{
+    struct kqueue_stats stats;
+
+    if (kqueue_stats(kqfd, &stats) < 0)
+        die("kqueue_stats");
+    return (stats.ks_ctl_calls);
+}
+
+/*
+ * The kernel disarms a one-shot knote when it fires, so copying it out
+ * and disabling or deleting it takes no system call, and enabling it
+ * again takes one.
+ */
+void
+test_kevent_socket_dispatch_ctl_calls(struct test_context *ctx)
+{
+    struct kevent kev, ret;
+    uint64_t calls;
+    int sv[2], i, kqfd;
+    char buf;
+
+    if ((kqfd = kqueue()) < 0)
+        die("kqueue");
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+        die("socketpair");
+
+    kevent_add(kqfd, &kev, sv[0], EVFILT_READ, EV_ADD | EV_DISPATCH, 0, 0, NULL);
+    for (i = 0; i < 3; i++) {
+        if (write(sv[1], ".", 1) < 1)
+            die("write(2)");
+        calls = kevent_ctl_calls(kqfd);
+        kevent_get(&ret, kqfd);
+        if (read(sv[0], &buf, 1) < 1)
+            die("read(2)");
+        if (kevent_ctl_calls(kqfd) != calls)
+            err(1, "%s - copyout of a dispatched event changed the set", ctx->cur_test_id);
+        kevent_add(kqfd, &kev, sv[0], EVFILT_READ, EV_ENABLE | EV_DISPATCH, 0, 0, NULL);
+        if (kevent_ctl_calls(kqfd) != calls + 1)
+            err(1, "%s - enable took %u changes", ctx->cur_test_id,
+                    (unsigned int) (kevent_ctl_calls(kqfd) - calls));
+    }
+
+    /* Disable and delete a knote that has fired */
+    if (write(sv[1], ".", 1) < 1)
+        die("write(2)");
+    kevent_get(&ret, kqfd);
+    calls = kevent_ctl_calls(kqfd);
+    kevent_add(kqfd, &kev, sv[0], EVFILT_READ, EV_DISABLE, 0, 0, NULL);
+    kevent_add(kqfd, &kev, sv[0], EVFILT_READ, EV_DELETE, 0, 0, NULL);
+    if (kevent_ctl_calls(kqfd) != calls)
+        err(1, "%s - deleting a fired knote changed the set", ctx->cur_test_id);
+
+    /* EV_ONESHOT deletes the knote without a change either */
+    close(sv[0]);
+    close(sv[1]);
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+        die("socketpair");
+    kevent_add(kqfd, &kev, sv[0], EVFILT_READ, EV_ADD | EV_ONESHOT, 0, 0, NULL);
+    if (write(sv[1], ".", 1) < 1)
+        die("write(2)");
+    calls = kevent_ctl_calls(kqfd);
+    kevent_get(&ret, kqfd);
+    if (kevent_ctl_calls(kqfd) != calls)
+        err(1, "%s - copyout of a one-shot event changed the set", ctx->cur_test_id);
+    test_no_kevents(kqfd);
+
+    close(sv[0]);
+    close(sv[1]);
+    close(kqfd);
+}
+#endif
+
+#if defined(__linux__)
+static void *
+add_thread(void *arg)
+{
+    struct test_context *ctx = (struct test_context *) arg;
+    struct kevent kev;
+
+    kevent_add(ctx->kqfd, &kev, ctx->client_fd, EVFILT_READ, EV_ADD, 0, 0, &ctx->client_fd);
+    return (NULL);
+}
+
+/* A knote outlives the thread that added it */
+void
+test_kevent_socket_thread_exit(struct test_context *ctx)
+{
+    struct kevent kev, ret;
+    pthread_t tid;
+
+    if (pthread_create(&tid, NULL, add_thread, ctx) != 0)
+        err(1, "pthread_create");
+    pthread_join(tid, NULL);
+
+    kevent_socket_fill(ctx);
+    kevent_get(&ret, ctx->kqfd);
+    kevent_socket_drain(ctx);
+    kevent_add(ctx->kqfd, &kev, ctx->client_fd, EVFILT_READ, EV_DELETE, 0, 0, &ctx->client_fd);
+    test_no_kevents(ctx->kqfd);
+}
+
+/* Closing a descriptor takes it out of the kqueue, and releases it */
+static void
+test_kevent_socket_close(struct test_context *ctx)
+{
+    struct kevent kev;
+    char buf[1];
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+        die("socketpair");
+    if (fcntl(sv[1], F_SETFL, O_NONBLOCK) < 0)
+        die("fcntl");
+    kevent_add(ctx->kqfd, &kev, sv[0], EVFILT_READ, EV_ADD, 0, 0, NULL);
+
+    close(sv[0]);
+    if (read(sv[1], buf, sizeof(buf)) != 0)
+        err(1, "%s - the peer did not see the close", ctx->cur_test_id);
+
+    kevent_add(ctx->kqfd, &kev, sv[0], EVFILT_READ, EV_DELETE, 0, 0, NULL);
+    test_no_kevents(ctx->kqfd);
+    close(sv[1]);
+}
+
+/* Repeat some of the tests with a kqueue that uses the io_uring backend */
+void
+test_kevent_socket_io_uring(struct test_context *ctx)
+{
+    int kqfd = ctx->kqfd;
+
+    setenv("KQUEUE_BACKEND", "io_uring", 1);
+    ctx->kqfd = kqueue();
+    unsetenv("KQUEUE_BACKEND");
+    if (ctx->kqfd < 0)
+        die("kqueue");
+
+    test_kevent_socket_get(ctx);
+    test_kevent_socket_disable_and_enable(ctx);
+    test_kevent_socket_oneshot(ctx);
+    test_kevent_socket_clear(ctx);
+    test_kevent_socket_dispatch(ctx);
+    test_kevent_socket_read_and_write(ctx);
+    test_kevent_socket_many(ctx);
+    test_kevent_socket_batch(ctx);
+    test_kevent_socket_thread_exit(ctx);
+    test_kevent_socket_close(ctx);
+
+    close(ctx->kqfd);
+    ctx->kqfd = kqfd;
+}
+#endif
+
 void
 test_evfilt_read(struct test_context *ctx)
 {
@@ -435,8 +1183,42 @@ test_evfilt_read(struct test_context *ctx)
     test(kevent_socket_dispatch, ctx);
 #endif
     test(kevent_socket_listen_backlog, ctx);
+    test(kevent_socket_read_and_write, ctx);
+#if defined(__linux__)
+    test(kevent_socket_io_uring, ctx);
+#endif
+    test(kevent_socket_changelist, ctx);
+    test(kevent_socket_many, ctx);
+#ifdef HAVE_KEVENT_BATCH
+    test(kevent_socket_batch, ctx);
+#endif
+#ifdef HAVE_KQUEUE_BUSY_POLL
+    test(kevent_socket_busy_poll, ctx);
+    test(kevent_socket_dispatch_ctl_calls, ctx);
+#endif
+#ifdef NOTE_LOWAT
+    test(kevent_socket_lowat, ctx);
+    test(kevent_socket_lowat_unix, ctx);
+    test(kevent_socket_lowat_write, ctx);
+#endif
+#ifdef NOTE_ACCEPT
+    test(kevent_socket_accept, ctx);
+#endif
+#if defined(NOTE_ACCEPT) && defined(HAVE_KEVENT_BATCH)
+    test(kevent_socket_accept_batch, ctx);
+#endif
+#ifdef NOTE_NODATA
+    test(kevent_socket_nodata, ctx);
+#endif
+#ifdef HAVE_KQUEUE_BATCH_DATA
+    test(kevent_socket_batch_data, ctx);
+#endif
     test(kevent_socket_eof, ctx);
     test(kevent_regular_file, ctx);
+    test(kevent_regular_file_nofd, ctx);
+#if defined(__linux__)
+    test(kevent_regular_file_tail, ctx);
+#endif
     close(ctx->client_fd);
     close(ctx->server_fd);
 }
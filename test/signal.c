@@ -134,6 +134,32 @@ test_kevent_signal_modify(struct test_context *ctx)
     test_kevent_signal_del(ctx);
 }
 
+#ifdef SIGRTMIN
+void
+test_kevent_signal_count(struct test_context *ctx)
+{
+    struct kevent kev, ret;
+    int i;
+
+    signal(SIGRTMIN, SIG_IGN);
+    kevent_add(ctx->kqfd, &kev, SIGRTMIN, EVFILT_SIGNAL, EV_ADD, 0, 0, NULL);
+
+    /* Realtime signals are queued, so every one of them is counted */
+    for (i = 0; i < 3; i++) {
+        if (kill(getpid(), SIGRTMIN) < 0)
+            die("kill");
+    }
+
+    kev.flags |= EV_CLEAR;
+    kev.data = 3;
+    kevent_get(&ret, ctx->kqfd);
+    kevent_cmp(&kev, &ret);
+    test_no_kevents(ctx->kqfd);
+
+    kevent_add(ctx->kqfd, &kev, SIGRTMIN, EVFILT_SIGNAL, EV_DELETE, 0, 0, NULL);
+}
+#endif
+
 #ifdef EV_DISPATCH
 void
 test_kevent_signal_dispatch(struct test_context *ctx)
@@ -188,6 +214,9 @@ test_evfilt_signal(struct test_context *ctx)
     test(kevent_signal_enable, ctx);
     test(kevent_signal_oneshot, ctx);
     test(kevent_signal_modify, ctx);
+#ifdef SIGRTMIN
+    test(kevent_signal_count, ctx);
+#endif
 #ifdef EV_DISPATCH
     test(kevent_signal_dispatch, ctx);
 #endif
@@ -117,6 +117,83 @@ test_kevent_timer_disable_and_enable(struct test_context *ctx)
     kevent_cmp(&kev, &ret);
 }
 
+/* EV_ENABLE on a running timer restarts it */
+static void
+test_kevent_timer_enable_running(struct test_context *ctx)
+{
+    struct kevent kev, ret[2];
+    struct timespec timeo = { 2, 0 };
+    int n, nret;
+
+    test_no_kevents(ctx->kqfd);
+
+    kevent_add(ctx->kqfd, &kev, 6, EVFILT_TIMER, EV_ADD | EV_ONESHOT, 0, 50, NULL);
+    kevent_add(ctx->kqfd, &kev, 7, EVFILT_TIMER, EV_ADD | EV_ONESHOT, 0, 50, NULL);
+    kev.flags = EV_ENABLE;
+    kevent_update(ctx->kqfd, &kev);
+
+    /* Both timers fire once */
+    for (nret = 0; nret < 2; nret += n) {
+        n = kevent(ctx->kqfd, NULL, 0, &ret[nret], 2 - nret, &timeo);
+        if (n < 1)
+            err(1, "%s - %d of 2 timers fired", ctx->cur_test_id, nret);
+    }
+    if (ret[0].ident == ret[1].ident)
+        err(1, "%s - timer %d fired twice", ctx->cur_test_id, (int) ret[0].ident);
+
+    test_no_kevents(ctx->kqfd);
+}
+
+static void
+test_kevent_timer_many(struct test_context *ctx)
+{
+    struct kevent kev[100], ret[100];
+    int i, n, nret;
+
+    test_no_kevents(ctx->kqfd);
+
+    /* Add a batch of one-shot timers with staggered timeouts */
+    for (i = 0; i < 100; i++) 
+        EV_SET(&kev[i], 100 + i, EVFILT_TIMER, EV_ADD | EV_ONESHOT, 0, 10 + (i * 3), NULL);
+    if (kevent(ctx->kqfd, &kev[0], 100, NULL, 0, NULL) < 0)
+        die("kevent");
+
+    /* Each timer must fire exactly once */
+    for (nret = 0; nret < 100; nret += n) {
+        n = kevent(ctx->kqfd, NULL, 0, &ret[0], 100, NULL);
+        if (n < 1)
+            die("kevent");
+        for (i = 0; i < n; i++) {
+            if (ret[i].filter != EVFILT_TIMER || ret[i].ident < 100 
+                    || ret[i].ident >= 200 || ret[i].data != 1)
+                errx(1, "unexpected event: %s", kevent_to_str(&ret[i]));
+        }
+    }
+
+    test_no_kevents(ctx->kqfd);
+}
+
+static void
+test_kevent_timer_modify(struct test_context *ctx)
+{
+    struct kevent kev, ret;
+
+    test_no_kevents(ctx->kqfd);
+
+    kevent_add(ctx->kqfd, &kev, 5, EVFILT_TIMER, EV_ADD | EV_ONESHOT, 0, 1000, NULL);
+
+    /* Re-adding the timer restarts it with the new timeout */
+    usleep(500000);
+    kevent_add(ctx->kqfd, &kev, 5, EVFILT_TIMER, EV_ADD | EV_ONESHOT, 0, 1000, NULL);
+    usleep(700000);
+    test_no_kevents(ctx->kqfd);
+
+    kev.flags = EV_ADD | EV_CLEAR | EV_ONESHOT;
+    kev.data = 1; 
+    kevent_get(&ret, ctx->kqfd);
+    kevent_cmp(&kev, &ret);
+}
+
 #ifdef EV_DISPATCH
 void
 test_kevent_timer_dispatch(struct test_context *ctx)
@@ -155,6 +232,29 @@ test_kevent_timer_dispatch(struct test_context *ctx)
 }
 #endif  /* EV_DISPATCH */
 
+#ifdef HAVE_KEVENT_BATCH
+/* The expirations reported by different waits of a batch are added up */
+static void
+test_kevent_timer_batch(struct test_context *ctx)
+{
+    struct kevent kev, ret[4];
+    struct timespec latency = { 0, 300000000 };
+    int nret;
+
+    kevent_add(ctx->kqfd, &kev, 5, EVFILT_TIMER, EV_ADD, 0, 10, NULL);
+
+    /* Several periods pass before the batch, and at least one during it */
+    usleep(60000);
+    nret = kevent_batch(ctx->kqfd, NULL, 0, ret, 4, 4, NULL, &latency);
+    if (nret != 1 || ret[0].ident != 5 || ret[0].data < 6)
+        err(1, "%s - expected one event with 6 or more expirations, got %d with %d",
+                ctx->cur_test_id, nret, (int) ret[0].data);
+
+    kevent_add(ctx->kqfd, &kev, 5, EVFILT_TIMER, EV_DELETE, 0, 0, NULL);
+    test_no_kevents(ctx->kqfd);
+}
+#endif
+
 void
 test_evfilt_timer(struct test_context *ctx)
 {
@@ -164,7 +264,13 @@ test_evfilt_timer(struct test_context *ctx)
     test(kevent_timer_oneshot, ctx);
     test(kevent_timer_periodic, ctx);
     test(kevent_timer_disable_and_enable, ctx);
+    test(kevent_timer_enable_running, ctx);
+    test(kevent_timer_many, ctx);
+    test(kevent_timer_modify, ctx);
 #ifdef EV_DISPATCH
     test(kevent_timer_dispatch, ctx);
 #endif
+#ifdef HAVE_KEVENT_BATCH
+    test(kevent_timer_batch, ctx);
+#endif
 }
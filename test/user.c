@@ -133,6 +133,189 @@ test_kevent_user_multi_trigger_merged(struct test_context *ctx)
     test_no_kevents(ctx->kqfd);
 }
 
+static void
+test_kevent_user_level_triggered(struct test_context *ctx)
+{
+    struct kevent kev, ret;
+
+    test_no_kevents(ctx->kqfd);
+
+    kevent_add(ctx->kqfd, &kev, 3, EVFILT_USER, EV_ADD, 0, 0, NULL);
+    kevent_add(ctx->kqfd, &kev, 3, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+
+    /* Without EV_CLEAR, the event is returned until it is deleted */
+    kev.flags = 0;
+    kev.fflags &= ~NOTE_FFCTRLMASK;
+    kev.fflags &= ~NOTE_TRIGGER;
+    kevent_get(&ret, ctx->kqfd);
+    kevent_cmp(&kev, &ret);
+    kevent_get(&ret, ctx->kqfd);
+    kevent_cmp(&kev, &ret);
+
+    kevent_add(ctx->kqfd, &kev, 3, EVFILT_USER, EV_DELETE, 0, 0, NULL);
+    test_no_kevents(ctx->kqfd);
+}
+
+static void *
+trigger_thread(void *arg)
+{
+    struct kevent kev;
+
+    usleep(100000);
+    kevent_add(*((int *) arg), &kev, 3, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+    return (NULL);
+}
+
+static void
+test_kevent_user_trigger_from_thread(struct test_context *ctx)
+{
+    struct kevent kev, ret;
+    pthread_t tid;
+
+    test_no_kevents(ctx->kqfd);
+
+    kevent_add(ctx->kqfd, &kev, 3, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
+
+    /* The trigger must wake up a thread that is already waiting */
+    if (pthread_create(&tid, NULL, trigger_thread, &ctx->kqfd) != 0)
+        err(1, "pthread_create");
+    kevent_get(&ret, ctx->kqfd);
+    pthread_join(tid, NULL);
+
+    kev.flags = EV_CLEAR;
+    kevent_cmp(&kev, &ret);
+    test_no_kevents(ctx->kqfd);
+
+    kevent_add(ctx->kqfd, &kev, 3, EVFILT_USER, EV_DELETE, 0, 0, NULL);
+}
+
+static void
+test_kevent_user_many(struct test_context *ctx)
+{
+    struct kevent kev, ret;
+    uintptr_t ident;
+    int i;
+
+    test_no_kevents(ctx->kqfd);
+
+    /* Sparse idents, so that lookups go through the hash table */
+    for (i = 0; i < 1000; i++) {
+        ident = 1000 + (uintptr_t) i * 7919;
+        kevent_add(ctx->kqfd, &kev, ident, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
+    }
+    for (i = 0; i < 1000; i += 2) {
+        ident = 1000 + (uintptr_t) i * 7919;
+        kevent_add(ctx->kqfd, &kev, ident, EVFILT_USER, EV_DELETE, 0, 0, NULL);
+    }
+
+    /* Every remaining knote must still be found */
+    for (i = 1; i < 1000; i += 2) {
+        ident = 1000 + (uintptr_t) i * 7919;
+        kevent_add(ctx->kqfd, &kev, ident, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+        kevent_get(&ret, ctx->kqfd);
+        if (ret.ident != ident)
+            err(1, "%s - wrong ident %u", ctx->cur_test_id, (u_int) ret.ident);
+        kevent_add(ctx->kqfd, &kev, ident, EVFILT_USER, EV_DELETE, 0, 0, NULL);
+    }
+    test_no_kevents(ctx->kqfd);
+}
+
+static void *
+delete_thread(void *arg)
+{
+    struct kevent kev;
+    int kqfd = *((int *) arg);
+    int i;
+
+    for (i = 0; i < 100; i++)
+        kevent_add(kqfd, &kev, 5000 + i, EVFILT_USER, EV_DELETE, 0, 0, NULL);
+    return (NULL);
+}
+
+/* Knotes are recycled through per-kqueue arenas and per-thread caches */
+static void
+test_kevent_user_churn(struct test_context *ctx)
+{
+    struct kevent kev, ret;
+    pthread_t tid;
+    int kqfd2, round, i;
+
+    test_no_kevents(ctx->kqfd);
+
+    if ((kqfd2 = kqueue()) < 0)
+        err(1, "kqueue");
+
+    /* Alternate between two kqueues, so knotes move between arenas */
+    for (round = 0; round < 50; round++) {
+        for (i = 0; i < 100; i++) {
+            kevent_add(ctx->kqfd, &kev, 5000 + i, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
+            kevent_add(kqfd2, &kev, 5000 + i, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
+        }
+        for (i = 0; i < 100; i++) {
+            kevent_add(kqfd2, &kev, 5000 + i, EVFILT_USER, EV_DELETE, 0, 0, NULL);
+            kevent_add(ctx->kqfd, &kev, 5000 + i, EVFILT_USER, EV_DELETE, 0, 0, NULL);
+        }
+    }
+
+    /* Free knotes from a thread other than the one that allocated them */
+    for (i = 0; i < 100; i++)
+        kevent_add(ctx->kqfd, &kev, 5000 + i, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
+    if (pthread_create(&tid, NULL, delete_thread, &ctx->kqfd) != 0)
+        err(1, "pthread_create");
+    pthread_join(tid, NULL);
+
+    /* The recycled knotes must come back clean */
+    kevent_add(ctx->kqfd, &kev, 5000, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, NULL);
+    kevent_add(ctx->kqfd, &kev, 5000, EVFILT_USER, 0, NOTE_TRIGGER, 0, NULL);
+    kevent_get(&ret, ctx->kqfd);
+    if (ret.ident != 5000 || ret.fflags != 0 || ret.data != 0)
+        err(1, "%s - stale knote %s", ctx->cur_test_id, kevent_to_str(&ret));
+    kevent_add(ctx->kqfd, &kev, 5000, EVFILT_USER, EV_DELETE, 0, 0, NULL);
+
+    test_no_kevents(ctx->kqfd);
+    test_no_kevents(kqfd2);
+    close(kqfd2);
+}
+
+static void *
+churn_thread(void *arg)
+{
+    struct kevent kev[2];
+    int kqfd = ((int *) arg)[0];
+    uintptr_t base = 10000 + 1000 * ((int *) arg)[1];
+    int i;
+
+    for (i = 0; i < 2000; i++) {
+        EV_SET(&kev[0], base + (i % 100), EVFILT_USER, EV_ADD, 0, 0, NULL);
+        EV_SET(&kev[1], base + (i % 100), EVFILT_USER, EV_DELETE, 0, 0, NULL);
+        if (kevent(kqfd, &kev[0], 2, NULL, 0, NULL) < 0)
+            err(1, "kevent");
+    }
+    return (NULL);
+}
+
+/* Lookups race with deletions from other threads */
+static void
+test_kevent_user_concurrent_churn(struct test_context *ctx)
+{
+    pthread_t tid[4];
+    int arg[4][2];
+    int i;
+
+    test_no_kevents(ctx->kqfd);
+
+    for (i = 0; i < 4; i++) {
+        arg[i][0] = ctx->kqfd;
+        arg[i][1] = i;
+        if (pthread_create(&tid[i], NULL, churn_thread, arg[i]) != 0)
+            err(1, "pthread_create");
+    }
+    for (i = 0; i < 4; i++)
+        pthread_join(tid[i], NULL);
+
+    test_no_kevents(ctx->kqfd);
+}
+
 #ifdef EV_DISPATCH
 void
 test_kevent_user_dispatch(struct test_context *ctx)
@@ -184,6 +367,11 @@ test_evfilt_user(struct test_context *ctx)
     test(kevent_user_disable_and_enable, ctx);
     test(kevent_user_oneshot, ctx);
     test(kevent_user_multi_trigger_merged, ctx);
+    test(kevent_user_level_triggered, ctx);
+    test(kevent_user_trigger_from_thread, ctx);
+    test(kevent_user_many, ctx);
+    test(kevent_user_churn, ctx);
+    test(kevent_user_concurrent_churn, ctx);
 #ifdef EV_DISPATCH
     test(kevent_user_dispatch, ctx);
 #endif
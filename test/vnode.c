@@ -196,6 +196,60 @@ test_kevent_vnode_disable_and_enable(struct test_context *ctx)
                 test_id, (unsigned int)kev.ident, kev.filter, kev.flags);
 }
 
+/* EV_ENABLE on an active knote leaves its watch alone */
+void
+test_kevent_vnode_enable_active(struct test_context *ctx)
+{
+    struct kevent kev;
+    struct timespec timeo = { 2, 0 };
+    int nfds;
+
+    test_no_kevents(ctx->kqfd);
+
+    kevent_add(ctx->kqfd, &kev, ctx->vnode_fd, EVFILT_VNODE, EV_ADD | EV_CLEAR, NOTE_WRITE, 0, NULL);
+    kev.flags = EV_ENABLE;
+    kevent_update(ctx->kqfd, &kev);
+
+    testfile_write(ctx->testfile);
+    nfds = kevent(ctx->kqfd, NULL, 0, &kev, 1, &timeo);
+    if (nfds != 1 || kev.ident != ctx->vnode_fd || !(kev.fflags & NOTE_WRITE))
+        err(1, "%s - expected a NOTE_WRITE event, got %d events", test_id, nfds);
+
+    kevent_add(ctx->kqfd, &kev, ctx->vnode_fd, EVFILT_VNODE, EV_DELETE, 0, 0, NULL);
+    test_no_kevents(ctx->kqfd);
+}
+
+void
+test_kevent_vnode_shared_watch(struct test_context *ctx)
+{
+    struct kevent kev[2];
+    int fd, nfds;
+
+    test_no_kevents(ctx->kqfd);
+
+    /* Two descriptors for the same file share an inotify watch */
+    if ((fd = open(ctx->testfile, O_RDONLY)) < 0)
+        err(1, "open of %s", ctx->testfile);
+    kevent_add(ctx->kqfd, &kev[0], ctx->vnode_fd, EVFILT_VNODE, EV_ADD | EV_CLEAR, NOTE_ATTRIB, 0, NULL);
+    kevent_add(ctx->kqfd, &kev[1], fd, EVFILT_VNODE, EV_ADD | EV_CLEAR, NOTE_ATTRIB, 0, NULL);
+
+    testfile_touch(ctx->testfile);
+    nfds = kevent(ctx->kqfd, NULL, 0, kev, 2, NULL);
+    if (nfds != 2)
+        err(1, "%s - expected 2 events, got %d", test_id, nfds);
+
+    /* Deleting one knote must not remove the watch of the other */
+    kevent_add(ctx->kqfd, &kev[1], fd, EVFILT_VNODE, EV_DELETE, 0, 0, NULL);
+    close(fd);
+    testfile_touch(ctx->testfile);
+    nfds = kevent(ctx->kqfd, NULL, 0, kev, 2, NULL);
+    if (nfds != 1 || kev[0].ident != ctx->vnode_fd || kev[0].fflags != NOTE_ATTRIB)
+        err(1, "%s - incorrect event after delete", test_id);
+
+    kevent_add(ctx->kqfd, &kev[0], ctx->vnode_fd, EVFILT_VNODE, EV_DELETE, 0, 0, NULL);
+    test_no_kevents(ctx->kqfd);
+}
+
 #ifdef EV_DISPATCH
 void
 test_kevent_vnode_dispatch(struct test_context *ctx)
@@ -259,6 +313,8 @@ test_evfilt_vnode(struct test_context *ctx)
     test(kevent_vnode_add, ctx);
     test(kevent_vnode_del, ctx);
     test(kevent_vnode_disable_and_enable, ctx);
+    test(kevent_vnode_enable_active, ctx);
+    test(kevent_vnode_shared_watch, ctx);
 #ifdef EV_DISPATCH
     test(kevent_vnode_dispatch, ctx);
 #endif